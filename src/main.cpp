@@ -1,6 +1,7 @@
 #include "stdafx.h"
 
 #include "renderer/PathTracer.h"
+#include "renderer/WavefrontPathTracer.h"
 #include "renderer/Camera.h"
 #include "renderer/LinearGammaToonMapper.h"
 #include "scenes/CornellBoxScene.h"
@@ -51,7 +52,7 @@ int main(int argc, char *argv[]) {
   auto hdrSaver = settings->DoSaveHDR() ? std::make_shared<RadianceSaver>(settings) : nullptr;
   auto pngSaver = std::make_shared<PNGSaver>(settings);
 
-  PathTracer::RenderingFinishCallbackFunction callback([&hdrSaver, &pngSaver](int samples, const Color *img, double accumulatedRenderingTime) {
+  Renderer::RenderingFinishCallbackFunction callback([&hdrSaver, &pngSaver](int samples, const Color *img, double accumulatedRenderingTime) {
       // _OɌĂ΂R[obN\bh
       cerr << "save ppm file for sample " << samples << " ..." << endl;
       if (hdrSaver) {
@@ -84,9 +85,22 @@ int main(int argc, char *argv[]) {
   camera.SetAperture(std::shared_ptr<Aperture>(new CircleAperture(1.5)));
 
   // _
-  std::shared_ptr<PathTracer> renderer = std::make_shared<PathTracer>(
-    camera, settings->GetSampleStart(), settings->GetSampleEnd(), settings->GetSampleStep(), settings->GetSuperSamples(), callback);
-  renderer->EnableNextEventEstimation(Utils::parseBoolean(settings->GetRawSetting("next event estimation")));
+  const bool nextEventEstimation = Utils::parseBoolean(settings->GetRawSetting("next event estimation"));
+  std::shared_ptr<Renderer> renderer;
+  if (Utils::tolower(settings->GetRawSetting("renderer")) == "wavefront") {
+    auto wavefront = std::make_shared<WavefrontPathTracer>(
+      camera, settings->GetSampleStart(), settings->GetSampleEnd(), settings->GetSampleStep(), settings->GetSuperSamples(), callback);
+    wavefront->EnableNextEventEstimation(nextEventEstimation);
+    renderer = wavefront;
+  } else {
+    auto pathtracer = std::make_shared<PathTracer>(
+      camera, settings->GetSampleStart(), settings->GetSampleEnd(), settings->GetSampleStep(), settings->GetSuperSamples(), callback);
+    pathtracer->EnableNextEventEstimation(nextEventEstimation);
+    pathtracer->SetSamplerType(Utils::tolower(settings->GetSampler()) == "random" ? Sampler::SAMPLER_TYPE_RANDOM : Sampler::SAMPLER_TYPE_SOBOL);
+    pathtracer->SetAdaptiveSampling(settings->GetAdaptiveErrorThreshold(), settings->GetAdaptiveMinSamples(), settings->DoStopWhenConverged());
+    pathtracer->SetTileScheduling(settings->GetTileSize(), TileScheduler::ParseTileOrder(settings->GetTileOrder()), settings->DoServeTilesCenterOut());
+    renderer = pathtracer;
+  }
 
   // ԊĎăt@CۑCX^X
   FileSaverCallerWithTimer timeSaver(renderer, pngSaver);
@@ -112,6 +126,8 @@ int main(int argc, char *argv[]) {
     return -1;
   }
   std::shared_ptr<Scene> scene = sceneFactory->Create(settings->GetSceneInformation());
+  scene->ConstructLightSampler(LightSampler::ParseSamplingType(settings->GetLightSampling()));
+  scene->SetIBLLookupType(IBL::ParseLookupType(settings->GetIBLLookup()));
 
   clock_t startTime;
 
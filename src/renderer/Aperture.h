@@ -1,7 +1,7 @@
 #pragma once
 
 #include "tools/Vector.h"
-#include "tools/Random.h"
+#include "tools/Sampler.h"
 #include "tools/Constant.h"
 
 namespace OmochiRenderer {
@@ -9,7 +9,7 @@ namespace OmochiRenderer {
   // ĩC^[tF[X
   class Aperture {
   public:
-    virtual void SampleOnePoint(double &sampledX, double &sampledY, const Random &rnd) const = 0;
+    virtual void SampleOnePoint(double &sampledX, double &sampledY, const Sampler &rnd) const = 0;
   };
 
   // ~`̍i
@@ -20,15 +20,18 @@ namespace OmochiRenderer {
     {
     }
 
-    virtual void SampleOnePoint(double &sampledX, double &sampledY, const Random &rnd) const {
+    virtual void SampleOnePoint(double &sampledX, double &sampledY, const Sampler &rnd) const {
       // 1_TvO
       // F(r, ) = /2PI * r^2/R^2
 
+      double u1, u2;
+      rnd.next2D(u1, u2);
+
       // F() = /2PI
-      double theta = 2 * PI * rnd.nextDouble();
+      double theta = 2 * PI * u1;
 
       // F(r) = r^2/R^2
-      double r = m_radius * sqrt(rnd.nextDouble());
+      double r = m_radius * sqrt(u2);
 
       sampledX = r * cos(theta);
       sampledY = r * sin(theta);
@@ -58,7 +58,7 @@ namespace OmochiRenderer {
 
       hit.distance = t;
       hit.normal = m_normal;
-      hit.position = ray.orig + ray.dir * t;
+      hit.position = ray(t);
 
       return true;
     }
@@ -1,7 +1,14 @@
 #include "stdafx.h"
 
 #include "BVH.h"
+#include "TriangleBase.h"
 #include <emmintrin.h>
+#include <malloc.h>
+#include <limits>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <omp.h>
 
 using namespace std;
 
@@ -16,7 +23,7 @@ BVH::~BVH()
   m_root.clear();
 }
 
-bool BVH::CheckIntersection(const Ray &ray, Scene::IntersectionInformation &info) const {
+bool BVH::CheckIntersection(const Ray &ray, SceneIntersectionInformation &info) const {
   info.hit.distance = INF;
   info.object = NULL;
 
@@ -29,26 +36,25 @@ bool BVH::CheckIntersection(const Ray &ray, Scene::IntersectionInformation &info
     }
   };
 
-  std::vector<CheckData> next_list;
-  next_list.reserve(m_root.size());
-  next_list.push_back(CheckData(0, INF));
+  // each node pops one entry and pushes at most two, so the stack never exceeds (max depth + 1) entries.
+  // it is allocated on the stack to avoid a heap allocation for each ray
+  CheckData *next_list = static_cast<CheckData *>(_alloca(sizeof(CheckData) * (m_maxDepth + 1)));
+  size_t next_list_size = 0;
+  next_list[next_list_size++] = CheckData(0, INF);
 
   const float rayDir[3] = {static_cast<float>(ray.dir.x), static_cast<float>(ray.dir.y), static_cast<float>(ray.dir.z)};
   const float rayOrig[3] = {static_cast<float>(ray.orig.x), static_cast<float>(ray.orig.y), static_cast<float>(ray.orig.z)};
 
-  while (!next_list.empty()) {
-    auto nextCheckData = next_list.back();
+  while (next_list_size > 0) {
+    const CheckData nextCheckData = next_list[--next_list_size];
     const BVH_structure *next = &m_root[nextCheckData.index];
-    next_list.pop_back();
 
     if (next->children[0] == -1) {
       // leaf
       HitInformation hit;
-      bool isHit = false;
       for (size_t i=0; next->objects[i]; i++) {
         if (next->objects[i]->CheckIntersection(ray, hit)) {
           if (info.hit.distance > hit.distance) {
-            isHit = true;
             info.hit = hit;
             info.object = next->objects[i];
           }
@@ -69,17 +75,17 @@ bool BVH::CheckIntersection(const Ray &ray, Scene::IntersectionInformation &info
         //cerr << dist1 << "," << dist2 << endl;
         if (dist1 < dist2 && info.hit.distance >= dist1) {
           // check child1 at first
-          next_list.push_back(CheckData(next->children[1], nextCheckData.nextCheckBoundingBoxDist));
-          next_list.push_back(CheckData(next->children[0], dist2));
+          next_list[next_list_size++] = CheckData(next->children[1], nextCheckData.nextCheckBoundingBoxDist);
+          next_list[next_list_size++] = CheckData(next->children[0], dist2);
         } else if (dist1 >= dist2 && info.hit.distance >= dist2) {
           // check child2 at first
-          next_list.push_back(CheckData(next->children[0], nextCheckData.nextCheckBoundingBoxDist));
-          next_list.push_back(CheckData(next->children[1], dist1));
+          next_list[next_list_size++] = CheckData(next->children[0], nextCheckData.nextCheckBoundingBoxDist);
+          next_list[next_list_size++] = CheckData(next->children[1], dist1);
         }
       } else if (hit1) {
-        next_list.push_back(CheckData(next->children[0], nextCheckData.nextCheckBoundingBoxDist));
+        next_list[next_list_size++] = CheckData(next->children[0], nextCheckData.nextCheckBoundingBoxDist);
       } else if (hit2) {
-        next_list.push_back(CheckData(next->children[1], nextCheckData.nextCheckBoundingBoxDist));
+        next_list[next_list_size++] = CheckData(next->children[1], nextCheckData.nextCheckBoundingBoxDist);
       }
     }
   }
@@ -87,6 +93,37 @@ bool BVH::CheckIntersection(const Ray &ray, Scene::IntersectionInformation &info
   return info.hit.distance != INF;
 }
 
+bool BVH::Occluded(const Ray &ray, double maxDistance) const {
+  // any hit closer than maxDistance terminates the traversal, so the children are not ordered
+  unsigned int *indicesStack = static_cast<unsigned int *>(_alloca(sizeof(unsigned int) * (m_maxDepth + 1)));
+  size_t stackSize = 0;
+  indicesStack[stackSize++] = 0;
+
+  const float rayDir[3] = {static_cast<float>(ray.dir.x), static_cast<float>(ray.dir.y), static_cast<float>(ray.dir.z)};
+  const float rayOrig[3] = {static_cast<float>(ray.orig.x), static_cast<float>(ray.orig.y), static_cast<float>(ray.orig.z)};
+
+  while (stackSize > 0) {
+    const BVH_structure *next = &m_root[indicesStack[--stackSize]];
+
+    if (next->children[0] == -1) {
+      // leaf
+      for (size_t i=0; next->objects[i]; i++) {
+        if (next->objects[i]->CheckOcclusion(ray, maxDistance)) return true;
+      }
+    } else {
+      for (int i=0; i<2; i++) {
+        float dist = INF;
+        const BVH_structure *child = &m_root[next->children[i]];
+        if (BoundingBox::CheckIntersection(rayDir, rayOrig, child->box[0], child->box[1], dist) && dist < maxDistance) {
+          indicesStack[stackSize++] = next->children[i];
+        }
+      }
+    }
+  }
+
+  return false;
+}
+
 bool BVH::Construct(const BVH::CONSTRUCTION_TYPE type, const std::vector<SceneObject *> &targets)
 {
   if (targets.size() == 0)
@@ -105,13 +142,39 @@ bool BVH::Construct(const BVH::CONSTRUCTION_TYPE type, const std::vector<SceneOb
   //m_root.reserve(24*targets.size());
   //m_bvh_node_size = targets.size()*targets.size()+1;
   //m_bvh_node_size = 8*targets.size()+1;
-  m_root.push_back(BVH_structure());
+  if (type == CONSTRUCTION_BINNED_SAH) {
+    ConstructBinnedParallel(targets);
+  } else if (type == CONSTRUCTION_SBVH) {
+    ConstructSBVH(targets);
+  } else if (type == CONSTRUCTION_LBVH) {
+    ConstructLBVH(targets);
+  } else {
+    m_root.push_back(BVH_structure());
+    Construct_internal(type, targets, 0);
+  }
 
-  Construct_internal(type, targets, 0);
+  CalcMaxDepth_internal();
 
   return true;
 }
 
+void BVH::CalcMaxDepth_internal()
+{
+  m_maxDepth = 0;
+  std::vector<std::pair<unsigned int, unsigned int> > indicesStack; // (index, depth)
+  indicesStack.push_back(std::make_pair(0u, 0u));
+  while (!indicesStack.empty()) {
+    const std::pair<unsigned int, unsigned int> current = indicesStack.back();
+    indicesStack.pop_back();
+    if (current.second > m_maxDepth) m_maxDepth = current.second;
+    const BVH_structure &node = m_root[current.first];
+    if (node.children[0] != static_cast<unsigned int>(-1)) {
+      indicesStack.push_back(std::make_pair(node.children[0], current.second + 1));
+      indicesStack.push_back(std::make_pair(node.children[1], current.second + 1));
+    }
+  }
+}
+
 namespace {
 void CalcBoundingBoxOfObjects(const std::vector<SceneObject *> &objects, BoundingBox &boxResult)
 {
@@ -270,6 +333,12 @@ void BVH::Construct_internal(const CONSTRUCTION_TYPE type, const std::vector<Sce
         delete[] rightAreas;
       }
         break;
+      case CONSTRUCTION_BINNED_SAH:
+      case CONSTRUCTION_SBVH:
+      case CONSTRUCTION_LBVH:
+        // these are built by their own functions (see Construct) and never reach here
+        assert(false);
+        break;
       }
     }
 
@@ -308,9 +377,917 @@ void BVH::Construct_internal(const CONSTRUCTION_TYPE type, const std::vector<Sce
   }
 
   // constructs children
-  BVH_structure *current = &m_root[index];
-  Construct_internal(type, lefts, current->children[0]);
-  Construct_internal(type, rights, current->children[1]);
+  // (m_root may be reallocated while constructing the first child, so don't keep a pointer to the current node)
+  const unsigned int rightChildIndex = m_root[index].children[1];
+  Construct_internal(type, lefts, m_root[index].children[0]);
+  Construct_internal(type, rights, rightChildIndex);
+}
+
+namespace {
+  void InitializeBox(float box[2][3]) {
+    for (int xyz=0; xyz<3; xyz++) {
+      box[0][xyz] = std::numeric_limits<float>::max();
+      box[1][xyz] = -std::numeric_limits<float>::max();
+    }
+  }
+  void MergeBox(float box[2][3], const float another[2][3]) {
+    for (int xyz=0; xyz<3; xyz++) {
+      box[0][xyz] = std::min(box[0][xyz], another[0][xyz]);
+      box[1][xyz] = std::max(box[1][xyz], another[1][xyz]);
+    }
+  }
+  void MergePoint(float box[2][3], const float point[3]) {
+    for (int xyz=0; xyz<3; xyz++) {
+      box[0][xyz] = std::min(box[0][xyz], point[xyz]);
+      box[1][xyz] = std::max(box[1][xyz], point[xyz]);
+    }
+  }
+
+  // the same formula is used for binning and partitioning so that both agree on every reference
+  inline int ComputeBinIndex(float centroid, float centroidMin, float binScale) {
+    int bin = static_cast<int>((centroid - centroidMin) * binScale);
+    return std::min(std::max(bin, 0), BVH::BINNED_SAH_BIN_COUNT - 1);
+  }
+
+  // [begin, end) is split into chunkCount chunks for parallel loops
+  inline size_t ChunkBegin(size_t begin, size_t end, int chunkCount, int chunk) {
+    return begin + (end - begin) * chunk / chunkCount;
+  }
+
+  struct ReferenceBounds {
+    float box[2][3];
+    float centroidBox[2][3];
+
+    void Initialize() { InitializeBox(box); InitializeBox(centroidBox); }
+    void Merge(const ReferenceBounds &another) { MergeBox(box, another.box); MergeBox(centroidBox, another.centroidBox); }
+    void Accumulate(const std::vector<BVH::BuildReference> &references, size_t begin, size_t end) {
+      for (size_t i=begin; i<end; i++) {
+        MergeBox(box, references[i].box);
+        MergePoint(centroidBox, references[i].centroid);
+      }
+    }
+  };
+
+  // bins of the three axes
+  struct BinSet {
+    float boxes[3][BVH::BINNED_SAH_BIN_COUNT][2][3];
+    size_t counts[3][BVH::BINNED_SAH_BIN_COUNT];
+
+    void Initialize() {
+      for (int axis=0; axis<3; axis++) for (int bin=0; bin<BVH::BINNED_SAH_BIN_COUNT; bin++) {
+        InitializeBox(boxes[axis][bin]);
+        counts[axis][bin] = 0;
+      }
+    }
+    void Merge(const BinSet &another) {
+      for (int axis=0; axis<3; axis++) for (int bin=0; bin<BVH::BINNED_SAH_BIN_COUNT; bin++) {
+        MergeBox(boxes[axis][bin], another.boxes[axis][bin]);
+        counts[axis][bin] += another.counts[axis][bin];
+      }
+    }
+    void Accumulate(const std::vector<BVH::BuildReference> &references, size_t begin, size_t end, const float centroidMin[3], const float binScale[3]) {
+      for (size_t i=begin; i<end; i++) {
+        const BVH::BuildReference &ref = references[i];
+        for (int axis=0; axis<3; axis++) {
+          const int bin = ComputeBinIndex(ref.centroid[axis], centroidMin[axis], binScale[axis]);
+          counts[axis][bin]++;
+          MergeBox(boxes[axis][bin], ref.box);
+        }
+      }
+    }
+  };
+
+  // a split after bin "bin" on "axis"
+  struct SplitCandidate {
+    double cost;
+    int axis, bin;
+    float leftBox[2][3], rightBox[2][3];
+    size_t leftCount, rightCount;
+
+    void Initialize(double maxCost) { cost = maxCost; axis = bin = -1; }
+  };
+
+  // sweeps the bins of one axis and updates "best" if splitting after some bin is cheaper.
+  // enterCounts[i]/exitCounts[i] are the numbers of references starting/ending in bin i
+  // (the same array for object bins, where each reference is in exactly one bin).
+  template <int BIN_COUNT> void FindBestBinSplit(const float binBoxes[BIN_COUNT][2][3], const size_t enterCounts[BIN_COUNT], const size_t exitCounts[BIN_COUNT],
+    int axis, double currentBoxSurfaceInverse, SplitCandidate &best)
+  {
+    const double T_aabb = 1.0; // cost of check intersection of AABB
+    const double T_tri = 1.0; // cost of check intersection of Triangle
+
+    // sweep from right: rightBoxes[i] is the box of bins (i, BIN_COUNT)
+    float rightBoxes[BIN_COUNT][2][3];
+    size_t rightCounts[BIN_COUNT];
+    {
+      float boxTmp[2][3]; InitializeBox(boxTmp);
+      size_t countTmp = 0;
+      for (int bin=BIN_COUNT-1; bin>0; bin--) {
+        MergeBox(boxTmp, binBoxes[bin]);
+        countTmp += exitCounts[bin];
+        memcpy(rightBoxes[bin-1], boxTmp, sizeof(boxTmp));
+        rightCounts[bin-1] = countTmp;
+      }
+    }
+
+    // sweep from left and calc SAH of splitting after each bin
+    float boxTmp[2][3]; InitializeBox(boxTmp);
+    size_t leftCount = 0;
+    for (int bin=0; bin<BIN_COUNT-1; bin++) {
+      MergeBox(boxTmp, binBoxes[bin]);
+      leftCount += enterCounts[bin];
+      if (leftCount == 0 || rightCounts[bin] == 0) continue;
+
+      const double leftArea = BoundingBox::CalcSurfaceArea(boxTmp[0], boxTmp[1]);
+      const double rightArea = BoundingBox::CalcSurfaceArea(rightBoxes[bin][0], rightBoxes[bin][1]);
+      double cost = 2 * T_aabb + (leftArea * leftCount + rightArea * rightCounts[bin])*currentBoxSurfaceInverse * T_tri;
+
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = axis;
+        best.bin = bin;
+        memcpy(best.leftBox, boxTmp, sizeof(boxTmp));
+        memcpy(best.rightBox, rightBoxes[bin], sizeof(best.rightBox));
+        best.leftCount = leftCount;
+        best.rightCount = rightCounts[bin];
+      }
+    }
+  }
+
+  // bounding box of the part of the referenced object in the slab lo <= x[axis] <= hi.
+  // triangles are clipped exactly, other objects just by their boxes.
+  // returns false if nothing is left.
+  bool ClipReference(const BVH::BuildReference &ref, int axis, float lo, float hi, float result[2][3]) {
+    const TriangleBase *triangle = dynamic_cast<const TriangleBase *>(ref.object);
+    if (triangle) {
+      Vector3 origin, edge1, edge2;
+      triangle->GetVertexAndEdges(origin, edge1, edge2);
+      const Vector3 positions[3] = {origin, origin + edge1, origin + edge2};
+      float vertices[3][3];
+      for (int i=0; i<3; i++) {
+        vertices[i][0] = static_cast<float>(positions[i].x);
+        vertices[i][1] = static_cast<float>(positions[i].y);
+        vertices[i][2] = static_cast<float>(positions[i].z);
+      }
+
+      // vertices in the slab and intersections of the edges with both planes
+      InitializeBox(result);
+      for (int i=0; i<3; i++) {
+        const float *v0 = vertices[i], *v1 = vertices[(i+1)%3];
+        if (lo <= v0[axis] && v0[axis] <= hi) MergePoint(result, v0);
+        const float planes[2] = {lo, hi};
+        for (int p=0; p<2; p++) {
+          if ((v0[axis] < planes[p]) == (v1[axis] < planes[p]) || v0[axis] == v1[axis]) continue;
+          const float t = (planes[p] - v0[axis]) / (v1[axis] - v0[axis]);
+          float point[3];
+          for (int xyz=0; xyz<3; xyz++) point[xyz] = v0[xyz] + (v1[xyz] - v0[xyz]) * t;
+          point[axis] = planes[p];
+          MergePoint(result, point);
+        }
+      }
+    } else {
+      memcpy(result, ref.box, sizeof(ref.box));
+    }
+
+    // the reference may already be a clipped part of the object
+    for (int xyz=0; xyz<3; xyz++) {
+      result[0][xyz] = std::max(result[0][xyz], ref.box[0][xyz]);
+      result[1][xyz] = std::min(result[1][xyz], ref.box[1][xyz]);
+    }
+    result[0][axis] = std::max(result[0][axis], lo);
+    result[1][axis] = std::min(result[1][axis], hi);
+    for (int xyz=0; xyz<3; xyz++) {
+      if (result[0][xyz] > result[1][xyz]) return false;
+    }
+    return true;
+  }
+
+  void SetReferenceBox(BVH::BuildReference &ref, const float box[2][3]) {
+    memcpy(ref.box, box, sizeof(ref.box));
+    for (int xyz=0; xyz<3; xyz++) ref.centroid[xyz] = (box[0][xyz] + box[1][xyz]) * 0.5f;
+  }
+
+  double CalcOverlapArea(const float box1[2][3], const float box2[2][3]) {
+    float overlap[2][3];
+    for (int xyz=0; xyz<3; xyz++) {
+      overlap[0][xyz] = std::max(box1[0][xyz], box2[0][xyz]);
+      overlap[1][xyz] = std::min(box1[1][xyz], box2[1][xyz]);
+      if (overlap[0][xyz] > overlap[1][xyz]) return 0.0;
+    }
+    return BoundingBox::CalcSurfaceArea(overlap[0], overlap[1]);
+  }
+
+  // bins of a spatial split: references are clipped into every bin they cross
+  struct SpatialBins {
+    float boxes[BVH::SBVH_SPATIAL_BIN_COUNT][2][3];
+    size_t enterCounts[BVH::SBVH_SPATIAL_BIN_COUNT];
+    size_t exitCounts[BVH::SBVH_SPATIAL_BIN_COUNT];
+
+    void Initialize() {
+      for (int bin=0; bin<BVH::SBVH_SPATIAL_BIN_COUNT; bin++) {
+        InitializeBox(boxes[bin]);
+        enterCounts[bin] = exitCounts[bin] = 0;
+      }
+    }
+  };
+
+  inline int ComputeSpatialBinIndex(float position, float boxMin, float binScale) {
+    int bin = static_cast<int>((position - boxMin) * binScale);
+    return std::min(std::max(bin, 0), BVH::SBVH_SPATIAL_BIN_COUNT - 1);
+  }
+
+  // spreads the lower 21 bits of x to every third bit
+  inline unsigned long long ExpandBitsBy3(unsigned long long x) {
+    x &= 0x1fffffULL;
+    x = (x | x << 32) & 0x1f00000000ffffULL;
+    x = (x | x << 16) & 0x1f0000ff0000ffULL;
+    x = (x | x << 8) & 0x100f00f00f00f00fULL;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+    x = (x | x << 2) & 0x1249249249249249ULL;
+    return x;
+  }
+
+  // 63-bit Morton code of a point normalized to [0, 1]^3. bit 3k+2 is x, 3k+1 is y and 3k is z
+  inline unsigned long long CalcMortonCode(const float normalized[3]) {
+    const float scale = static_cast<float>(1 << 21);
+    unsigned long long quantized[3];
+    for (int xyz=0; xyz<3; xyz++) {
+      quantized[xyz] = static_cast<unsigned long long>(std::min(std::max(normalized[xyz] * scale, 0.0f), scale - 1.0f));
+    }
+    return (ExpandBitsBy3(quantized[0]) << 2) | (ExpandBitsBy3(quantized[1]) << 1) | ExpandBitsBy3(quantized[2]);
+  }
+
+  // index of the highest set bit (x must not be 0)
+  inline int HighestBit(unsigned long long x) {
+    int bit = 0;
+    if (x >> 32) { x >>= 32; bit += 32; }
+    if (x >> 16) { x >>= 16; bit += 16; }
+    if (x >> 8) { x >>= 8; bit += 8; }
+    if (x >> 4) { x >>= 4; bit += 4; }
+    if (x >> 2) { x >>= 2; bit += 2; }
+    if (x >> 1) { bit += 1; }
+    return bit;
+  }
+
+  struct MortonPrimitive {
+    unsigned long long code;
+    unsigned int index;
+  };
+
+  // LSD radix sort by Morton codes, 8 bits per pass.
+  // each pass counts the digits of every chunk in parallel, then scatters the chunks in parallel (stable)
+  void RadixSortMortonPrimitives(std::vector<MortonPrimitive> &primitives, int chunkCount) {
+    const int BITS_PER_PASS = 8;
+    const int BUCKET_COUNT = 1 << BITS_PER_PASS;
+    const size_t count = primitives.size();
+
+    std::vector<MortonPrimitive> buffer(count);
+    std::vector<size_t> offsets(chunkCount * BUCKET_COUNT);
+    for (int shift = 0; shift < 63; shift += BITS_PER_PASS) {
+#pragma omp parallel for
+      for (int chunk=0; chunk<chunkCount; chunk++) {
+        size_t *counts = &offsets[chunk * BUCKET_COUNT];
+        std::fill(counts, counts + BUCKET_COUNT, 0);
+        const size_t chunkEnd = ChunkBegin(0, count, chunkCount, chunk+1);
+        for (size_t i=ChunkBegin(0, count, chunkCount, chunk); i<chunkEnd; i++) {
+          counts[(primitives[i].code >> shift) & (BUCKET_COUNT - 1)]++;
+        }
+      }
+
+      // counts -> offsets, ordered by bucket first and chunk second
+      size_t offset = 0;
+      bool allInOneBucket = false;
+      for (int bucket=0; bucket<BUCKET_COUNT; bucket++) {
+        size_t bucketCount = 0;
+        for (int chunk=0; chunk<chunkCount; chunk++) {
+          const size_t chunkBucketCount = offsets[chunk * BUCKET_COUNT + bucket];
+          offsets[chunk * BUCKET_COUNT + bucket] = offset;
+          offset += chunkBucketCount;
+          bucketCount += chunkBucketCount;
+        }
+        if (bucketCount == count) allInOneBucket = true;
+      }
+      if (allInOneBucket) continue; // this digit is the same for all
+
+#pragma omp parallel for
+      for (int chunk=0; chunk<chunkCount; chunk++) {
+        size_t *chunkOffsets = &offsets[chunk * BUCKET_COUNT];
+        const size_t chunkEnd = ChunkBegin(0, count, chunkCount, chunk+1);
+        for (size_t i=ChunkBegin(0, count, chunkCount, chunk); i<chunkEnd; i++) {
+          buffer[chunkOffsets[(primitives[i].code >> shift) & (BUCKET_COUNT - 1)]++] = primitives[i];
+        }
+      }
+      primitives.swap(buffer);
+    }
+  }
+
+  typedef std::chrono::high_resolution_clock BuildClock;
+  double SecondsBetween(const BuildClock::time_point &from, const BuildClock::time_point &to) {
+    return std::chrono::duration_cast<std::chrono::duration<double> >(to - from).count();
+  }
+}
+
+void BVH::MakeLeafFromReferences_internal(const std::vector<BuildReference> &references, size_t begin, size_t end, int index)
+{
+  std::vector<SceneObject *> targets;
+  targets.reserve(end - begin);
+  for (size_t i=begin; i<end; i++) targets.push_back(references[i].object);
+  MakeLeaf_internal(targets, index);
+
+  // with CONSTRUCTION_SBVH the references may be clipped, so the leaf box is the box of the references, not of the objects
+  float box[2][3]; InitializeBox(box);
+  for (size_t i=begin; i<end; i++) MergeBox(box, references[i].box);
+  memcpy(m_root[index].box, box, sizeof(box));
+}
+
+// Binned SAH construction:
+// 1. the nodes near the root are split one by one, binning and partitioning their references with all threads
+// 2. the remaining subtrees are built by worker threads, each one into its own pre-reserved range of m_root
+// 3. the unused slots of the reserved ranges are removed
+// The resulting tree does not depend on the number of threads.
+void BVH::ConstructBinnedParallel(const std::vector<SceneObject *> &targets)
+{
+  const BuildClock::time_point setupStart = BuildClock::now();
+
+  const size_t count = targets.size();
+  const int threadCount = std::max(1, omp_get_max_threads());
+
+  // a binary tree with N leaves never has more than 2N-1 nodes
+  m_root.clear();
+  m_root.resize(2*count - 1);
+
+  std::vector<BuildReference> references(count);
+#pragma omp parallel for
+  for (int i=0; i<static_cast<int>(count); i++) {
+    BuildReference &ref = references[i];
+    const BoundingBox &box = targets[i]->boundingBox;
+    ref.box[0][0] = static_cast<float>(box.min().x); ref.box[0][1] = static_cast<float>(box.min().y); ref.box[0][2] = static_cast<float>(box.min().z);
+    ref.box[1][0] = static_cast<float>(box.max().x); ref.box[1][1] = static_cast<float>(box.max().y); ref.box[1][2] = static_cast<float>(box.max().z);
+    for (int xyz=0; xyz<3; xyz++) ref.centroid[xyz] = (ref.box[0][xyz] + ref.box[1][xyz]) * 0.5f;
+    ref.object = targets[i];
+  }
+
+  const BuildClock::time_point topLevelStart = BuildClock::now();
+
+  // every node with PARALLEL_BINNING_THRESHOLD or more references is split here regardless of the thread count
+  const size_t taskSize = std::min(PARALLEL_BINNING_THRESHOLD - 1, std::max(MIN_SUBTREE_TASK_SIZE, count / (threadCount * 8)));
+  std::vector<BuildReference> partitionBuffer;
+  if (count >= PARALLEL_BINNING_THRESHOLD) partitionBuffer.resize(count);
+  std::vector<SubtreeTask> tasks;
+  ConstructBinnedTopLevel_internal(references, 0, count, 0, taskSize, partitionBuffer, tasks);
+  partitionBuffer.clear(); partitionBuffer.shrink_to_fit();
+
+  const BuildClock::time_point subtreesStart = BuildClock::now();
+
+  // larger subtrees first, so that the threads finish at nearly the same time
+  std::sort(tasks.begin(), tasks.end(), [](const SubtreeTask &a, const SubtreeTask &b) -> bool {
+    return (a.end - a.begin) > (b.end - b.begin);
+  });
+  std::atomic<size_t> nextTask(0);
+  auto worker = [this, &references, &tasks, &nextTask]() {
+    for (size_t i = nextTask++; i < tasks.size(); i = nextTask++) {
+      ConstructBinned_internal(references, tasks[i].begin, tasks[i].end, tasks[i].index);
+    }
+  };
+  const int workerCount = static_cast<int>(std::min(static_cast<size_t>(threadCount), tasks.size()));
+  std::vector<std::thread> workers;
+  for (int i=1; i<workerCount; i++) workers.push_back(std::thread(worker));
+  worker();
+  for (size_t i=0; i<workers.size(); i++) workers[i].join();
+
+  const BuildClock::time_point compactionStart = BuildClock::now();
+
+  CompactNodes_internal();
+
+  const BuildClock::time_point finished = BuildClock::now();
+
+  cerr << "BVH construction (binned SAH, " << count << " objects, " << threadCount << " threads): "
+    << "setup " << SecondsBetween(setupStart, topLevelStart) << " sec, "
+    << "top levels " << SecondsBetween(topLevelStart, subtreesStart) << " sec, "
+    << tasks.size() << " subtrees " << SecondsBetween(subtreesStart, compactionStart) << " sec, "
+    << "compaction " << SecondsBetween(compactionStart, finished) << " sec, "
+    << "total " << SecondsBetween(setupStart, finished) << " sec" << endl;
+}
+
+void BVH::ConstructBinnedTopLevel_internal(std::vector<BuildReference> &references, size_t begin, size_t end, int index,
+  size_t taskSize, std::vector<BuildReference> &partitionBuffer, std::vector<SubtreeTask> &tasks)
+{
+  if (end - begin <= taskSize) {
+    tasks.push_back(SubtreeTask(begin, end, index));
+    return;
+  }
+
+  size_t middle;
+  if (!SplitBinned_internal(references, begin, end, index, &partitionBuffer, middle)) return;
+
+  ConstructBinnedTopLevel_internal(references, begin, middle, index + 1, taskSize, partitionBuffer, tasks);
+  ConstructBinnedTopLevel_internal(references, middle, end, index + static_cast<int>(2*(middle - begin)), taskSize, partitionBuffer, tasks);
+}
+
+void BVH::ConstructBinned_internal(std::vector<BuildReference> &references, size_t begin, size_t end, int index)
+{
+  size_t middle;
+  if (!SplitBinned_internal(references, begin, end, index, NULL, middle)) return;
+
+  // constructs children
+  ConstructBinned_internal(references, begin, middle, index + 1);
+  ConstructBinned_internal(references, middle, end, index + static_cast<int>(2*(middle - begin)));
+}
+
+// SAH over a fixed number of centroid bins per axis.
+// Unlike Construct_internal, this never sorts nor copies the object list:
+// each node partitions its own range [begin, end) of references in place.
+// Returns false if the node became a leaf.
+bool BVH::SplitBinned_internal(std::vector<BuildReference> &references, size_t begin, size_t end, int index,
+  std::vector<BuildReference> *partitionBuffer, size_t &middle)
+{
+  const double T_tri = 1.0; // cost of check intersection of Triangle
+
+  const size_t count = end - begin;
+  const bool parallel = count >= PARALLEL_BINNING_THRESHOLD;
+  const int chunkCount = parallel ? 4 * std::max(1, omp_get_max_threads()) : 1;
+
+  // calculate this node's bounding box and the bounds of the centroids
+  ReferenceBounds bounds; bounds.Initialize();
+  if (parallel) {
+    std::vector<ReferenceBounds> partialBounds(chunkCount);
+#pragma omp parallel for
+    for (int chunk=0; chunk<chunkCount; chunk++) {
+      partialBounds[chunk].Initialize();
+      partialBounds[chunk].Accumulate(references, ChunkBegin(begin, end, chunkCount, chunk), ChunkBegin(begin, end, chunkCount, chunk+1));
+    }
+    for (int chunk=0; chunk<chunkCount; chunk++) bounds.Merge(partialBounds[chunk]);
+  } else {
+    bounds.Accumulate(references, begin, end);
+  }
+  for (int xyz=0; xyz<3; xyz++) {
+    m_root[index].box[0][xyz] = bounds.box[0][xyz];
+    m_root[index].box[1][xyz] = bounds.box[1][xyz];
+  }
+
+  if (count == 1) {
+    MakeLeafFromReferences_internal(references, begin, end, index);
+    return false;
+  }
+
+  float centroidMin[3], binScale[3];
+  for (int axis=0; axis<3; axis++) {
+    const float extent = bounds.centroidBox[1][axis] - bounds.centroidBox[0][axis];
+    centroidMin[axis] = bounds.centroidBox[0][axis];
+    binScale[axis] = extent > 0.0f ? BINNED_SAH_BIN_COUNT / extent : 0.0f;
+  }
+
+  BinSet bins; bins.Initialize();
+  if (parallel) {
+    std::vector<BinSet> partialBins(chunkCount);
+#pragma omp parallel for
+    for (int chunk=0; chunk<chunkCount; chunk++) {
+      partialBins[chunk].Initialize();
+      partialBins[chunk].Accumulate(references, ChunkBegin(begin, end, chunkCount, chunk), ChunkBegin(begin, end, chunkCount, chunk+1), centroidMin, binScale);
+    }
+    for (int chunk=0; chunk<chunkCount; chunk++) bins.Merge(partialBins[chunk]);
+  } else {
+    bins.Accumulate(references, begin, end, centroidMin, binScale);
+  }
+
+  const double currentBoxSurfaceInverse = 1.0 / BoundingBox::CalcSurfaceArea(bounds.box[0], bounds.box[1]);
+
+  SplitCandidate best;
+  best.Initialize(T_tri * count); // a split must be cheaper than a leaf
+  for (int axis = 0; axis < 3; axis++) {
+    if (binScale[axis] == 0.0f) continue; // all centroids are on the same plane
+    FindBestBinSplit<BINNED_SAH_BIN_COUNT>(bins.boxes[axis], bins.counts[axis], bins.counts[axis], axis, currentBoxSurfaceInverse, best);
+  }
+  const int bestAxis = best.axis;
+  const int bestBin = best.bin;
+
+  if (bestAxis == -1) {
+    // make leaf
+    MakeLeafFromReferences_internal(references, begin, end, index);
+    return false;
+  }
+
+  // partition the references
+  const float axisCentroidMin = centroidMin[bestAxis];
+  const float axisBinScale = binScale[bestAxis];
+  auto isLeft = [bestAxis, bestBin, axisCentroidMin, axisBinScale](const BuildReference &ref) -> bool {
+    return ComputeBinIndex(ref.centroid[bestAxis], axisCentroidMin, axisBinScale) <= bestBin;
+  };
+  if (parallel && partitionBuffer) {
+    // stable partition through the buffer: count the left references of each chunk, then scatter
+    std::vector<size_t> leftCounts(chunkCount, 0), leftOffsets(chunkCount), rightOffsets(chunkCount);
+#pragma omp parallel for
+    for (int chunk=0; chunk<chunkCount; chunk++) {
+      const size_t chunkEnd = ChunkBegin(begin, end, chunkCount, chunk+1);
+      for (size_t i=ChunkBegin(begin, end, chunkCount, chunk); i<chunkEnd; i++) {
+        if (isLeft(references[i])) leftCounts[chunk]++;
+      }
+    }
+    size_t totalLeftCount = 0;
+    for (int chunk=0; chunk<chunkCount; chunk++) totalLeftCount += leftCounts[chunk];
+    size_t leftOffset = begin, rightOffset = begin + totalLeftCount;
+    for (int chunk=0; chunk<chunkCount; chunk++) {
+      leftOffsets[chunk] = leftOffset;
+      rightOffsets[chunk] = rightOffset;
+      const size_t chunkSize = ChunkBegin(begin, end, chunkCount, chunk+1) - ChunkBegin(begin, end, chunkCount, chunk);
+      leftOffset += leftCounts[chunk];
+      rightOffset += chunkSize - leftCounts[chunk];
+    }
+    std::vector<BuildReference> &buffer = *partitionBuffer;
+#pragma omp parallel for
+    for (int chunk=0; chunk<chunkCount; chunk++) {
+      size_t l = leftOffsets[chunk], r = rightOffsets[chunk];
+      const size_t chunkEnd = ChunkBegin(begin, end, chunkCount, chunk+1);
+      for (size_t i=ChunkBegin(begin, end, chunkCount, chunk); i<chunkEnd; i++) {
+        if (isLeft(references[i])) buffer[l++] = references[i];
+        else buffer[r++] = references[i];
+      }
+    }
+#pragma omp parallel for
+    for (int chunk=0; chunk<chunkCount; chunk++) {
+      std::copy(buffer.begin() + ChunkBegin(begin, end, chunkCount, chunk), buffer.begin() + ChunkBegin(begin, end, chunkCount, chunk+1),
+        references.begin() + ChunkBegin(begin, end, chunkCount, chunk));
+    }
+    middle = begin + totalLeftCount;
+  } else {
+    middle = std::partition(references.begin() + begin, references.begin() + end, isLeft) - references.begin();
+  }
+  assert (begin < middle && middle < end);
+
+  // the left subtree takes at most 2*(middle-begin)-1 nodes just after this node
+  m_root[index].axis = bestAxis;
+  m_root[index].children[0] = index + 1;
+  m_root[index].children[1] = index + static_cast<int>(2*(middle - begin));
+  return true;
+}
+
+// Spatial split BVH (Stich et al. 2009):
+// in addition to the binned object splits, a node may be split by a plane clipping the objects crossing it,
+// which cuts down the overlap of the children boxes around long, thin polygons.
+// An object crossing the plane gets a reference in both children, at most SBVH_MAX_DUPLICATION_PERCENT% more in total.
+void BVH::ConstructSBVH(const std::vector<SceneObject *> &targets)
+{
+  const BuildClock::time_point start = BuildClock::now();
+
+  const size_t count = targets.size();
+  std::vector<BuildReference> references(count);
+  for (size_t i=0; i<count; i++) {
+    const BoundingBox &box = targets[i]->boundingBox;
+    const float refBox[2][3] = {
+      {static_cast<float>(box.min().x), static_cast<float>(box.min().y), static_cast<float>(box.min().z)},
+      {static_cast<float>(box.max().x), static_cast<float>(box.max().y), static_cast<float>(box.max().z)}
+    };
+    SetReferenceBox(references[i], refBox);
+    references[i].object = targets[i];
+  }
+
+  const size_t maxDuplication = count * SBVH_MAX_DUPLICATION_PERCENT / 100;
+  size_t duplicationBudget = maxDuplication;
+
+  m_root.clear();
+  m_root.reserve(2*count);
+  m_root.push_back(BVH_structure());
+
+  ReferenceBounds bounds; bounds.Initialize();
+  bounds.Accumulate(references, 0, count);
+  ConstructSBVH_internal(references, 0, duplicationBudget, BoundingBox::CalcSurfaceArea(bounds.box[0], bounds.box[1]));
+
+  cerr << "BVH construction (SBVH, " << count << " objects): "
+    << (maxDuplication - duplicationBudget) << " references added, "
+    << m_root.size() << " nodes, "
+    << SecondsBetween(start, BuildClock::now()) << " sec" << endl;
+}
+
+void BVH::ConstructSBVH_internal(std::vector<BuildReference> &references, int index, size_t &duplicationBudget, double rootSurfaceArea)
+{
+  const double T_tri = 1.0; // cost of check intersection of Triangle
+  // spatial splits are tried only when the children of the best object split overlap more than this (relative to the root)
+  const double SPATIAL_SPLIT_OVERLAP_THRESHOLD = 1.0e-5;
+
+  const size_t count = references.size();
+
+  // calculate this node's bounding box and the bounds of the centroids
+  ReferenceBounds bounds; bounds.Initialize();
+  bounds.Accumulate(references, 0, count);
+  memcpy(m_root[index].box, bounds.box, sizeof(bounds.box));
+
+  if (count == 1) {
+    MakeLeafFromReferences_internal(references, 0, count, index);
+    return;
+  }
+
+  const double currentBoxSurface = BoundingBox::CalcSurfaceArea(bounds.box[0], bounds.box[1]);
+  const double currentBoxSurfaceInverse = 1.0 / currentBoxSurface;
+
+  // object split
+  float centroidMin[3], binScale[3];
+  for (int axis=0; axis<3; axis++) {
+    const float extent = bounds.centroidBox[1][axis] - bounds.centroidBox[0][axis];
+    centroidMin[axis] = bounds.centroidBox[0][axis];
+    binScale[axis] = extent > 0.0f ? BINNED_SAH_BIN_COUNT / extent : 0.0f;
+  }
+  BinSet bins; bins.Initialize();
+  bins.Accumulate(references, 0, count, centroidMin, binScale);
+
+  SplitCandidate objectSplit;
+  objectSplit.Initialize(T_tri * count); // a split must be cheaper than a leaf
+  for (int axis = 0; axis < 3; axis++) {
+    if (binScale[axis] == 0.0f) continue;
+    FindBestBinSplit<BINNED_SAH_BIN_COUNT>(bins.boxes[axis], bins.counts[axis], bins.counts[axis], axis, currentBoxSurfaceInverse, objectSplit);
+  }
+
+  // spatial split
+  SplitCandidate spatialSplit;
+  spatialSplit.Initialize(objectSplit.cost); // must be cheaper than the object split
+  float spatialBinScale[3] = {0.0f, 0.0f, 0.0f};
+  if (duplicationBudget > 0 &&
+    (objectSplit.axis == -1 || CalcOverlapArea(objectSplit.leftBox, objectSplit.rightBox) > SPATIAL_SPLIT_OVERLAP_THRESHOLD * rootSurfaceArea))
+  {
+    for (int axis = 0; axis < 3; axis++) {
+      const float boxMin = bounds.box[0][axis];
+      const float extent = bounds.box[1][axis] - boxMin;
+      if (extent <= 0.0f) continue;
+      spatialBinScale[axis] = SBVH_SPATIAL_BIN_COUNT / extent;
+      const float binWidth = extent / SBVH_SPATIAL_BIN_COUNT;
+
+      SpatialBins spatialBins; spatialBins.Initialize();
+      for (size_t i=0; i<count; i++) {
+        const BuildReference &ref = references[i];
+        const int enterBin = ComputeSpatialBinIndex(ref.box[0][axis], boxMin, spatialBinScale[axis]);
+        const int exitBin = ComputeSpatialBinIndex(ref.box[1][axis], boxMin, spatialBinScale[axis]);
+        spatialBins.enterCounts[enterBin]++;
+        spatialBins.exitCounts[exitBin]++;
+        if (enterBin == exitBin) {
+          MergeBox(spatialBins.boxes[enterBin], ref.box);
+          continue;
+        }
+        for (int bin=enterBin; bin<=exitBin; bin++) {
+          float clipped[2][3];
+          if (ClipReference(ref, axis, boxMin + binWidth * bin, boxMin + binWidth * (bin+1), clipped)) {
+            MergeBox(spatialBins.boxes[bin], clipped);
+          }
+        }
+      }
+      FindBestBinSplit<SBVH_SPATIAL_BIN_COUNT>(spatialBins.boxes, spatialBins.enterCounts, spatialBins.exitCounts, axis, currentBoxSurfaceInverse, spatialSplit);
+    }
+  }
+
+  std::vector<BuildReference> lefts, rights;
+  int splitAxis = -1;
+
+  if (spatialSplit.axis != -1) {
+    const int axis = spatialSplit.axis;
+    const float boxMin = bounds.box[0][axis];
+    const float plane = boxMin + (bounds.box[1][axis] - boxMin) / SBVH_SPATIAL_BIN_COUNT * (spatialSplit.bin + 1);
+    const double leftArea = BoundingBox::CalcSurfaceArea(spatialSplit.leftBox[0], spatialSplit.leftBox[1]);
+    const double rightArea = BoundingBox::CalcSurfaceArea(spatialSplit.rightBox[0], spatialSplit.rightBox[1]);
+    size_t leftCount = spatialSplit.leftCount, rightCount = spatialSplit.rightCount;
+    size_t addedReferences = 0;
+
+    lefts.reserve(leftCount); rights.reserve(rightCount);
+    for (size_t i=0; i<count; i++) {
+      const BuildReference &ref = references[i];
+      const int enterBin = ComputeSpatialBinIndex(ref.box[0][axis], boxMin, spatialBinScale[axis]);
+      const int exitBin = ComputeSpatialBinIndex(ref.box[1][axis], boxMin, spatialBinScale[axis]);
+      if (exitBin <= spatialSplit.bin) { lefts.push_back(ref); continue; }
+      if (enterBin > spatialSplit.bin) { rights.push_back(ref); continue; }
+
+      // the reference crosses the plane: split it, or put it into one side if that is cheaper ("unsplitting")
+      float leftUnion[2][3], rightUnion[2][3];
+      memcpy(leftUnion, spatialSplit.leftBox, sizeof(leftUnion)); MergeBox(leftUnion, ref.box);
+      memcpy(rightUnion, spatialSplit.rightBox, sizeof(rightUnion)); MergeBox(rightUnion, ref.box);
+      const double splitCost = leftArea * leftCount + rightArea * rightCount;
+      const double leftOnlyCost = BoundingBox::CalcSurfaceArea(leftUnion[0], leftUnion[1]) * leftCount + rightArea * (static_cast<double>(rightCount) - 1);
+      const double rightOnlyCost = leftArea * (static_cast<double>(leftCount) - 1) + BoundingBox::CalcSurfaceArea(rightUnion[0], rightUnion[1]) * rightCount;
+
+      float leftBox[2][3], rightBox[2][3];
+      if (splitCost < std::min(leftOnlyCost, rightOnlyCost) && addedReferences < duplicationBudget &&
+        ClipReference(ref, axis, -std::numeric_limits<float>::max(), plane, leftBox) &&
+        ClipReference(ref, axis, plane, std::numeric_limits<float>::max(), rightBox))
+      {
+        lefts.push_back(ref); SetReferenceBox(lefts.back(), leftBox);
+        rights.push_back(ref); SetReferenceBox(rights.back(), rightBox);
+        addedReferences++;
+      } else if (leftOnlyCost < rightOnlyCost) {
+        lefts.push_back(ref);
+        rightCount--;
+      } else {
+        rights.push_back(ref);
+        leftCount--;
+      }
+    }
+
+    if (!lefts.empty() && !rights.empty()) {
+      splitAxis = axis;
+      duplicationBudget -= addedReferences;
+    } else {
+      // unsplitting moved everything into one side
+      lefts.clear(); rights.clear();
+    }
+  }
+
+  if (splitAxis == -1 && objectSplit.axis != -1) {
+    const int axis = objectSplit.axis;
+    lefts.reserve(objectSplit.leftCount); rights.reserve(objectSplit.rightCount);
+    for (size_t i=0; i<count; i++) {
+      if (ComputeBinIndex(references[i].centroid[axis], centroidMin[axis], binScale[axis]) <= objectSplit.bin) {
+        lefts.push_back(references[i]);
+      } else {
+        rights.push_back(references[i]);
+      }
+    }
+    splitAxis = axis;
+  }
+
+  if (splitAxis == -1) {
+    // make leaf
+    MakeLeafFromReferences_internal(references, 0, count, index);
+    return;
+  }
+
+  // the references of this node are not needed any more
+  std::vector<BuildReference>().swap(references);
+
+  m_root[index].axis = splitAxis;
+  const int leftChildIndex = static_cast<int>(m_root.size());
+  const int rightChildIndex = leftChildIndex + 1;
+  m_root[index].children[0] = leftChildIndex;
+  m_root[index].children[1] = rightChildIndex;
+  m_root.push_back(BVH_structure()); m_root.push_back(BVH_structure());
+
+  // constructs children
+  ConstructSBVH_internal(lefts, leftChildIndex, duplicationBudget, rootSurfaceArea);
+  ConstructSBVH_internal(rights, rightChildIndex, duplicationBudget, rootSurfaceArea);
+}
+
+// Linear BVH (Karras 2012 / Lauterbach et al. 2009):
+// the objects are sorted along a Morton curve of their centroids,
+// and each node is split where the highest differing bit of the Morton codes in its range changes.
+// The splits are found in one pass over the adjacent codes, so the hierarchy is emitted in linear time.
+// Much faster to build than the SAH trees, at the cost of the tree quality.
+void BVH::ConstructLBVH(const std::vector<SceneObject *> &targets)
+{
+  const BuildClock::time_point start = BuildClock::now();
+
+  const size_t count = targets.size();
+  const bool parallel = count >= PARALLEL_BINNING_THRESHOLD;
+  const int chunkCount = parallel ? std::max(1, omp_get_max_threads()) : 1;
+
+  std::vector<BuildReference> references(count);
+  ReferenceBounds bounds; bounds.Initialize();
+  {
+    std::vector<ReferenceBounds> partialBounds(chunkCount);
+#pragma omp parallel for if (parallel)
+    for (int chunk=0; chunk<chunkCount; chunk++) {
+      partialBounds[chunk].Initialize();
+      const size_t chunkEnd = ChunkBegin(0, count, chunkCount, chunk+1);
+      for (size_t i=ChunkBegin(0, count, chunkCount, chunk); i<chunkEnd; i++) {
+        BuildReference &ref = references[i];
+        const BoundingBox &box = targets[i]->boundingBox;
+        ref.box[0][0] = static_cast<float>(box.min().x); ref.box[0][1] = static_cast<float>(box.min().y); ref.box[0][2] = static_cast<float>(box.min().z);
+        ref.box[1][0] = static_cast<float>(box.max().x); ref.box[1][1] = static_cast<float>(box.max().y); ref.box[1][2] = static_cast<float>(box.max().z);
+        for (int xyz=0; xyz<3; xyz++) ref.centroid[xyz] = (ref.box[0][xyz] + ref.box[1][xyz]) * 0.5f;
+        ref.object = targets[i];
+      }
+      partialBounds[chunk].Accumulate(references, ChunkBegin(0, count, chunkCount, chunk), chunkEnd);
+    }
+    for (int chunk=0; chunk<chunkCount; chunk++) bounds.Merge(partialBounds[chunk]);
+  }
+
+  // Morton codes of the centroids
+  std::vector<MortonPrimitive> primitives(count);
+  float centroidMin[3], centroidScale[3];
+  for (int xyz=0; xyz<3; xyz++) {
+    const float extent = bounds.centroidBox[1][xyz] - bounds.centroidBox[0][xyz];
+    centroidMin[xyz] = bounds.centroidBox[0][xyz];
+    centroidScale[xyz] = extent > 0.0f ? 1.0f / extent : 0.0f;
+  }
+#pragma omp parallel for if (parallel)
+  for (int i=0; i<static_cast<int>(count); i++) {
+    float normalized[3];
+    for (int xyz=0; xyz<3; xyz++) normalized[xyz] = (references[i].centroid[xyz] - centroidMin[xyz]) * centroidScale[xyz];
+    primitives[i].code = CalcMortonCode(normalized);
+    primitives[i].index = static_cast<unsigned int>(i);
+  }
+
+  const BuildClock::time_point sortStart = BuildClock::now();
+
+  RadixSortMortonPrimitives(primitives, chunkCount);
+
+  std::vector<BuildReference> sortedReferences(count);
+#pragma omp parallel for if (parallel)
+  for (int i=0; i<static_cast<int>(count); i++) {
+    sortedReferences[i] = references[primitives[i].index];
+  }
+
+  const BuildClock::time_point hierarchyStart = BuildClock::now();
+
+  // the level of a split is the highest differing bit of the two codes (+64), or of the two indices if the codes are equal,
+  // so that the runs of equal codes are split after everything else (Karras 2012).
+  // a range splits at its highest level, so the splits form a Cartesian tree of the levels (the highest at the root),
+  // which is built in one pass with a stack
+  const unsigned int INVALID_SPLIT = static_cast<unsigned int>(-1);
+  std::vector<LBVHSplit> splits(count > 0 ? count - 1 : 0);
+  std::vector<unsigned int> splitStack;
+  for (size_t i=0; i<splits.size(); i++) {
+    LBVHSplit &split = splits[i];
+    const unsigned long long differentBits = primitives[i].code ^ primitives[i+1].code;
+    if (differentBits != 0) {
+      const int highestBit = HighestBit(differentBits);
+      split.level = 64 + highestBit;
+      split.axis = 2 - highestBit % 3;
+    } else {
+      split.level = HighestBit(static_cast<unsigned long long>(i ^ (i+1)));
+      split.axis = 0;
+    }
+    split.children[0] = split.children[1] = INVALID_SPLIT;
+    while (!splitStack.empty() && splits[splitStack.back()].level < split.level) {
+      split.children[0] = splitStack.back();
+      splitStack.pop_back();
+    }
+    if (!splitStack.empty()) splits[splitStack.back()].children[1] = static_cast<unsigned int>(i);
+    splitStack.push_back(static_cast<unsigned int>(i));
+  }
+
+  m_root.clear();
+  m_root.reserve(2*count / LBVH_MAX_LEAF_COUNT + 1);
+  ConstructLBVH_internal(sortedReferences, splits, 0, count, splitStack.empty() ? 0 : splitStack.front());
+
+  const BuildClock::time_point finished = BuildClock::now();
+
+  cerr << "BVH construction (LBVH, " << count << " objects, " << chunkCount << " threads): "
+    << "Morton codes " << SecondsBetween(start, sortStart) << " sec, "
+    << "sort " << SecondsBetween(sortStart, hierarchyStart) << " sec, "
+    << "hierarchy " << SecondsBetween(hierarchyStart, finished) << " sec, "
+    << "total " << SecondsBetween(start, finished) << " sec" << endl;
+}
+
+// emits the subtree of the Morton-sorted references [begin, end) in pre-order and returns the index of its root.
+// split is the highest split in the range
+int BVH::ConstructLBVH_internal(const std::vector<BuildReference> &references, const std::vector<LBVHSplit> &splits, size_t begin, size_t end, size_t split)
+{
+  const int index = static_cast<int>(m_root.size());
+  m_root.push_back(BVH_structure());
+
+  if (end - begin <= static_cast<size_t>(LBVH_MAX_LEAF_COUNT)) {
+    MakeLeafFromReferences_internal(references, begin, end, index);
+    return index;
+  }
+
+  const LBVHSplit &current_split = splits[split];
+  const size_t middle = split + 1;
+  const int leftChildIndex = ConstructLBVH_internal(references, splits, begin, middle, current_split.children[0]);
+  const int rightChildIndex = ConstructLBVH_internal(references, splits, middle, end, current_split.children[1]);
+
+  BVH_structure &current = m_root[index];
+  current.axis = current_split.axis;
+  current.children[0] = leftChildIndex;
+  current.children[1] = rightChildIndex;
+  memcpy(current.box, m_root[leftChildIndex].box, sizeof(current.box));
+  MergeBox(current.box, m_root[rightChildIndex].box);
+  return index;
+}
+
+// removes the unused nodes of the ranges reserved by ConstructBinnedParallel
+void BVH::CompactNodes_internal()
+{
+  const unsigned int INVALID_INDEX = static_cast<unsigned int>(-1);
+
+  std::vector<unsigned int> newIndices(m_root.size(), INVALID_INDEX);
+  std::vector<unsigned int> indicesStack;
+  indicesStack.push_back(0);
+  while (!indicesStack.empty()) {
+    const unsigned int index = indicesStack.back();
+    indicesStack.pop_back();
+    newIndices[index] = 0; // reachable
+    if (m_root[index].children[0] != INVALID_INDEX) {
+      indicesStack.push_back(m_root[index].children[0]);
+      indicesStack.push_back(m_root[index].children[1]);
+    }
+  }
+
+  unsigned int usedNodeCount = 0;
+  for (size_t i=0; i<m_root.size(); i++) {
+    if (newIndices[i] != INVALID_INDEX) newIndices[i] = usedNodeCount++;
+  }
+
+  // nodes are in pre-order, so every node moves toward the front into a free (or already moved) slot
+  for (size_t i=0; i<m_root.size(); i++) {
+    if (newIndices[i] == INVALID_INDEX) continue;
+    BVH_structure &node = m_root[i];
+    if (node.children[0] != INVALID_INDEX) {
+      node.children[0] = newIndices[node.children[0]];
+      node.children[1] = newIndices[node.children[1]];
+    }
+    if (newIndices[i] == i) continue;
+    BVH_structure &target = m_root[newIndices[i]];
+    memcpy(target.box, node.box, sizeof(node.box));
+    target.children[0] = node.children[0];
+    target.children[1] = node.children[1];
+    target.axis = node.axis;
+    target.objects.swap(node.objects);
+  }
+  m_root.resize(usedNodeCount);
 }
 
 void BVH::CollectBoundingBoxes(int depth, std::vector<BoundingBox> &result)
@@ -348,6 +1325,10 @@ size_t BVH::GetBVHNodeCount() const {
   return m_root.size();
 }
 
+unsigned int BVH::GetMaxDepth() const {
+  return m_maxDepth;
+}
+
 const BVH::BVH_structure *BVH::GetFirstChild(const BVH::BVH_structure *parent) const {
   assert (parent);
   if (IsLeaf(parent)) return NULL;
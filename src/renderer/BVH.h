@@ -2,7 +2,7 @@
 #pragma once
 
 #include <vector>
-#include "scenes/Scene.h"
+#include "scenes/IntersectionInformation.h"
 #include "SceneObject.h"
 
 namespace OmochiRenderer {
@@ -12,10 +12,23 @@ public:
   enum CONSTRUCTION_TYPE {
     CONSTRUCTION_OBJECT_MEDIAN,
     CONSTRUCTION_OBJECT_SAH,
+    CONSTRUCTION_BINNED_SAH,
+    CONSTRUCTION_SBVH,
+    CONSTRUCTION_LBVH,
   };
 
 public:
   static const int MAX_LEAF_COUNT_IN_ONE_BVH_NODE = 22;
+  static const int BINNED_SAH_BIN_COUNT = 16;
+  // CONSTRUCTION_BINNED_SAH: nodes with more objects than this are binned and partitioned by all threads
+  static const size_t PARALLEL_BINNING_THRESHOLD = 64 * 1024;
+  // CONSTRUCTION_BINNED_SAH: subtrees smaller than this are never handed to another thread
+  static const size_t MIN_SUBTREE_TASK_SIZE = 1024;
+  // CONSTRUCTION_SBVH: bins of spatial splits, and how many references may be added by splitting objects (percent of the objects)
+  static const int SBVH_SPATIAL_BIN_COUNT = 32;
+  static const int SBVH_MAX_DUPLICATION_PERCENT = 30;
+  // CONSTRUCTION_LBVH: ranges of Morton-sorted objects at most this size become leaves
+  static const int LBVH_MAX_LEAF_COUNT = 4;
 
   class BVH_structure {
   public:
@@ -30,17 +43,35 @@ public:
     BVH_structure() : objects() {}
   };
 
+  // an object referenced while constructing with CONSTRUCTION_BINNED_SAH/CONSTRUCTION_SBVH.
+  // with CONSTRUCTION_SBVH, one object may have several references whose boxes are clipped parts of the object's box
+  struct BuildReference {
+    float box[2][3];
+    float centroid[3];
+    SceneObject *object;
+  };
+
+  // for CONSTRUCTION_LBVH: the split between the Morton-sorted references i and i+1
+  struct LBVHSplit {
+    int level;                // a range is split at its highest level first
+    int axis;
+    unsigned int children[2]; // the splits of the two sub-ranges (-1 for a range of one reference)
+  };
+
 public:
-  explicit BVH() : m_root() {}
+  explicit BVH() : m_root(), m_maxDepth(0) {}
   ~BVH();
 
   bool Construct(const CONSTRUCTION_TYPE type, const std::vector<SceneObject *> &targets);
-  bool CheckIntersection(const Ray &ray, Scene::IntersectionInformation &info) const;
+  bool CheckIntersection(const Ray &ray, SceneIntersectionInformation &info) const;
+  // true if anything is hit closer than maxDistance (for shadow rays)
+  bool Occluded(const Ray &ray, double maxDistance) const;
 
   void CollectBoundingBoxes(int depth, std::vector<BoundingBox> &result); // for Visualization
 
   const BVH_structure *GetRootNode() const;
   size_t GetBVHNodeCount() const;
+  unsigned int GetMaxDepth() const; // the root is at depth 0
   const BVH_structure *GetFirstChild(const BVH_structure *parent) const;
   const BVH_structure *GetSecondChild(const BVH_structure *parent) const;
   bool IsLeaf(const BVH_structure *node) const;
@@ -49,9 +80,37 @@ private:
   void Construct_internal(const CONSTRUCTION_TYPE type, const std::vector<SceneObject *> &targets, int index);
   void MakeLeaf_internal(const std::vector<SceneObject *> &targets, int index);
 
+  // for CONSTRUCTION_BINNED_SAH
+  struct SubtreeTask {
+    SubtreeTask(size_t begin_, size_t end_, int index_) : begin(begin_), end(end_), index(index_) {}
+    size_t begin, end;
+    int index;
+  };
+  // nodes of a subtree over references [begin, end) are stored in pre-order in [index, index + 2*(end-begin) - 1),
+  // so that subtrees can be built independently (and in parallel) without sharing an allocator
+  void ConstructBinned_internal(std::vector<BuildReference> &references, size_t begin, size_t end, int index);
+  void ConstructBinnedTopLevel_internal(std::vector<BuildReference> &references, size_t begin, size_t end, int index,
+    size_t taskSize, std::vector<BuildReference> &partitionBuffer, std::vector<SubtreeTask> &tasks);
+  bool SplitBinned_internal(std::vector<BuildReference> &references, size_t begin, size_t end, int index,
+    std::vector<BuildReference> *partitionBuffer, size_t &middle);
+  void MakeLeafFromReferences_internal(const std::vector<BuildReference> &references, size_t begin, size_t end, int index);
+  void ConstructBinnedParallel(const std::vector<SceneObject *> &targets);
+  void CompactNodes_internal();
+
+  // for CONSTRUCTION_SBVH
+  void ConstructSBVH(const std::vector<SceneObject *> &targets);
+  void ConstructSBVH_internal(std::vector<BuildReference> &references, int index, size_t &duplicationBudget, double rootSurfaceArea);
+
+  // for CONSTRUCTION_LBVH
+  void ConstructLBVH(const std::vector<SceneObject *> &targets);
+  int ConstructLBVH_internal(const std::vector<BuildReference> &references, const std::vector<LBVHSplit> &splits, size_t begin, size_t end, size_t split);
+
+  void CalcMaxDepth_internal();
+
   void CollectBoundingBoxes_internal(int currentDepth, int targetDepth, int index, std::vector<BoundingBox> &result);
 private:
   std::vector<BVH_structure> m_root;
+  unsigned int m_maxDepth;
   //int m_bvh_node_size;
 };
 
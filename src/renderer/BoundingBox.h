@@ -1,6 +1,7 @@
 #pragma once
 
 #include <algorithm>
+#include <immintrin.h>
 #include "tools/Vector.h"
 #include "Ray.h"
 #include "tools/Constant.h"
@@ -27,7 +28,7 @@ public:
     return diff_x*diff_y + diff_x*diff_z + diff_y*diff_z;
   }
 
-  template <typename FLOATING> static FLOATING CalcSurfaceArea(FLOATING min[3], FLOATING max[3]) {
+  template <typename FLOATING> static FLOATING CalcSurfaceArea(const FLOATING min[3], const FLOATING max[3]) {
     FLOATING diff[3] = {max[0]-min[0], max[1]-min[1], max[2]-min[2]};
     return diff[0]*diff[1] + diff[1]*diff[2] + diff[0]*diff[2];
   }
@@ -133,6 +134,31 @@ public:
     return true;
   }
 
+  // returns the bit mask of intersected boxes
+  inline static int CheckIntersection8floatAABB(
+    const __m256 bboxes[2][3], // 8boxes: min-max[2] * xyz[3] * boxes[8](__m256)
+    const __m256 rayOrig[3],   // ray origin
+    const __m256 rayInverseDir[3], // ray inversed dir
+    const int raySign[3],         // ray xyz direction => +:0, -:1
+    __m256 tmin, __m256 tmax,     // ray range tmin-tmax
+    __m256 &distances
+    ) {
+
+    // same as CheckIntersection4floatAABB
+    for (int xyz = 0; xyz < 3; xyz++) {
+      tmin = _mm256_max_ps(
+        tmin, _mm256_mul_ps(_mm256_sub_ps(bboxes[raySign[xyz]][xyz], rayOrig[xyz]), rayInverseDir[xyz])
+        );
+      tmax = _mm256_min_ps(
+        tmax, _mm256_mul_ps(_mm256_sub_ps(bboxes[1 - raySign[xyz]][xyz], rayOrig[xyz]), rayInverseDir[xyz])
+        );
+    }
+
+    distances = tmin;
+
+    return _mm256_movemask_ps(_mm256_cmp_ps(tmax, tmin, _CMP_GE_OQ));
+  }
+
   inline static bool CheckIntersection2doubleAABB(
     const __m128d bboxes[2][3], // 4boxes: min-max[2] * xyz[3] * boxes[2](__m128)
     const __m128d rayOrig[3],   // ray origin
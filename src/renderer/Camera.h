@@ -62,7 +62,7 @@ namespace OmochiRenderer {
       return m_screenYaxis;
     }
 
-    Ray SampleRayForPixel(double x, double y, const Random &rnd) const {
+    Ray SampleRayForPixel(double x, double y, const Sampler &rnd) const {
 
       // ʂ ray (center_ray) ̕
       Vector3 target_position = m_screenCenter +
@@ -2,17 +2,32 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include "Color.h"
 #include "tools/HDRImage.h"
 #include "tools/Constant.h"
+#include "tools/Sampler.h"
+#include "tools/Utils.h"
 
 namespace OmochiRenderer {
 
   class IBL {
   public:
+    // representation that Sample(dir) looks up
+    //   LOOKUP_LATLONG:             the loaded lat-long image (acos and sqrt per lookup)
+    //   LOOKUP_OCTAHEDRAL:          float copy of the environment in the octahedral mapping, nearest texel
+    //   LOOKUP_OCTAHEDRAL_BILINEAR: the same, bilinear filtered
+    enum LOOKUP_TYPE {
+      LOOKUP_LATLONG,
+      LOOKUP_OCTAHEDRAL,
+      LOOKUP_OCTAHEDRAL_BILINEAR,
+    };
 
     IBL(const std::string &hdr_filename, const double radius = 1000000.0, const Vector3 &centerPosition = Vector3::Zero())
       : m_image()
+      , m_lookupType(LOOKUP_LATLONG)
+      , m_octahedralSize(0)
       , m_radius(radius)
       , m_center(centerPosition)
     {
@@ -21,22 +36,41 @@ namespace OmochiRenderer {
         return;
       }
 
-      //CreateImportanceSamplingMap();
+      CreateImportanceSamplingMap();
     }
 
-    inline const Color &Sample(const Ray &ray) const {
+    // the octahedral map is built here, once, when it is selected for the first time
+    void SetLookupType(LOOKUP_TYPE type) {
+      if (type != LOOKUP_LATLONG && m_octahedralSize == 0) {
+        CreateOctahedralMap();
+      }
+      m_lookupType = type;
+    }
+    LOOKUP_TYPE GetLookupType() const { return m_lookupType; }
+
+    // "latlong", "octahedral" or "octahedral bilinear". returns defaultType for anything else
+    static LOOKUP_TYPE ParseLookupType(const std::string &str, LOOKUP_TYPE defaultType = LOOKUP_LATLONG) {
+      const std::string lower(Utils::tolower(Utils::trim(str)));
+      if (lower == "latlong") return LOOKUP_LATLONG;
+      if (lower == "octahedral") return LOOKUP_OCTAHEDRAL;
+      if (lower == "octahedral bilinear") return LOOKUP_OCTAHEDRAL_BILINEAR;
+      return defaultType;
+    }
+
+    inline Color Sample(const Ray &ray) const {
       return Sample(ConvertRayToNormalizedDir(ray));
     }
-    inline const Color &Sample(const Vector3 &dir) const {
-      // (x, y, z) = (r*sin(theta)*cos(phi), r*cos(theta), r*sin(theta)*sin(phi))
-      const double theta = acos(dir.y);
-      double phi = acos(dir.x / sqrt(dir.x*dir.x + dir.z*dir.z));
-      if (dir.z < 0.0) {
-        phi = 2.0 * PI - phi;
+    inline Color Sample(const Vector3 &dir) const {
+      if (m_octahedralSize > 0) {
+        if (m_lookupType == LOOKUP_OCTAHEDRAL) return SampleOctahedral(dir);
+        if (m_lookupType == LOOKUP_OCTAHEDRAL_BILINEAR) return SampleOctahedralBilinear(dir);
       }
+      return SampleLatLong(dir);
+    }
 
+    inline const Color &SampleLatLong(const Vector3 &dir) const {
       double u, v;
-      PhiThetaToUV(phi, theta, u, v);
+      DirToUV(dir, u, v);
 
       return m_image.GetPixel(
         static_cast<int>(u * m_image.GetWidth()) % m_image.GetWidth(),
@@ -44,6 +78,53 @@ namespace OmochiRenderer {
       );
     }
 
+    // false if the image is not loaded or black: the environment is then reached by the BSDF sampling only
+    bool HasImportanceSamplingMap() const { return !m_marginalCdf.empty(); }
+
+    // picks a direction towards the environment with the probability proportional to its luminance.
+    // pdf is in the solid angle. false if there is no importance sampling map
+    bool SampleDirection(Vector3 &dir, double &pdf, const Sampler &rnd) const {
+      if (!HasImportanceSamplingMap()) return false;
+      const size_t width = m_image.GetWidth();
+      const size_t height = m_image.GetHeight();
+
+      double u1, u2;
+      rnd.next2D(u1, u2);
+      double offsetX, offsetY;
+      const size_t yi = SampleCdf(&m_marginalCdf[0], height, u2, offsetY);
+      const double *conditionalCdf = &m_conditionalCdf[yi * (width + 1)];
+      const size_t xi = SampleCdf(conditionalCdf, width, u1, offsetX);
+
+      double phi, theta;
+      UVToPhiTheta((xi + offsetX) / width, (yi + offsetY) / height, phi, theta);
+      const double sinTheta = sin(theta);
+      if (sinTheta <= 0.0) return false;
+      dir = Vector3(sinTheta * cos(phi), cos(theta), sinTheta * sin(phi));
+
+      // pdf in (u,v) is (pixel probability) * width * height. d = 2PI * PI * sin dudv
+      const double pixelProbability = (conditionalCdf[xi + 1] - conditionalCdf[xi]) * (m_marginalCdf[yi + 1] - m_marginalCdf[yi]);
+      pdf = pixelProbability * width * height / (2.0 * PI * PI * sinTheta);
+      return pdf > 0.0;
+    }
+
+    // solid angle pdf with which SampleDirection picks dir, for MIS. 0 if there is no importance sampling map
+    double Pdf(const Vector3 &dir) const {
+      if (!HasImportanceSamplingMap()) return 0.0;
+      const size_t width = m_image.GetWidth();
+      const size_t height = m_image.GetHeight();
+
+      double u, v;
+      DirToUV(dir, u, v);
+      const double sinTheta = sqrt(std::max(0.0, 1.0 - dir.y * dir.y));
+      if (sinTheta <= 0.0) return 0.0;
+
+      const size_t xi = static_cast<size_t>(u * width) % width;
+      const size_t yi = static_cast<size_t>(v * height) % height;
+      const double *conditionalCdf = &m_conditionalCdf[yi * (width + 1)];
+      const double pixelProbability = (conditionalCdf[xi + 1] - conditionalCdf[xi]) * (m_marginalCdf[yi + 1] - m_marginalCdf[yi]);
+      return pixelProbability * width * height / (2.0 * PI * PI * sinTheta);
+    }
+
     inline const Color &SampleOriginal(const Vector3 &dir) {
       const float r = static_cast<float>((1.0f / PI) * acos(dir.z) / sqrt(dir.x * dir.x + dir.y * dir.y));
 
@@ -73,6 +154,15 @@ namespace OmochiRenderer {
       phi = u * (2.0 * PI);
       theta = v * PI;
     }
+    static void DirToUV(const Vector3 &dir, double &u, double &v) {
+      // (x, y, z) = (r*sin(theta)*cos(phi), r*cos(theta), r*sin(theta)*sin(phi))
+      const double theta = acos(std::max(-1.0, std::min<double>(1.0, dir.y)));
+      double phi = acos(dir.x / sqrt(dir.x*dir.x + dir.z*dir.z));
+      if (dir.z < 0.0) {
+        phi = 2.0 * PI - phi;
+      }
+      PhiThetaToUV(phi, theta, u, v);
+    }
 
     Vector3 ConvertRayToNormalizedDir(const Ray &ray) const {
       const Vector3 &x = ray.orig;
@@ -101,98 +191,147 @@ namespace OmochiRenderer {
       return res;
     }
 
-    void CreateImportanceSamplingMap() {
-      return;
-
-      std::vector<Color> xyToEnv(m_image.GetWidth()*m_image.GetHeight());
-
-      size_t width = m_image.GetWidth();
-      size_t height = m_image.GetHeight();
+    // the octahedral map folds the sphere onto the square [-1,1]^2: the upper hemisphere (y >= 0) is the inner diamond
+    // |cx| + |cz| <= 1 and the lower one is folded out to the corners. the map has a border of one texel holding the
+    // texels across the edges (the edges are mirrored), so that the bilinear lookup needs no wrapping
+    struct FloatColor {
+      float r, g, b;
+    };
+
+    // direction -> [-1,1]^2
+    static inline void DirToOctahedral(const Vector3 &dir, double &cx, double &cz) {
+      const double inv = 1.0 / (fabs(dir.x) + fabs(dir.y) + fabs(dir.z));
+      const double px = dir.x * inv, pz = dir.z * inv;
+      const double foldedX = (1.0 - fabs(pz)) * (px >= 0.0 ? 1.0 : -1.0);
+      const double foldedZ = (1.0 - fabs(px)) * (pz >= 0.0 ? 1.0 : -1.0);
+      const bool lower = dir.y < 0.0;
+      cx = lower ? foldedX : px;
+      cz = lower ? foldedZ : pz;
+    }
+    // [-1,1]^2 -> normalized direction
+    static Vector3 OctahedralToDir(double cx, double cz) {
+      const double y = 1.0 - fabs(cx) - fabs(cz);
+      if (y < 0.0) {
+        const double x = (1.0 - fabs(cz)) * (cx >= 0.0 ? 1.0 : -1.0);
+        cz = (1.0 - fabs(cx)) * (cz >= 0.0 ? 1.0 : -1.0);
+        cx = x;
+      }
+      Vector3 dir(cx, y, cz);
+      dir.normalize();
+      return dir;
+    }
 
-      // (x, y) sNZ => coslTvl ɕϊ
-      // eւ̕ˋPxAtheta = a (a͔C) 猩̕ˋPxɕϊĂ
-      // E_{=a} = E_(cos)*cos(-a)
-      // 2v-1 = cos ƕϐϊ (pdf vZƂɂ̌vZeՂɂ邽)
-      //  E_{=a} = E_(2v-1)*cos(-a)
-      //  E_(2v-1) e[uɂĂ (cos(-a)́̕AۂɃTvOƂɌvZ)
-      for (size_t yi = 0; yi < height; yi++) {
-        for (size_t xi = 0; xi < width; xi++) {
-          const double u = (xi + 0.5) / width;
-          const double v = (yi + 0.5) / height;
-
-          const double phi = u * 2.0 * PI;
-          const double y = 2 * v - 1.0;
-          //double phi, theta;
-          //UVToPhiTheta(u, v, phi, theta);
-          //const double y = cos(theta);
-
-          xyToEnv[yi*width + xi] = Sample(Vector3(
-            sqrt(1.0 - y*y) * cos(phi),
-            y,
-            sqrt(1.0 - y*y) * sin(phi)
-            ));
+    // same number of texels as the lat-long image. each texel averages 2x2 lookups of the lat-long image
+    void CreateOctahedralMap() {
+      const size_t pixels = m_image.GetWidth() * m_image.GetHeight();
+      if (pixels == 0) return;
+      const int size = std::max(1, static_cast<int>(sqrt(static_cast<double>(pixels))));
+      const int stride = size + 2;
+
+      m_octahedralMap.assign(stride * stride, FloatColor());
+      for (int yi = 0; yi < stride; yi++) {
+        for (int xi = 0; xi < stride; xi++) {
+          Color sum;
+          for (int s = 0; s < 4; s++) {
+            double cx = ((xi - 1) + 0.25 + 0.5 * (s & 1)) / size * 2.0 - 1.0;
+            double cz = ((yi - 1) + 0.25 + 0.5 * (s >> 1)) / size * 2.0 - 1.0;
+            // border texels: the point across the edge is mirrored
+            if (cx < -1.0) { cx = -2.0 - cx; cz = -cz; }
+            if (cx > 1.0) { cx = 2.0 - cx; cz = -cz; }
+            if (cz < -1.0) { cz = -2.0 - cz; cx = -cx; }
+            if (cz > 1.0) { cz = 2.0 - cz; cx = -cx; }
+            sum += SampleLatLong(OctahedralToDir(cx, cz));
+          }
+          FloatColor &texel = m_octahedralMap[yi * stride + xi];
+          texel.r = static_cast<float>(sum.x * 0.25);
+          texel.g = static_cast<float>(sum.y * 0.25);
+          texel.b = static_cast<float>(sum.z * 0.25);
         }
       }
+      m_octahedralSize = size;
+    }
 
-      const double width_scale = 1.0 * width / m_importance_map_size;
-      const double height_scale = 1.0 * height / m_importance_map_size;
-
-      m_luminance_map.clear(); m_luminance_map.resize(m_importance_map_size * m_importance_map_size);
-      m_direction_map.clear(); m_direction_map.resize(m_importance_map_size * m_importance_map_size);
-
-      // importance map ̍쐬
-      // map  index  accumulated luminance  ray direction 悤ɂĂ
-      for (size_t yi = 0; yi < m_importance_map_size; yi++) {
-        for (size_t xi = 0; xi < m_importance_map_size; xi++) {
-          const double u = (xi + 0.5) / m_importance_map_size;
-          const double v = (yi + 0.5) / m_importance_map_size;
-
-          //double phi, theta;
-          //UVToPhiTheta(u, v, phi, theta);
-          //double y = cos(theta);
-
-          const double phi = u * 2.0 * PI;
-          const double y = 2 * v - 1.0;   // cos
-          const Vector3 vec(sqrt(1.0 - y*y)*cos(phi), y, sqrt(1.0 - y*y)*sin(phi));
-
-          size_t index = yi * m_importance_map_size + xi;
+    inline Color SampleOctahedral(const Vector3 &dir) const {
+      double cx, cz;
+      DirToOctahedral(dir, cx, cz);
+      const int size = m_octahedralSize;
+      const int xi = std::min(static_cast<int>((cx + 1.0) * 0.5 * size), size - 1) + 1;
+      const int yi = std::min(static_cast<int>((cz + 1.0) * 0.5 * size), size - 1) + 1;
+      const FloatColor &texel = m_octahedralMap[yi * (size + 2) + xi];
+      return Color(texel.r, texel.g, texel.b);
+    }
 
-          m_direction_map[index] = vec;
+    inline Color SampleOctahedralBilinear(const Vector3 &dir) const {
+      double cx, cz;
+      DirToOctahedral(dir, cx, cz);
+      const int size = m_octahedralSize;
+      const int stride = size + 2;
+      // texel i of the bordered map has its center at i + 0.5
+      const double fx = std::max(0.0, std::min((cx + 1.0) * 0.5 * size + 0.5, size + 0.999999));
+      const double fz = std::max(0.0, std::min((cz + 1.0) * 0.5 * size + 0.5, size + 0.999999));
+      const int xi = static_cast<int>(fx), yi = static_cast<int>(fz);
+      const float tx = static_cast<float>(fx - xi), tz = static_cast<float>(fz - yi);
+
+      const FloatColor *row0 = &m_octahedralMap[yi * stride + xi];
+      const FloatColor *row1 = row0 + stride;
+      const float w00 = (1 - tx) * (1 - tz), w10 = tx * (1 - tz), w01 = (1 - tx) * tz, w11 = tx * tz;
+      return Color(
+        w00 * row0[0].r + w10 * row0[1].r + w01 * row1[0].r + w11 * row1[1].r,
+        w00 * row0[0].g + w10 * row0[1].g + w01 * row1[0].g + w11 * row1[1].g,
+        w00 * row0[0].b + w10 * row0[1].b + w01 * row1[0].b + w11 * row1[1].b);
+    }
 
-          Color tmp;
-          for (int yi_ = static_cast<int>(yi * height_scale); yi_ < static_cast<int>((yi + 1)*height_scale); yi_++) {
-            for (int xi_ = static_cast<int>(xi * width_scale); xi_ < static_cast<int>((xi + 1)*width_scale); xi_++) {
-              tmp += xyToEnv[yi_ * width + xi_];
-            }
-          }
-          m_luminance_map[index] = 0.298912 * tmp.x + 0.586611 * tmp.y + 0.114478 * tmp.z;
+    // 2D piecewise-constant distribution over the pixels of the lat-long image: a row is picked by the marginal CDF and
+    // a pixel in it by the conditional CDF of the row. the weight of a pixel is its luminance times sin, since the rows
+    // near the poles cover less solid angle
+    void CreateImportanceSamplingMap() {
+      const size_t width = m_image.GetWidth();
+      const size_t height = m_image.GetHeight();
+      m_marginalCdf.clear();
+      m_conditionalCdf.clear();
+      if (width == 0 || height == 0) return;
+
+      std::vector<double> marginalCdf(height + 1, 0.0);
+      std::vector<double> conditionalCdf(height * (width + 1), 0.0);
+      for (size_t yi = 0; yi < height; yi++) {
+        const double sinTheta = sin(PI * (yi + 0.5) / height);
+        double *cdf = &conditionalCdf[yi * (width + 1)];
+        for (size_t xi = 0; xi < width; xi++) {
+          const Color &c = m_image.GetPixel(xi, yi);
+          const double luminance = 0.298912 * c.x + 0.586611 * c.y + 0.114478 * c.z;
+          cdf[xi + 1] = cdf[xi] + std::max(luminance, 0.0) * sinTheta;
+        }
+        const double rowWeight = cdf[width];
+        marginalCdf[yi + 1] = marginalCdf[yi] + rowWeight;
+        if (rowWeight > 0.0) {
+          for (size_t xi = 1; xi <= width; xi++) cdf[xi] /= rowWeight;
         }
       }
 
-      // importance map  (x,y) IԊmx֐
-      //  C * luminance_rate(x,y) (ȍ~Aluminance_rate(x,y) = l_{x,y})
-      // ƂBϕ
-      //  Cl_{x,y}*sindd (:0->PI, :0->2PI)
-      // ALŕϊĂ悤ɁA
-      //  cos = 2*v - 1,  = 2*u*PI
-      // ƕϐϊƁA
-      //  4*PI*Cl_{x,y}*dudv (u:0->1, v:-0.5->0.5)
-      // ƂȂBŁAl_{x,y}u,vɂāAꂼ1ӂ 1/map_size Ƃ鐳`̑\lƂĂ킳Ă
-      // ܂Ä̗ł͒l̂߁AL̐ϕ
-      //  4PI*Cl_{(0.5+xi)/map_size, (0.5+yi)/map_size}*uv
-      // ̂悤ɒuBuv l_{x,y} \lƂĂ̖̈ʐςȂ̂ŁA 1/map_size^2 ƂȂB
-      // ܂Al ͐Kꂽ̂ĝŁA̍vl1ƂȂB܂A
-      //  Cl_{x,y}*sindd = 4PI/map_size^2 * C
-      // ƂȂ̂ŁA C = map_size^2/4PI ŁA pdf = luminance_rate(x,y) * map_size^2 / 4PI ƂȂB
-      // L map 쐬A y (=cos) = 2v - 1 ƂA = v*PI ƂƁA܂vZقȂĂ
+      const double totalWeight = marginalCdf[height];
+      if (totalWeight <= 0.0) return;
+      for (size_t yi = 1; yi <= height; yi++) marginalCdf[yi] /= totalWeight;
+
+      m_marginalCdf.swap(marginalCdf);
+      m_conditionalCdf.swap(conditionalCdf);
+    }
 
+    // index i of the interval [cdf[i], cdf[i+1]) containing u, and the position of u in it: [0,1)
+    static size_t SampleCdf(const double *cdf, size_t count, double u, double &offset) {
+      u = std::min(u, 1.0 - 1e-12);
+      const size_t index = std::min<size_t>(std::upper_bound(cdf, cdf + count + 1, u) - cdf, count) - 1;
+      const double width = cdf[index + 1] - cdf[index];
+      offset = width > 0.0 ? std::min((u - cdf[index]) / width, 1.0 - 1e-12) : 0.0;
+      return index;
     }
 
   private:
     HDRImage m_image;
-    static const int m_importance_map_size = 64;
-    std::vector<double> m_luminance_map;
-    std::vector<Vector3> m_direction_map;
+    LOOKUP_TYPE m_lookupType;
+    std::vector<FloatColor> m_octahedralMap;  // (size+2)^2 texels with the border
+    int m_octahedralSize;                     // 0 until the map is built
+    std::vector<double> m_marginalCdf;      // height+1 entries. empty if there is no importance sampling map
+    std::vector<double> m_conditionalCdf;   // width+1 entries per row
 
     double m_radius;
     Vector3 m_center;
@@ -4,15 +4,26 @@
 
 namespace OmochiRenderer {
 
-  class Random;
+  class Sampler;
 
   class LightBase {
   public:
+    LightBase() : m_lightIndex(-1) {}
     virtual ~LightBase() {}
 
-    virtual void SampleOnePoint(Vector3 &point, Vector3 &normal, double &pdf, const Random &rnd) const = 0;
+    virtual void SampleOnePoint(Vector3 &point, Vector3 &normal, double &pdf, const Sampler &rnd) const = 0;
     // targetPoint ł\ʒuŃTvO
-    virtual bool SampleOnePointWithTargetPoint(Vector3 &sampledPoint, Vector3 &sampledPointNormal, double &pdf, const Vector3 &targetPoint, const Random &rnd) const = 0;
+    virtual bool SampleOnePointWithTargetPoint(Vector3 &sampledPoint, Vector3 &sampledPointNormal, double &pdf, const Vector3 &targetPoint, const Sampler &rnd) const = 0;
+    // pdf in the solid angle around targetPoint with which SampleOnePointWithTargetPoint samples pointOnLight, for MIS.
+    // 0 if it is never sampled
+    virtual double PdfWithTargetPoint(const Vector3 &pointOnLight, const Vector3 &targetPoint) const = 0;
     virtual double TotalPower() const = 0;
+
+    // index in Scene::GetLights(), set when the light is added to the scene
+    int GetLightIndex() const { return m_lightIndex; }
+    void SetLightIndex(int index) { m_lightIndex = index; }
+
+  private:
+    int m_lightIndex;
   };
 }
@@ -0,0 +1,210 @@
+#include "stdafx.h"
+
+#include "LightSampler.h"
+#include "LightBase.h"
+#include "SceneObject.h"
+#include "tools/Utils.h"
+
+#include <cassert>
+
+using namespace std;
+
+namespace OmochiRenderer {
+
+namespace {
+  // u is kept below 1 when it is rescaled to the chosen child
+  const double ONE_MINUS_EPSILON = 1.0 - 1e-12;
+}
+
+LightSampler::LightSampler(const std::vector<LightBase *> &lights, SAMPLING_TYPE type)
+  : m_type(type)
+  , m_lights()
+  , m_powerTable()
+  , m_nodes()
+  , m_lightTrails()
+  , m_lightDepths()
+{
+  vector<double> powers;
+  m_lights.reserve(lights.size());
+  powers.reserve(lights.size());
+  for (size_t i = 0; i < lights.size(); i++) {
+    Light light;
+    light.light = lights[i];
+    light.object = dynamic_cast<const SceneObject *>(lights[i]);
+    m_lights.push_back(light);
+    powers.push_back(lights[i]->TotalPower());
+  }
+
+  if (m_type == SAMPLING_BVH) {
+    ConstructBVH(powers);
+  } else {
+    m_powerTable.Build(powers);
+  }
+}
+
+const LightSampler::Light *LightSampler::Sample(const Vector3 &position, const Vector3 &normal, double u, double &probability) const {
+  probability = 0.0;
+
+  if (m_type == SAMPLING_POWER) {
+    const int index = m_powerTable.Sample(u);
+    if (index < 0) return nullptr;
+    probability = m_powerTable.Probability(index);
+    return &m_lights[index];
+  }
+
+  if (m_nodes.empty()) return nullptr;
+
+  // the random number is rescaled at each level, so one number is enough for the whole descent
+  int nodeIndex = 0;
+  double p = 1.0;
+  while (m_nodes[nodeIndex].secondChild >= 0) {
+    const int first = nodeIndex + 1, second = m_nodes[nodeIndex].secondChild;
+    const double importance1 = Importance(m_nodes[first], position, normal);
+    const double importance2 = Importance(m_nodes[second], position, normal);
+    if (importance1 + importance2 <= 0.0) return nullptr;
+
+    const double p1 = importance1 / (importance1 + importance2);
+    if (u < p1 || importance2 <= 0.0) {
+      nodeIndex = first;
+      p *= p1;
+      u = std::min(u / p1, ONE_MINUS_EPSILON);
+    } else {
+      nodeIndex = second;
+      p *= 1.0 - p1;
+      u = std::min((u - p1) / (1.0 - p1), ONE_MINUS_EPSILON);
+    }
+  }
+
+  probability = p;
+  return &m_lights[m_nodes[nodeIndex].lightIndex];
+}
+
+double LightSampler::Probability(const Vector3 &position, const Vector3 &normal, int lightIndex) const {
+  if (lightIndex < 0 || lightIndex >= static_cast<int>(m_lights.size())) return 0.0;
+
+  if (m_type == SAMPLING_POWER) {
+    return m_powerTable.size() > 0 ? m_powerTable.Probability(lightIndex) : 0.0;
+  }
+
+  if (m_lightDepths[lightIndex] < 0) return 0.0;
+
+  // follow the trail of the light, with the same choices as Sample
+  const unsigned long long trail = m_lightTrails[lightIndex];
+  int nodeIndex = 0;
+  double p = 1.0;
+  for (int depth = 0; m_nodes[nodeIndex].secondChild >= 0; depth++) {
+    const int first = nodeIndex + 1, second = m_nodes[nodeIndex].secondChild;
+    const double importance1 = Importance(m_nodes[first], position, normal);
+    const double importance2 = Importance(m_nodes[second], position, normal);
+    if (importance1 + importance2 <= 0.0) return 0.0;
+
+    const double p1 = importance1 / (importance1 + importance2);
+    if ((trail >> depth) & 1) {
+      if (importance2 <= 0.0) return 0.0;
+      nodeIndex = second;
+      p *= 1.0 - p1;
+    } else {
+      nodeIndex = first;
+      p *= p1;
+    }
+  }
+  return p;
+}
+
+double LightSampler::Pdf(const Vector3 &position, const Vector3 &normal, const LightBase *light, const Vector3 &pointOnLight) const {
+  const double probability = Probability(position, normal, light->GetLightIndex());
+  if (probability <= 0.0) return 0.0;
+  return probability * light->PdfWithTargetPoint(pointOnLight, position);
+}
+
+LightSampler::SAMPLING_TYPE LightSampler::ParseSamplingType(const std::string &str, SAMPLING_TYPE defaultType) {
+  const string lower(Utils::tolower(Utils::trim(str)));
+  if (lower == "power") return SAMPLING_POWER;
+  if (lower == "bvh") return SAMPLING_BVH;
+  return defaultType;
+}
+
+void LightSampler::ConstructBVH(const std::vector<double> &powers) {
+  m_lightTrails.assign(m_lights.size(), 0);
+  m_lightDepths.assign(m_lights.size(), -1);
+
+  // lights without power are never sampled
+  vector<int> lightIndices;
+  for (size_t i = 0; i < m_lights.size(); i++) {
+    if (powers[i] > 0.0) lightIndices.push_back(static_cast<int>(i));
+  }
+  if (lightIndices.empty()) return;
+
+  m_nodes.reserve(2 * lightIndices.size() - 1);
+  ConstructBVH_internal(lightIndices, 0, lightIndices.size(), powers, 0, 0);
+}
+
+// median split on the longest axis of the light centers
+int LightSampler::ConstructBVH_internal(std::vector<int> &lightIndices, size_t begin, size_t end, const std::vector<double> &powers,
+  unsigned long long trail, int depth)
+{
+  assert(begin < end);
+  assert(depth < 64);
+
+  const int nodeIndex = static_cast<int>(m_nodes.size());
+  m_nodes.push_back(LightBVHNode());
+
+  if (end - begin == 1) {
+    const int lightIndex = lightIndices[begin];
+    LightBVHNode &leaf = m_nodes[nodeIndex];
+    leaf.box = m_lights[lightIndex].object != nullptr ? m_lights[lightIndex].object->boundingBox : BoundingBox();
+    leaf.power = powers[lightIndex];
+    leaf.secondChild = -1;
+    leaf.lightIndex = lightIndex;
+    m_lightTrails[lightIndex] = trail;
+    m_lightDepths[lightIndex] = depth;
+    return nodeIndex;
+  }
+
+  Vector3 centerMin(INF, INF, INF), centerMax(-INF, -INF, -INF);
+  for (size_t i = begin; i < end; i++) {
+    const SceneObject *object = m_lights[lightIndices[i]].object;
+    const Vector3 center = object != nullptr ? object->boundingBox.position() : Vector3(0, 0, 0);
+    centerMin = Vector3(std::min(centerMin.x, center.x), std::min(centerMin.y, center.y), std::min(centerMin.z, center.z));
+    centerMax = Vector3(std::max(centerMax.x, center.x), std::max(centerMax.y, center.y), std::max(centerMax.z, center.z));
+  }
+  const Vector3 extent = centerMax - centerMin;
+  const int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+  const size_t middle = (begin + end) / 2;
+  nth_element(lightIndices.begin() + begin, lightIndices.begin() + middle, lightIndices.begin() + end,
+    [this, axis](int a, int b) {
+      const SceneObject *objectA = m_lights[a].object, *objectB = m_lights[b].object;
+      const Vector3 centerA = objectA != nullptr ? objectA->boundingBox.position() : Vector3(0, 0, 0);
+      const Vector3 centerB = objectB != nullptr ? objectB->boundingBox.position() : Vector3(0, 0, 0);
+      const double a_ = axis == 0 ? centerA.x : (axis == 1 ? centerA.y : centerA.z);
+      const double b_ = axis == 0 ? centerB.x : (axis == 1 ? centerB.y : centerB.z);
+      return a_ < b_;
+    });
+
+  const int first = ConstructBVH_internal(lightIndices, begin, middle, powers, trail, depth + 1);
+  const int second = ConstructBVH_internal(lightIndices, middle, end, powers, trail | (1ULL << depth), depth + 1);
+
+  LightBVHNode &node = m_nodes[nodeIndex];
+  node.box = BoundingBox::CompoundBoxes(m_nodes[first].box, m_nodes[second].box);
+  node.power = m_nodes[first].power + m_nodes[second].power;
+  node.secondChild = second;
+  node.lightIndex = -1;
+  return nodeIndex;
+}
+
+// power / squared distance to the box center, which is clamped to the size of the box so that nearby clusters
+// are not overestimated. 0 if the whole box is below the tangent plane of the shading point
+double LightSampler::Importance(const LightBVHNode &node, const Vector3 &position, const Vector3 &normal) {
+  const Vector3 toCenter = node.box.position() - position;
+  const Vector3 halfSize = (node.box.max() - node.box.min()) * 0.5;
+
+  const double maxHeight = toCenter.dot(normal)
+    + halfSize.x * fabs(normal.x) + halfSize.y * fabs(normal.y) + halfSize.z * fabs(normal.z);
+  if (maxHeight < 0.0) return 0.0;
+
+  const double distanceSq = std::max<double>(std::max(toCenter.lengthSq(), halfSize.lengthSq()), EPS);
+  return node.power / distanceSq;
+}
+
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include "BoundingBox.h"
+#include "tools/Vector.h"
+#include "tools/AliasTable.h"
+
+namespace OmochiRenderer {
+
+class LightBase;
+class SceneObject;
+
+// picks the light to sample for next event estimation. built once per scene, sampling allocates nothing.
+//   SAMPLING_POWER: proportional to the total power of the lights (alias table)
+//   SAMPLING_BVH:   descends a binary BVH over the lights. each child is chosen by its power over the squared distance
+//                   to the shading point, and never if it is entirely below the surface. for scenes with many lights,
+//                   most of which are too far to contribute much
+class LightSampler {
+public:
+  enum SAMPLING_TYPE {
+    SAMPLING_POWER,
+    SAMPLING_BVH,
+  };
+
+  struct Light {
+    const LightBase *light;
+    const SceneObject *object;  // surface of the light, which the shadow ray has to hit
+  };
+
+public:
+  LightSampler(const std::vector<LightBase *> &lights, SAMPLING_TYPE type = SAMPLING_POWER);
+
+  size_t GetLightCount() const { return m_lights.size(); }
+  SAMPLING_TYPE GetSamplingType() const { return m_type; }
+
+  // picks a light for the shading point (position, normal) with u in [0, 1).
+  // returns nullptr if no light can illuminate the point
+  const Light *Sample(const Vector3 &position, const Vector3 &normal, double u, double &probability) const;
+  // probability that Sample picks the light of lightIndex (LightBase::GetLightIndex) for the shading point
+  double Probability(const Vector3 &position, const Vector3 &normal, int lightIndex) const;
+  // pdf in the solid angle around the shading point with which pointOnLight is sampled (Sample and
+  // LightBase::SampleOnePointWithTargetPoint), for MIS
+  double Pdf(const Vector3 &position, const Vector3 &normal, const LightBase *light, const Vector3 &pointOnLight) const;
+
+  // "power" or "bvh". returns defaultType for anything else
+  static SAMPLING_TYPE ParseSamplingType(const std::string &str, SAMPLING_TYPE defaultType = SAMPLING_POWER);
+
+private:
+  // the first child of an inner node follows the node
+  struct LightBVHNode {
+    BoundingBox box;
+    double power;
+    int secondChild;    // -1 for a leaf
+    int lightIndex;     // leaf only
+  };
+
+  void ConstructBVH(const std::vector<double> &powers);
+  int ConstructBVH_internal(std::vector<int> &lightIndices, size_t begin, size_t end, const std::vector<double> &powers,
+    unsigned long long trail, int depth);
+  static double Importance(const LightBVHNode &node, const Vector3 &position, const Vector3 &normal);
+
+private:
+  SAMPLING_TYPE m_type;
+  std::vector<Light> m_lights;
+  AliasTable m_powerTable;
+
+  std::vector<LightBVHNode> m_nodes;
+  // path from the root to the leaf of each light: bit d is set if the second child is taken at depth d
+  std::vector<unsigned long long> m_lightTrails;
+  std::vector<int> m_lightDepths;   // -1 if the light is not in the BVH (no power)
+};
+
+}
@@ -27,6 +27,24 @@ public:
   , texture_id(texture_id_)
   {}
 
+  // color multiplied by the texture at uv
+  Color GetTexturedColor(const Vector3 &uv) const {
+    if (texture_id != ImageHandler::INVALID_IMAGE_ID)
+    {
+      Color c = color;
+      if (Image *img = ImageHandler::GetInstance().GetImage(texture_id))
+      {
+        auto &pixel = img->GetPixelByUV(uv.x, uv.y);
+
+        c.x *= pixel.x;
+        c.y *= pixel.y;
+        c.z *= pixel.z;
+
+        return c;
+      }
+    }
+    return color;
+  }
 
   REFLECTION_TYPE reflection_type;
   Color emission;
@@ -35,15 +53,20 @@ public:
   ImageHandler::IMAGE_ID texture_id;
 };
 
+// combines the hashes of the members (the same members as MaterialEq)
 struct MaterialHash {
-  std::hash<std::string> sh;
-  MaterialHash() : sh() {}
-
   size_t operator()(const Material &mat) const {
-    size_t type = static_cast<size_t>(mat.reflection_type);
-    std::stringstream ss;
-    ss << type << "_" << mat.color.toString() + "_" + mat.emission.toString() + "_" << mat.refraction_rate << "_" << mat.texture_id;
-    return sh(ss.str());
+    size_t h = std::hash<int>()(static_cast<int>(mat.reflection_type));
+    Combine(h, mat.color.x); Combine(h, mat.color.y); Combine(h, mat.color.z);
+    Combine(h, mat.emission.x); Combine(h, mat.emission.y); Combine(h, mat.emission.z);
+    Combine(h, mat.refraction_rate);
+    h ^= std::hash<int>()(mat.texture_id) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    return h;
+  }
+
+private:
+  static void Combine(size_t &h, double value) {
+    h ^= std::hash<double>()(value) + 0x9e3779b9 + (h << 6) + (h >> 2);
   }
 };
 
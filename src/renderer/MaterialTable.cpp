@@ -0,0 +1,17 @@
+#include "stdafx.h"
+
+#include "MaterialTable.h"
+
+namespace OmochiRenderer {
+
+MaterialTable::MATERIAL_ID MaterialTable::Register(const Material &mat) {
+  auto it = m_materialToID.find(mat);
+  if (it != m_materialToID.end()) return it->second;
+
+  const MATERIAL_ID id = static_cast<MATERIAL_ID>(m_materials.size());
+  m_materials.push_back(mat);
+  m_materialToID.insert(std::make_pair(mat, id));
+  return id;
+}
+
+}
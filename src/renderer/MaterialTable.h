@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include "Material.h"
+
+namespace OmochiRenderer {
+
+// every material of the scene. the objects keep only the ID of their material (SceneObject::materialId)
+// and shading fetches the material from the contiguous array here
+class MaterialTable {
+public:
+  typedef unsigned int MATERIAL_ID;
+  static const MATERIAL_ID INVALID_MATERIAL_ID = 0xffffffff;
+
+private:
+  MaterialTable() : m_materials(), m_materialToID() {}
+
+public:
+  static MaterialTable &GetInstance() {
+    static MaterialTable s;
+    return s;
+  }
+
+  // returns the ID of the material. the same ID for equal materials (MaterialEq).
+  // call while the scene is loaded: a new material may move the array
+  MATERIAL_ID Register(const Material &mat);
+
+  const Material &Get(MATERIAL_ID id) const {
+    return m_materials[id];
+  }
+  size_t GetCount() const {
+    return m_materials.size();
+  }
+
+private:
+  std::vector<Material> m_materials;
+  std::unordered_map<Material, MATERIAL_ID, MaterialHash, MaterialEq> m_materialToID;
+};
+
+}
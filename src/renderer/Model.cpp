@@ -3,6 +3,7 @@
 #include <fstream>
 #include "Model.h"
 #include "Polygon.h"
+#include "PolygonLight.h"
 #include "tools/Utils.h"
 #include "tools/Matrix.h"
 #include "tools/ImageHandler.h"
@@ -11,9 +12,12 @@ using namespace std;
 
 namespace OmochiRenderer {
 
-Model::Model()
-  : m_materials()
+Model::Model(Arena &arena)
+  : m_arena(arena)
+  , m_materials()
   , m_meshes()
+  , m_triangleMeshes()
+  , m_sourceFiles()
 {
 }
 
@@ -22,28 +26,27 @@ Model::~Model()
   Clear();
 }
 
+// the polygons and the meshes stay in the arena until it is released
 void Model::Clear()
 {
-  std::vector<Material>::iterator it, end = m_materials.end();
-  for (it = m_materials.begin(); it!=end; it++) {
-    PolygonList l = GetPolygonList(*it);
-    for (size_t i=0; i<l.size(); i++) {
-      //delete l[i];
-    }
-  }
   m_materials.clear();
   m_meshes.clear();
+  m_triangleMeshes.clear();
+  m_sourceFiles.clear();
 }
 
 void Model::Transform(const Vector3 &pos, const Vector3 &scale, const Matrix &rot) {
   m_position = pos;
 
-  std::vector<Material>::iterator it, end = m_materials.end();
+  std::vector<MaterialTable::MATERIAL_ID>::iterator it, end = m_materials.end();
   for (it = m_materials.begin(); it!=end; it++) {
-    PolygonList l = GetPolygonList(*it);
+    const PolygonList &l = GetPolygonList(*it);
     for (size_t i=0; i<l.size(); i++) {
       l[i]->Transform(pos, scale, rot);
     }
+    if (TriangleMesh *mesh = GetTriangleMesh(*it)) {
+      mesh->Transform(pos, scale, rot);
+    }
   }
 }
 
@@ -60,12 +63,13 @@ bool Model::ReadFromObj(const std::string &filename, bool flipV_of_UV) {
   if (!ifs) return false;
 
   Clear();
+  m_sourceFiles.push_back(filename);
 
   const static std::string defaultMaterialName = "__default__material__";
 
-  std::unordered_map<string, Material> materialNames;
-  materialNames[defaultMaterialName] = Material(Material::REFLECTION_TYPE_LAMBERT, Vector3(0,0,0), Vector3(0.99, 0.99, 0.99));
-  m_meshes[materialNames[defaultMaterialName]] = PolygonList();
+  MaterialTable &materialTable = MaterialTable::GetInstance();
+  std::unordered_map<string, MaterialTable::MATERIAL_ID> materialNames;
+  materialNames[defaultMaterialName] = materialTable.Register(Material(Material::REFLECTION_TYPE_LAMBERT, Vector3(0,0,0), Vector3(0.99, 0.99, 0.99)));
 
   string currentMaterialName = defaultMaterialName;
   string currentGroupName;
@@ -74,8 +78,11 @@ bool Model::ReadFromObj(const std::string &filename, bool flipV_of_UV) {
   vector<Vector3> normalsInGroup;
   vector<Vector3> uvCoordinatesInGroup;
 
-  Material *currentMaterial = &materialNames[currentMaterialName];
-  PolygonList *currentPolygonList = &m_meshes[materialNames[defaultMaterialName]];
+  MaterialTable::MATERIAL_ID currentMaterialId = materialNames[currentMaterialName];
+  std::unordered_map<TriangleMesh *, MeshVertexMap> meshVertexMaps;
+  // the polygon list or the mesh of the current material, not to look them up for every face
+  PolygonList *currentPolygonList = nullptr;
+  TriangleMesh *currentMesh = nullptr;
 
   while (!ifs.eof()) {
     string line;
@@ -89,10 +96,12 @@ bool Model::ReadFromObj(const std::string &filename, bool flipV_of_UV) {
       //materialNames[line.substr(string("mtllib ").length())] = Material(Material::REFLECTION_TYPE_LAMBERT, Vector3(0,0,0), Vector3(0.999+index*0.001,0.99,0.99));
       //index++;
       // material[h
-      if (!LoadMaterialFile(baseDir + "/" + line.substr(string("mtlib ").length()+1), materialNames)) {
+      const string materialFile(baseDir + "/" + line.substr(string("mtlib ").length()+1));
+      if (!LoadMaterialFile(materialFile, materialNames)) {
         cerr << "failed to load material file: " << line.substr(string("mtlib ").length()) << endl;
         return false;
       }
+      m_sourceFiles.push_back(materialFile);
 
     } else if (line.find("g ") == 0) {
       // group name
@@ -100,21 +109,20 @@ bool Model::ReadFromObj(const std::string &filename, bool flipV_of_UV) {
       currentGroupName = line.substr(string("g ").length());
       //verticesInGroup.clear(); normalsInGroup.clear(); uvCoordinatesInGroup.clear();
       currentMaterialName = defaultMaterialName;
-      currentMaterial = &materialNames[currentMaterialName];
-      currentPolygonList = &m_meshes[*currentMaterial];
+      currentMaterialId = materialNames[currentMaterialName];
+      currentPolygonList = nullptr;
+      currentMesh = nullptr;
     } else if (line.find("usemtl ") == 0) {
       // current material name
       currentMaterialName = line.substr(string("usemtl ").length());
-      if (materialNames.find(currentMaterialName) == materialNames.end()) {
+      auto materialIt = materialNames.find(currentMaterialName);
+      if (materialIt == materialNames.end()) {
         currentMaterialName = defaultMaterialName;
+        materialIt = materialNames.find(currentMaterialName);
       }
-      currentMaterial = &materialNames[currentMaterialName];
-      if (m_meshes.find(*currentMaterial) != m_meshes.end()) {
-        currentPolygonList = &m_meshes[*currentMaterial];
-      } else {
-        m_meshes[*currentMaterial] = PolygonList();
-        currentPolygonList = &m_meshes[*currentMaterial];
-      }
+      currentMaterialId = materialIt->second;
+      currentPolygonList = nullptr;
+      currentMesh = nullptr;
     } else if (line.find("v ") == 0) {
       // vertex
       std::vector<string> vertex = Utils::split(line.substr(string("v ").length()), ' ');
@@ -149,39 +157,51 @@ bool Model::ReadFromObj(const std::string &filename, bool flipV_of_UV) {
       // face
       
       vector<string> faces = Utils::split(line.substr(string("f ").length()), ' ');
-      if (faces.size() >= 5) {
-        // triangle fan
-        for (int i = 0; i < faces.size() - 2; i++)
-        {
-          vector<string> face;
-          face.push_back(faces[0]);
-          face.push_back(faces[i+1]);
-          face.push_back(faces[i+2]);
-          PolygonPtr polygon(Load3verticesFace(face, verticesInGroup, normalsInGroup, uvCoordinatesInGroup, materialNames[currentMaterialName]));
+      if (currentPolygonList == nullptr && currentMesh == nullptr) {
+        if (materialTable.Get(currentMaterialId).emission.lengthSq() == 0) {
+          // non emissive faces share the vertices in the mesh of the material
+          TriangleMesh *&meshOfMaterial = m_triangleMeshes[currentMaterialId];
+          if (meshOfMaterial == nullptr) meshOfMaterial = m_arena.New<TriangleMesh>(currentMaterialId);
+          currentMesh = meshOfMaterial;
+        } else {
+          currentPolygonList = &m_meshes[currentMaterialId];
+        }
+      }
+
+      // triangle fan (a quad is split into (0,1,2), (0,2,3))
+      for (size_t i = 0; i + 2 < faces.size(); i++)
+      {
+        vector<string> face;
+        face.push_back(faces[0]);
+        face.push_back(faces[i+1]);
+        face.push_back(faces[i+2]);
+        if (currentMesh) {
+          Load3verticesFaceToMesh(face, verticesInGroup, normalsInGroup, uvCoordinatesInGroup, *currentMesh, meshVertexMaps[currentMesh]);
+        } else {
+          PolygonPtr polygon(Load3verticesFace(face, verticesInGroup, normalsInGroup, uvCoordinatesInGroup, currentMaterialId));
           currentPolygonList->push_back(polygon);
         }
-        //return false;
-      } else if (faces.size() == 4) {
-        vector<PolygonPtr> polygons = load4verticesFace(faces, verticesInGroup, normalsInGroup, uvCoordinatesInGroup, materialNames[currentMaterialName]);
-        currentPolygonList->push_back(polygons[0]);
-        currentPolygonList->push_back(polygons[1]);
-      } else if (faces.size() == 3) {
-        PolygonPtr polygon(Load3verticesFace(faces, verticesInGroup, normalsInGroup, uvCoordinatesInGroup, materialNames[currentMaterialName]));
-        currentPolygonList->push_back(polygon);
       }
     }
   }
 
-  unordered_map<string, Material>::iterator it,end = materialNames.end();
+  for (auto it = m_triangleMeshes.begin(); it != m_triangleMeshes.end(); it++) {
+    it->second->ConstructTriangles();
+  }
+
+  // materials of different names may be the same one in the table
+  unordered_map<string, MaterialTable::MATERIAL_ID>::iterator it,end = materialNames.end();
   m_materials.clear();
   for (it=materialNames.begin(); it!=end; it++) {
-    m_materials.push_back(it->second);
+    if (std::find(m_materials.begin(), m_materials.end(), it->second) == m_materials.end()) {
+      m_materials.push_back(it->second);
+    }
   }
 
   return true;
 }
 
-bool Model::LoadMaterialFile(const std::string &filename, std::unordered_map<string, Material> &materials) {
+bool Model::LoadMaterialFile(const std::string &filename, std::unordered_map<string, MaterialTable::MATERIAL_ID> &materials) {
   ifstream ifs(filename.c_str());
 
   // get the basedir
@@ -206,7 +226,7 @@ bool Model::LoadMaterialFile(const std::string &filename, std::unordered_map<str
   string currentMaterialName = "";
   Material currentMaterial;
 
-  Color ambient, diffuse, specular;
+  Color ambient, diffuse, specular, emission;
   ImageHandler::IMAGE_ID texture_id = ImageHandler::INVALID_IMAGE_ID;
 
   while (!ifs.eof()) {
@@ -228,9 +248,11 @@ bool Model::LoadMaterialFile(const std::string &filename, std::unordered_map<str
           currentMaterial.color = specular;
           break;
         }
-        materials[currentMaterialName] = currentMaterial;
+        currentMaterial.emission = emission;
+        materials[currentMaterialName] = MaterialTable::GetInstance().Register(currentMaterial);
       }
       currentMaterialName = line.substr(string("newmtl ").length());
+      emission = Color();
     } else if (line.find("Ns ") == 0) {
       // Shininess
       // ignore
@@ -278,6 +300,13 @@ bool Model::LoadMaterialFile(const std::string &filename, std::unordered_map<str
       specular.x = atof(values[0].c_str());
       specular.y = atof(values[1].c_str());
       specular.z = atof(values[2].c_str());
+    } else if (line.find("Ke ") == 0) {
+      // emissive color. the polygons of the material become lights (PolygonLight)
+      vector<string> values(Utils::split(line.substr(string("Ke ").length()), ' '));
+      assert (values.size() == 3);
+      emission.x = atof(values[0].c_str());
+      emission.y = atof(values[1].c_str());
+      emission.z = atof(values[2].c_str());
     } else if (line.find("map_Kd ") == 0) {
       // texture name
       string file = line.substr(string("map_Kd ").length());
@@ -297,49 +326,41 @@ bool Model::LoadMaterialFile(const std::string &filename, std::unordered_map<str
     currentMaterial.color = specular;
     break;
   }
+  currentMaterial.emission = emission;
   currentMaterial.texture_id = texture_id;
-  materials[currentMaterialName] = currentMaterial;
+  materials[currentMaterialName] = MaterialTable::GetInstance().Register(currentMaterial);
 
   return true;
 }
 
-std::vector<Model::PolygonPtr> Model::load4verticesFace(const vector<string> &face, const vector<Vector3> &verticesInGroup, 
-  const vector<Vector3> &normalsInGroup, 
-  const vector<Vector3> &uvCoordinatesInGroup, const Material &mat) {
-  vector<string> face1, face2;
-  face1.push_back(face[0]); face1.push_back(face[1]); face1.push_back(face[2]);
-  face2.push_back(face[0]); face2.push_back(face[2]); face2.push_back(face[3]);
-  PolygonPtr p1 = Load3verticesFace(face1, verticesInGroup, normalsInGroup, uvCoordinatesInGroup, mat);
-  PolygonPtr p2 = Load3verticesFace(face2, verticesInGroup, normalsInGroup, uvCoordinatesInGroup, mat);
-
-  vector<PolygonPtr> ret;
-  ret.push_back(p1); ret.push_back(p2);
+Model::FaceVertex Model::ParseFaceVertex(const std::string &str) {
+  vector<string> data(Utils::split(str, '/'));
 
-  return ret;
+  FaceVertex faceVertex = {-1, -1, -1};
+  if (data.size() == 1) {
+    faceVertex.vertex = atoi(data[0].c_str())-1;
+  }
+  if (data.size() == 2) {
+    faceVertex.vertex = atoi(data[0].c_str())-1;
+    faceVertex.uv = atoi(data[1].c_str())-1;
+  } else if (data.size() == 3) {
+    faceVertex.vertex = atoi(data[0].c_str())-1;
+    if (data[1].length() != 0) faceVertex.uv = atoi(data[1].c_str())-1;
+    faceVertex.normal = atoi(data[2].c_str())-1;
+  }
+  return faceVertex;
 }
 
 Model::PolygonPtr Model::Load3verticesFace(const vector<string> &face, const vector<Vector3> &verticesInGroup, 
   const vector<Vector3> &normalsInGroup, 
-  const vector<Vector3> &uvCoordinatesInGroup, const Material &mat) {
+  const vector<Vector3> &uvCoordinatesInGroup, MaterialTable::MATERIAL_ID materialId) {
   Vector3 vec[3], normals[3], uvs[3];
 
   bool normal_exist = false;
 
   for (size_t i=0; i<face.size(); i++) {
-    vector<string> data(Utils::split(face[i], '/'));
-
-    int vertex_number = -1; int uv_numver = -1; int normal_number = -1;
-    if (data.size() == 1) {
-      vertex_number = atoi(data[0].c_str())-1;
-    }
-    if (data.size() == 2) {
-      vertex_number = atoi(data[0].c_str())-1;
-      uv_numver = atoi(data[1].c_str())-1;
-    } else if (data.size() == 3) {
-      vertex_number = atoi(data[0].c_str())-1;
-      if (data[1].length() != 0) uv_numver = atoi(data[1].c_str())-1;
-      normal_number = atoi(data[2].c_str())-1;
-    }
+    const FaceVertex faceVertex(ParseFaceVertex(face[i]));
+    const int vertex_number = faceVertex.vertex, uv_numver = faceVertex.uv, normal_number = faceVertex.normal;
 
     assert (vertex_number != -1);
     size_t index = i;
@@ -358,12 +379,35 @@ Model::PolygonPtr Model::Load3verticesFace(const vector<string> &face, const vec
   if (!normal_exist) {
     // normal ̎wȂ
     auto auto_normal = Polygon::CalculateNormal(vec[0], vec[1], vec[2]);
-    ret_p = (new Polygon(vec[0], vec[1], vec[2], uvs[0], uvs[1], uvs[2], auto_normal, auto_normal, auto_normal, mat, Vector3(0, 0, 0)));
+    ret_p = PolygonLight::Create(m_arena, vec[0], vec[1], vec[2], uvs[0], uvs[1], uvs[2], auto_normal, auto_normal, auto_normal, materialId, Vector3(0, 0, 0));
   } else {
-    ret_p = (new Polygon(vec[0], vec[1], vec[2], uvs[0], uvs[1], uvs[2], normals[0], normals[1], normals[2], mat, Vector3(0, 0, 0)));
+    ret_p = PolygonLight::Create(m_arena, vec[0], vec[1], vec[2], uvs[0], uvs[1], uvs[2], normals[0], normals[1], normals[2], materialId, Vector3(0, 0, 0));
   }
 
   return ret_p;
 }
 
+// the same vertices as Load3verticesFace. a vertex without the normal has zero normal, and the triangle whose normals
+// are all zero uses the face normal
+void Model::Load3verticesFaceToMesh(const vector<string> &face, const vector<Vector3> &verticesInGroup,
+  const vector<Vector3> &normalsInGroup,
+  const vector<Vector3> &uvCoordinatesInGroup, TriangleMesh &mesh, MeshVertexMap &vertexMap) {
+  unsigned int indices[3];
+
+  for (size_t i=0; i<3; i++) {
+    const FaceVertex faceVertex(ParseFaceVertex(face[i]));
+    assert (faceVertex.vertex != -1);
+
+    auto it = vertexMap.find(faceVertex);
+    if (it == vertexMap.end()) {
+      const Vector3 normal(faceVertex.normal != -1 ? normalsInGroup[faceVertex.normal] : Vector3(0, 0, 0));
+      const Vector3 uv(faceVertex.uv != -1 ? uvCoordinatesInGroup[faceVertex.uv] : Vector3(0, 0, 0));
+      it = vertexMap.insert(std::make_pair(faceVertex, mesh.AddVertex(verticesInGroup[faceVertex.vertex], normal, uv))).first;
+    }
+    indices[i] = it->second;
+  }
+
+  mesh.AddTriangle(indices[0], indices[1], indices[2]);
+}
+
 }
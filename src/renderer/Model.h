@@ -5,7 +5,10 @@
 #include <unordered_map>
 #include "SceneObject.h"
 #include "Material.h"
+#include "MaterialTable.h"
 #include "Polygon.h"
+#include "TriangleMesh.h"
+#include "tools/Arena.h"
 
 
 namespace OmochiRenderer {
@@ -18,7 +21,8 @@ public:
   typedef std::vector<PolygonPtr> PolygonList;
 
 public:
-  Model();
+  // the polygons and the meshes are allocated from arena (usually the one of the scene), which owns them
+  explicit Model(Arena &arena);
   ~Model();
 
   //void setPosition(const Vector3 &pos);
@@ -34,30 +38,60 @@ public:
   size_t GetMaterialCount() const {
     return m_materials.size();
   }
-  const Material &GetMaterial(size_t i) const {
+  // the materials of the model, each once
+  MaterialTable::MATERIAL_ID GetMaterialID(size_t i) const {
     return m_materials.at(i);
   }
-  const PolygonList &GetPolygonList(const Material &mat) const {
-    return m_meshes.find(mat)->second;
+  // polygons of an emissive material (they are lights: PolygonLight)
+  const PolygonList &GetPolygonList(MaterialTable::MATERIAL_ID materialId) const {
+    static const PolygonList empty;
+    auto it = m_meshes.find(materialId);
+    return it != m_meshes.end() ? it->second : empty;
+  }
+  // triangles of a non emissive material. nullptr if the material has none
+  TriangleMesh *GetTriangleMesh(MaterialTable::MATERIAL_ID materialId) const {
+    auto it = m_triangleMeshes.find(materialId);
+    return it != m_triangleMeshes.end() ? it->second : nullptr;
+  }
+  // ǂݍ obj, mtl t@C̃Xg
+  const std::vector<std::string> &GetSourceFiles() const {
+    return m_sourceFiles;
   }
 
 private:
   void Clear();
-  bool LoadMaterialFile(const std::string &filename, std::unordered_map<std::string, Material> &materials);
-  std::vector<PolygonPtr> load4verticesFace(const std::vector<std::string> &face,
-    const std::vector<Vector3> &verticesInGroup, 
-    const std::vector<Vector3> &normalsInGroup, 
-    const std::vector<Vector3> &uvCoordinatesInGroup,
-    const Material &mat);
+  bool LoadMaterialFile(const std::string &filename, std::unordered_map<std::string, MaterialTable::MATERIAL_ID> &materials);
+  // "v", "v/vt", "v//vn" or "v/vt/vn" of a face. the numbers are 0-origin, -1 if not given
+  struct FaceVertex {
+    int vertex, uv, normal;
+    bool operator==(const FaceVertex &f) const { return vertex == f.vertex && uv == f.uv && normal == f.normal; }
+  };
+  struct FaceVertexHash {
+    size_t operator()(const FaceVertex &f) const {
+      return std::hash<long long>()((static_cast<long long>(f.vertex) * 1000003 + f.uv) * 1000003 + f.normal);
+    }
+  };
+  // the vertex of a mesh for each combination of the numbers in the faces
+  typedef std::unordered_map<FaceVertex, unsigned int, FaceVertexHash> MeshVertexMap;
+
+  static FaceVertex ParseFaceVertex(const std::string &str);
   PolygonPtr Load3verticesFace(const std::vector<std::string> &face,
     const std::vector<Vector3> &verticesInGroup, 
     const std::vector<Vector3> &normalsInGroup, 
     const std::vector<Vector3> &uvCoordinatesInGroup,
-    const Material &mat);
+    MaterialTable::MATERIAL_ID materialId);
+  void Load3verticesFaceToMesh(const std::vector<std::string> &face,
+    const std::vector<Vector3> &verticesInGroup,
+    const std::vector<Vector3> &normalsInGroup,
+    const std::vector<Vector3> &uvCoordinatesInGroup,
+    TriangleMesh &mesh, MeshVertexMap &vertexMap);
 
 private:
-  std::vector<Material> m_materials;
-  std::unordered_map<Material, PolygonList, MaterialHash, MaterialEq> m_meshes;
+  Arena &m_arena;
+  std::vector<MaterialTable::MATERIAL_ID> m_materials;
+  std::unordered_map<MaterialTable::MATERIAL_ID, PolygonList> m_meshes;
+  std::unordered_map<MaterialTable::MATERIAL_ID, TriangleMesh *> m_triangleMeshes;
+  std::vector<std::string> m_sourceFiles;
 
   Vector3 m_position;
 };
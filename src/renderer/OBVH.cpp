@@ -0,0 +1,421 @@
+#include "stdafx.h"
+
+#include <iostream>
+#include <limits>
+#include <intrin.h>
+#include <malloc.h>
+#include "OBVH.h"
+#include "BVH.h"
+
+#include "SceneObject.h"
+#include "TriangleBase.h"
+
+using namespace std;
+
+namespace OmochiRenderer {
+
+  OBVH::~OBVH() {
+  }
+
+  bool OBVH::IsSupported() {
+    static const bool supported = []() -> bool {
+      int cpuInfo[4];
+      __cpuid(cpuInfo, 1);
+      const bool osUsesXSAVE = (cpuInfo[2] & (1 << 27)) != 0;
+      const bool cpuSupportsAVX = (cpuInfo[2] & (1 << 28)) != 0;
+      if (!osUsesXSAVE || !cpuSupportsAVX) return false;
+      // the OS must save the YMM registers
+      return (_xgetbv(0) & 0x6) == 0x6;
+    }();
+    return supported;
+  }
+
+  bool OBVH::CheckIntersection(const Ray &ray, SceneIntersectionInformation &info) const {
+
+    info.hit.distance = INF;
+
+    // initialize
+    const int rayDirSign[3] = {
+      ray.dir.x >= 0 ? 0 : 1,
+      ray.dir.y >= 0 ? 0 : 1,
+      ray.dir.z >= 0 ? 0 : 1
+    };
+    const int rayOctant = rayDirSign[0] | (rayDirSign[1] << 1) | (rayDirSign[2] << 2);
+
+    const __m256 zero_m256 = _mm256_setzero_ps();
+
+    const __m256 rayOrg[3] = {
+      _mm256_set1_ps(static_cast<float>(ray.orig.x)),
+      _mm256_set1_ps(static_cast<float>(ray.orig.y)),
+      _mm256_set1_ps(static_cast<float>(ray.orig.z))
+    };
+    const __m256 rayDirection[3] = {
+      _mm256_set1_ps(static_cast<float>(ray.dir.x)),
+      _mm256_set1_ps(static_cast<float>(ray.dir.y)),
+      _mm256_set1_ps(static_cast<float>(ray.dir.z))
+    };
+    const __m256 inversedRayDir[3] = {
+      _mm256_set1_ps(ray.dir.x == 0 ? static_cast<float>(INF) : static_cast<float>(1.0f/ray.dir.x)),
+      _mm256_set1_ps(ray.dir.y == 0 ? static_cast<float>(INF) : static_cast<float>(1.0f/ray.dir.y)),
+      _mm256_set1_ps(ray.dir.z == 0 ? static_cast<float>(INF) : static_cast<float>(1.0f/ray.dir.z))
+    };
+
+    float currentShortestDistance = std::numeric_limits<float>::max();
+
+    const OBVH_structure *root = m_root.get();
+
+    // search loop
+    __declspec(align(32)) float distancesToAABB[8];
+    // the stack is bounded by the tree (see CalcTraversalStackSize_internal), so it is allocated on the stack
+    unsigned int *indicesStack = static_cast<unsigned int *>(_alloca(sizeof(unsigned int) * m_traversalStackSize));
+    size_t stackSize = 0;
+    indicesStack[stackSize++] = 0;  // root index
+    while (stackSize > 0) {
+      const unsigned int nextIndex = indicesStack[--stackSize];
+
+      assert (nextIndex < m_usedNodeCount);
+
+      const OBVH_structure *node = &root[nextIndex];
+
+      // boxes farther than the current nearest hit are culled by tmax
+      __m256 distances;
+      const int hitMask = BoundingBox::CheckIntersection8floatAABB(
+        node->bboxes, rayOrg, inversedRayDir, rayDirSign, zero_m256, _mm256_set1_ps(currentShortestDistance), distances);
+      if (hitMask == 0) continue;
+      _mm256_store_ps(distancesToAABB, distances);
+
+      // visit the children from near to far: check leaves at once, and push inner nodes so that the nearest is popped first
+      unsigned int innerNodes[8];
+      int innerNodeCount = 0;
+      const unsigned int order = node->childOrders[rayOctant];
+      for (int i = 0; i < 8; i++) {
+        const unsigned int childindex = (order >> (4 * i)) & 0xF;
+        if (childindex == CHILD_ORDER_END) break;
+        if (((hitMask >> childindex) & 0x01) == 0 || distancesToAABB[childindex] > currentShortestDistance) continue;
+
+        const unsigned int child = node->children[childindex];
+        if (IsChildindexLeaf(child)) {
+          // this child node is a leaf
+          SceneIntersectionInformation infoTmp;
+          if (CheckIntersection_Leaf(ray, rayOrg, rayDirection, GetIndexOfObjectInChildLeaf(child), currentShortestDistance, infoTmp)) {
+            if (info.hit.distance > infoTmp.hit.distance) {
+              info = infoTmp;
+              currentShortestDistance = static_cast<float>(info.hit.distance);
+            }
+          }
+        } else {
+          innerNodes[innerNodeCount++] = child;
+        }
+      }
+      while (innerNodeCount > 0) {
+        assert (stackSize < m_traversalStackSize);
+        indicesStack[stackSize++] = innerNodes[--innerNodeCount];
+      }
+    }
+
+    // avoid AVX-SSE transition penalties in the callers
+    _mm256_zeroupper();
+    return false;
+  }
+
+  bool OBVH::CheckIntersection_Leaf(const Ray &ray, const __m256 rayOrig[3], const __m256 rayDir[3], size_t leafIndex, float tmax,
+    SceneIntersectionInformation &hitResultDetail) const
+  {
+    const LeafInfo &leaf = m_leaves[leafIndex];
+    double nearestDist = -1;
+
+    // polygons: intersect whole blocks, then resolve only the nearest one in double (as QBVH)
+    const TriangleBlock8 *blocks = m_triangleBlocks.get();
+    size_t nearestPolygonIndex = 0;
+    float nearestU = 0, nearestV = 0;
+    for (unsigned int i=leaf.firstBlock; i<leaf.firstBlock+leaf.blockCount; i++) {
+      float u, v;
+      const int lane = blocks[i].Intersect(rayOrig, rayDir, tmax, u, v);
+      if (lane >= 0) {
+        nearestPolygonIndex = i * TriangleBlock8::WIDTH + lane;
+        nearestU = u; nearestV = v;
+        nearestDist = tmax;
+      }
+    }
+    if (nearestDist >= 0) {
+      const TriangleBase *polygon = static_cast<const TriangleBase *>(m_triangleBlockObjects[nearestPolygonIndex]);
+      if (!polygon->CheckIntersection(ray, hitResultDetail.hit)) {
+        polygon->CalcHitInformation(ray, nearestDist, nearestU, nearestV, hitResultDetail.hit);
+      }
+      hitResultDetail.object = m_triangleBlockObjects[nearestPolygonIndex];
+      nearestDist = hitResultDetail.hit.distance;
+    }
+
+    // other objects
+    HitInformation info;
+    for (size_t i=leaf.firstObject; m_leafObjectArray[i]; i++) {
+      assert (i+1<m_leafObjectArray.size());
+
+      const SceneObject *obj = m_leafObjectArray[i];
+      if (obj->CheckIntersection(ray, info) && (nearestDist < 0 || info.distance < nearestDist)) {
+        hitResultDetail.hit = info;
+        hitResultDetail.object = m_leafObjectArray[i];
+        nearestDist = info.distance;
+      }
+    }
+
+    return (nearestDist >= 0);
+  }
+
+  bool OBVH::Occluded(const Ray &ray, double maxDistance) const {
+    // any hit closer than maxDistance terminates the traversal, so the children are not ordered
+    const int rayDirSign[3] = {
+      ray.dir.x >= 0 ? 0 : 1,
+      ray.dir.y >= 0 ? 0 : 1,
+      ray.dir.z >= 0 ? 0 : 1
+    };
+    const __m256 rayOrg[3] = {
+      _mm256_set1_ps(static_cast<float>(ray.orig.x)),
+      _mm256_set1_ps(static_cast<float>(ray.orig.y)),
+      _mm256_set1_ps(static_cast<float>(ray.orig.z))
+    };
+    const __m256 rayDirection[3] = {
+      _mm256_set1_ps(static_cast<float>(ray.dir.x)),
+      _mm256_set1_ps(static_cast<float>(ray.dir.y)),
+      _mm256_set1_ps(static_cast<float>(ray.dir.z))
+    };
+    const __m256 inversedRayDir[3] = {
+      _mm256_set1_ps(ray.dir.x == 0 ? static_cast<float>(INF) : static_cast<float>(1.0f/ray.dir.x)),
+      _mm256_set1_ps(ray.dir.y == 0 ? static_cast<float>(INF) : static_cast<float>(1.0f/ray.dir.y)),
+      _mm256_set1_ps(ray.dir.z == 0 ? static_cast<float>(INF) : static_cast<float>(1.0f/ray.dir.z))
+    };
+    const __m256 tmax_m256 = _mm256_set1_ps(static_cast<float>(maxDistance));
+
+    const OBVH_structure *root = m_root.get();
+    __m256 distances;
+    bool occluded = false;
+
+    unsigned int *indicesStack = static_cast<unsigned int *>(_alloca(sizeof(unsigned int) * m_traversalStackSize));
+    size_t stackSize = 0;
+    indicesStack[stackSize++] = 0;  // root index
+    while (stackSize > 0 && !occluded) {
+      const OBVH_structure *node = &root[indicesStack[--stackSize]];
+
+      const int hitMask = BoundingBox::CheckIntersection8floatAABB(
+        node->bboxes, rayOrg, inversedRayDir, rayDirSign, _mm256_setzero_ps(), tmax_m256, distances);
+      for (int childindex = 0; childindex < 8 && !occluded; childindex++) {
+        if (((hitMask >> childindex) & 0x01) == 0) continue;
+        const unsigned int child = node->children[childindex];
+        if (child == GetInvalidChildIndex()) continue;
+        if (IsChildindexLeaf(child)) {
+          occluded = Occluded_Leaf(ray, rayOrg, rayDirection, GetIndexOfObjectInChildLeaf(child), maxDistance);
+        } else {
+          assert (stackSize < m_traversalStackSize);
+          indicesStack[stackSize++] = child;
+        }
+      }
+    }
+
+    // avoid AVX-SSE transition penalties in the callers
+    _mm256_zeroupper();
+    return occluded;
+  }
+
+  bool OBVH::Occluded_Leaf(const Ray &ray, const __m256 rayOrig[3], const __m256 rayDir[3], size_t leafIndex, double maxDistance) const {
+    const LeafInfo &leaf = m_leaves[leafIndex];
+
+    const TriangleBlock8 *blocks = m_triangleBlocks.get();
+    const float tmax = static_cast<float>(maxDistance);
+    for (unsigned int i=leaf.firstBlock; i<leaf.firstBlock+leaf.blockCount; i++) {
+      if (blocks[i].Occluded(rayOrig, rayDir, tmax)) return true;
+    }
+    for (size_t i=leaf.firstObject; m_leafObjectArray[i]; i++) {
+      if (m_leafObjectArray[i]->CheckOcclusion(ray, maxDistance)) return true;
+    }
+    return false;
+  }
+
+  bool OBVH::Construct(const std::vector<SceneObject *> &targets, const BVH::CONSTRUCTION_TYPE bvhConstructionType) {
+    if (targets.size() == 0) return false;
+
+    // at first, construct BVH
+    BVH bvh;
+    if (!bvh.Construct(bvhConstructionType, targets)) return false;
+
+    // each node consumes at least one inner node of the BVH (or the root leaf)
+    m_allocatedNodeCount = bvh.GetBVHNodeCount();
+    OBVH_structure *alignedRoot = new(_aligned_malloc(sizeof(OBVH_structure)*m_allocatedNodeCount, 32)) OBVH_structure[m_allocatedNodeCount];
+    m_root.reset(alignedRoot, [](void *p){_aligned_free(p);});
+    m_usedNodeCount = 1; // for the root node
+
+    m_leaves.clear();
+    m_triangleBlockObjects.clear(); m_triangleBlockObjects.reserve(targets.size()*2);
+    m_leafObjectArray.clear();
+
+    // flatten the BVH structure to OBVH structure
+    std::vector<const BVH::BVH_structure *> children;
+    CollectChildren_internal(bvh, bvh.GetRootNode(), children);
+    Construct_internal(0, bvh, children);
+
+    BuildTriangleBlocks_internal();
+    CalcTraversalStackSize_internal();
+
+    return true;
+  }
+
+  // collects (up to) 8 descendants of the node by opening the largest inner node one by one
+  void OBVH::CollectChildren_internal(const BVH &bvh, const BVH::BVH_structure *node, std::vector<const BVH::BVH_structure *> &children) const {
+    children.clear();
+    if (bvh.IsLeaf(node)) {
+      children.push_back(node);
+      return;
+    }
+    children.push_back(bvh.GetFirstChild(node));
+    children.push_back(bvh.GetSecondChild(node));
+
+    while (children.size() < 8) {
+      int largest = -1;
+      float largestArea = -1.0f;
+      for (size_t i=0; i<children.size(); i++) {
+        if (bvh.IsLeaf(children[i])) continue;
+        const float area = BoundingBox::CalcSurfaceArea(children[i]->box[0], children[i]->box[1]);
+        if (area > largestArea) {
+          largestArea = area;
+          largest = static_cast<int>(i);
+        }
+      }
+      if (largest == -1) break; // all are leaves
+
+      const BVH::BVH_structure *opened = children[largest];
+      children[largest] = bvh.GetFirstChild(opened);
+      children.push_back(bvh.GetSecondChild(opened));
+    }
+  }
+
+  void OBVH::Construct_internal(size_t index, const BVH &bvh, const std::vector<const BVH::BVH_structure *> &children) {
+    __declspec(align(32)) float eight_boxes[2][3][8]; // min-max * xyz * 8box
+    float centers[8][3];
+
+    // empty slots never intersect
+    for (int xyz=0; xyz<3; xyz++) for (int i=0; i<8; i++) {
+      eight_boxes[0][xyz][i] = std::numeric_limits<float>::max();
+      eight_boxes[1][xyz][i] = -std::numeric_limits<float>::max();
+    }
+
+    unsigned int childIndices[8];
+    std::vector<const BVH::BVH_structure *> grandchildren;
+    for (size_t i=0; i<8; i++) {
+      if (i >= children.size()) {
+        childIndices[i] = GetInvalidChildIndex();
+        continue;
+      }
+      const BVH::BVH_structure *child = children[i];
+      for (int xyz=0; xyz<3; xyz++) {
+        eight_boxes[0][xyz][i] = child->box[0][xyz];
+        eight_boxes[1][xyz][i] = child->box[1][xyz];
+        centers[i][xyz] = (child->box[0][xyz] + child->box[1][xyz]) * 0.5f;
+      }
+
+      if (bvh.IsLeaf(child)) {
+        childIndices[i] = MakeLeaf_internal(child);
+      } else {
+        const size_t nextNewNodeIndex = m_usedNodeCount;
+        if (nextNewNodeIndex >= m_allocatedNodeCount) {
+          cerr << "Allocated OBVH nodes are not sufficient!!" << endl;
+          exit(-1);
+        }
+        m_usedNodeCount++;
+        childIndices[i] = static_cast<unsigned int>(nextNewNodeIndex);
+        CollectChildren_internal(bvh, child, grandchildren);
+        Construct_internal(nextNewNodeIndex, bvh, grandchildren);
+      }
+    }
+
+    OBVH_structure *current = &m_root.get()[index];
+    for (int i=0; i<8; i++) current->children[i] = childIndices[i];
+    for (int min_max=0; min_max<2; min_max++) for (int xyz=0; xyz<3; xyz++) {
+      current->bboxes[min_max][xyz] = _mm256_load_ps(eight_boxes[min_max][xyz]);
+    }
+
+    // child orders: sort the centers along the diagonal direction of each octant
+    const int childCount = static_cast<int>(children.size());
+    for (int octant=0; octant<8; octant++) {
+      const float dir[3] = {(octant & 1) ? -1.0f : 1.0f, (octant & 2) ? -1.0f : 1.0f, (octant & 4) ? -1.0f : 1.0f};
+      int slots[8];
+      float keys[8];
+      for (int i=0; i<childCount; i++) {
+        slots[i] = i;
+        keys[i] = centers[i][0]*dir[0] + centers[i][1]*dir[1] + centers[i][2]*dir[2];
+      }
+      std::sort(slots, slots + childCount, [&keys](int a, int b) { return keys[a] < keys[b]; });
+
+      unsigned int order = 0;
+      for (int i=0; i<8; i++) {
+        const unsigned int slot = i < childCount ? static_cast<unsigned int>(slots[i]) : CHILD_ORDER_END;
+        order |= slot << (4 * i);
+      }
+      current->childOrders[octant] = order;
+    }
+  }
+
+  unsigned int OBVH::MakeLeaf_internal(const BVH::BVH_structure *leaf) {
+    LeafInfo leafInfo;
+    leafInfo.firstBlock = static_cast<unsigned int>(m_triangleBlockObjects.size() / TriangleBlock8::WIDTH);
+    leafInfo.firstObject = static_cast<unsigned int>(m_leafObjectArray.size());
+    for (int j=0; leaf->objects[j] != NULL; j++) {
+      if (dynamic_cast<const TriangleBase *>(leaf->objects[j])) {
+        m_triangleBlockObjects.push_back(leaf->objects[j]);
+      } else {
+        m_leafObjectArray.push_back(leaf->objects[j]);
+      }
+    }
+    while (m_triangleBlockObjects.size() % TriangleBlock8::WIDTH != 0) m_triangleBlockObjects.push_back(NULL);
+    m_leafObjectArray.push_back(NULL);
+    leafInfo.blockCount = static_cast<unsigned int>(m_triangleBlockObjects.size() / TriangleBlock8::WIDTH) - leafInfo.firstBlock;
+
+    m_leaves.push_back(leafInfo);
+    return SetChildindexAsLeaf(static_cast<unsigned int>(m_leaves.size() - 1));
+  }
+
+  // each inner node pops one entry and pushes at most 8 inner children,
+  // so the traversal stack never exceeds (7 * max depth of inner nodes + 1) entries
+  void OBVH::CalcTraversalStackSize_internal() {
+    size_t maxDepth = 0;
+    std::vector<std::pair<unsigned int, size_t> > indicesStack; // (index, depth)
+    indicesStack.push_back(std::make_pair(0u, static_cast<size_t>(0)));
+    while (!indicesStack.empty()) {
+      const std::pair<unsigned int, size_t> current = indicesStack.back();
+      indicesStack.pop_back();
+      if (current.second > maxDepth) maxDepth = current.second;
+      const OBVH_structure &node = m_root.get()[current.first];
+      for (int i=0; i<8; i++) {
+        if (!IsChildindexLeaf(node.children[i])) {
+          indicesStack.push_back(std::make_pair(node.children[i], current.second + 1));
+        }
+      }
+    }
+    m_traversalStackSize = 7 * maxDepth + 1;
+  }
+
+  void OBVH::BuildTriangleBlocks_internal() {
+    const size_t blockCount = m_triangleBlockObjects.size() / TriangleBlock8::WIDTH;
+    m_triangleBlocks.reset();
+    if (blockCount == 0) return;
+
+    TriangleBlock8 *blocks = static_cast<TriangleBlock8 *>(_aligned_malloc(sizeof(TriangleBlock8)*blockCount, 32));
+    memset(blocks, 0, sizeof(TriangleBlock8)*blockCount);
+    for (size_t i=0; i<m_triangleBlockObjects.size(); i++) {
+      if (m_triangleBlockObjects[i] == NULL) continue;
+      blocks[i / TriangleBlock8::WIDTH].Set(static_cast<int>(i % TriangleBlock8::WIDTH), static_cast<const TriangleBase *>(m_triangleBlockObjects[i]));
+    }
+    m_triangleBlocks.reset(blocks, [](void *p){_aligned_free(p);});
+  }
+
+  unsigned int OBVH::SetChildindexAsLeaf(unsigned int childindex) {
+    return 0x80000000u | childindex;
+  }
+  unsigned int OBVH::GetInvalidChildIndex() {
+    return static_cast<unsigned int>(-1);
+  }
+  bool OBVH::IsChildindexLeaf(unsigned int childindex) {
+    return (0x80000000u & childindex) != 0;
+  }
+  unsigned int OBVH::GetIndexOfObjectInChildLeaf(unsigned int childleafindex) {
+    return 0x80000000u ^ childleafindex;
+  }
+}
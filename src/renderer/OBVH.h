@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <immintrin.h>
+#include "scenes/IntersectionInformation.h"
+#include "BVH.h"
+#include "TriangleBlock.h"
+
+namespace OmochiRenderer {
+  class SceneObject;
+  class Ray;
+
+  // 8-ary BVH: each node tests 8 boxes at once with AVX.
+  // Constructed by collapsing (about) three levels of a binary BVH into each node.
+  class OBVH {
+  public:
+    explicit OBVH() : m_root(), m_allocatedNodeCount(0), m_usedNodeCount(0), m_traversalStackSize(0), m_leaves(), m_triangleBlocks(), m_triangleBlockObjects(), m_leafObjectArray() {}
+    ~OBVH();
+
+    // true if this CPU and OS support AVX
+    static bool IsSupported();
+
+    bool Construct(const std::vector<SceneObject *> &targets, const BVH::CONSTRUCTION_TYPE bvhConstructionType = BVH::CONSTRUCTION_OBJECT_SAH);
+    bool CheckIntersection(const Ray &ray, SceneIntersectionInformation &info) const;
+    // true if anything is hit closer than maxDistance (for shadow rays)
+    bool Occluded(const Ray &ray, double maxDistance) const;
+
+  private:
+    void Construct_internal(size_t index, const BVH &bvh, const std::vector<const BVH::BVH_structure *> &children);
+    void CollectChildren_internal(const BVH &bvh, const BVH::BVH_structure *node, std::vector<const BVH::BVH_structure *> &children) const;
+    unsigned int MakeLeaf_internal(const BVH::BVH_structure *leaf);
+    void BuildTriangleBlocks_internal();
+    void CalcTraversalStackSize_internal();
+
+    bool CheckIntersection_Leaf(const Ray &ray, const __m256 rayOrig[3], const __m256 rayDir[3], size_t leafIndex, float tmax,
+      SceneIntersectionInformation &hitResultDetail) const;
+    bool Occluded_Leaf(const Ray &ray, const __m256 rayOrig[3], const __m256 rayDir[3], size_t leafIndex, double maxDistance) const;
+
+    static unsigned int SetChildindexAsLeaf(unsigned int childindex);
+    static unsigned int GetInvalidChildIndex();
+    static bool IsChildindexLeaf(unsigned int childindex);
+    static unsigned int GetIndexOfObjectInChildLeaf(unsigned int childleafindex);
+
+  private:
+    struct OBVH_structure {
+      __m256 bboxes[2][3];            // 8 float min-max xyz
+      unsigned int children[8];       // 8 children
+      // child slots from near to far, for each sign pattern of the ray direction (bit0: x<0, bit1: y<0, bit2: z<0).
+      // 4 bits per slot, 0xF after the last valid child
+      unsigned int childOrders[8];
+    };
+    static const unsigned int CHILD_ORDER_END = 0xF;
+
+    std::shared_ptr<OBVH_structure> m_root;
+    size_t m_allocatedNodeCount, m_usedNodeCount;
+    size_t m_traversalStackSize; // entries required by the traversal stack of CheckIntersection
+
+    // a leaf child index points to m_leaves
+    struct LeafInfo {
+      unsigned int firstBlock;   // polygons: m_triangleBlocks[firstBlock, firstBlock+blockCount)
+      unsigned int blockCount;
+      unsigned int firstObject;  // other objects: m_leafObjectArray[firstObject...] (NULL terminated)
+    };
+    std::vector<LeafInfo> m_leaves;
+    std::shared_ptr<TriangleBlock8> m_triangleBlocks;
+    std::vector<SceneObject *> m_triangleBlockObjects; // TriangleBlock8::WIDTH objects for each block (NULL for empty lanes)
+    std::vector<SceneObject *> m_leafObjectArray;
+  };
+}
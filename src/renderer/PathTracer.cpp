@@ -4,14 +4,33 @@
 #include "PathTracer.h"
 #include "Ray.h"
 #include "tools/Random.h"
+#include "tools/SobolSampler.h"
 #include "IBL.h"
 
 #include <sstream>
+#include <omp.h>
 
 using namespace std;
 
 namespace OmochiRenderer {
 
+namespace {
+  inline Color Multiply(const Color &a, const Color &b) {
+    return Color(a.x*b.x, a.y*b.y, a.z*b.z);
+  }
+
+  inline double Luminance(const Color &c) {
+    return 0.298912 * c.x + 0.586611 * c.y + 0.114478 * c.z;
+  }
+
+  // MIS weight of a sample taken with pdf, when the same path can also be sampled with otherPdf
+  inline double PowerHeuristic(double pdf, double otherPdf) {
+    return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+  }
+}
+
+const double PathTracer::ADAPTIVE_LUMINANCE_FLOOR = 0.01;
+
 PathTracer::PathTracer(const Camera &camera, int samples, int supersamples)
   : Renderer()
   , m_camera(camera)
@@ -38,6 +57,16 @@ void PathTracer::init(const Camera &camera, int min_samples, int max_samples, in
   m_renderFinishCallback = callback;
 
   m_checkIntersectionCount = 0;
+  m_processedTileCount = 0;
+  m_tileSize = TileScheduler::DEFAULT_TILE_SIZE;
+  m_tileOrder = TileScheduler::TILE_ORDER_HILBERT;
+  m_tileCenterOut = true;
+  m_samplerType = Sampler::SAMPLER_TYPE_SOBOL;
+  m_adaptiveErrorThreshold = 0.0;
+  m_adaptiveMinSamples = 0;
+  m_stopWhenConverged = false;
+  m_convergedPixelCount = 0;
+  m_lightSampler = nullptr;
   m_result = new Color[m_camera.GetScreenHeight()*m_camera.GetScreenWidth()];
 }
 
@@ -48,12 +77,19 @@ PathTracer::~PathTracer()
 
 void PathTracer::RenderScene(const Scene &scene) {
 
-  // XN[S
-  const Vector3 screen_center = m_camera.GetScreenCenterPosition();
-
   m_omittedRayCount = 0;
   m_hitToLightCount = 0;
   m_previous_samples = 0;
+  m_lightSampler = &scene.GetLightSampler();
+  m_tileScheduler = std::make_shared<TileScheduler>(
+    static_cast<int>(m_camera.GetScreenWidth()), static_cast<int>(m_camera.GetScreenHeight()), m_tileSize, m_tileOrder, m_tileCenterOut);
+
+  const size_t pixelCount = m_camera.GetScreenHeight()*m_camera.GetScreenWidth();
+  m_radianceSum.assign(pixelCount, Color());
+  m_luminanceSum.assign(pixelCount, 0.0);
+  m_luminanceSquaredSum.assign(pixelCount, 0.0);
+  m_pixelSampleCount.assign(pixelCount, 0);
+  m_convergedPixelCount = 0;
   for (m_currentSamples = m_min_samples; m_currentSamples <= m_max_samples && m_enableRendering; m_currentSamples += m_step_samples) {
     clock_t t1, t2;
     t1 = clock();
@@ -68,72 +104,222 @@ void PathTracer::RenderScene(const Scene &scene) {
     if (m_renderFinishCallback) {
       m_renderFinishCallback(m_currentSamples, m_result, pastsec / 60.0);
     }
+
+    if (m_adaptiveErrorThreshold > 0.0) {
+      m_convergedPixelCount = 0;
+      for (size_t i = 0; i < pixelCount; i++) {
+        if (IsPixelConverged(static_cast<int>(i))) m_convergedPixelCount++;
+      }
+      cerr << "converged pixels = " << m_convergedPixelCount * 100.0 / pixelCount << "%" << endl;
+      if (m_stopWhenConverged && m_convergedPixelCount == pixelCount) {
+        cerr << "all pixels converged." << endl;
+        break;
+      }
+    }
   }
 }
 
+// relative standard error of the mean luminance of the pixel
+double PathTracer::EstimatePixelError(int index) const {
+  const int n = m_pixelSampleCount[index];
+  if (n < 2) return INF;
+  const double mean = m_luminanceSum[index] / n;
+  const double variance = std::max(0.0, (m_luminanceSquaredSum[index] - mean * m_luminanceSum[index]) / (n - 1));
+  return sqrt(variance / n) / std::max(mean, ADAPTIVE_LUMINANCE_FLOOR);
+}
+
+bool PathTracer::IsPixelConverged(int index) const {
+  if (m_adaptiveErrorThreshold <= 0.0) return false;
+  if (m_pixelSampleCount[index] < m_adaptiveMinSamples * m_supersamples * m_supersamples) return false;
+  return EstimatePixelError(index) <= m_adaptiveErrorThreshold;
+}
+
+// number of samples (per sub pixel) to trace for the pixel in this pass.
+// converged pixels get none, the others get more the larger their error is
+int PathTracer::SamplesForPixel(int index, int passSamples) const {
+  if (m_adaptiveErrorThreshold <= 0.0) return passSamples;
+  if (m_pixelSampleCount[index] < m_adaptiveMinSamples * m_supersamples * m_supersamples) return passSamples;
+
+  const double errorRatio = EstimatePixelError(index) / m_adaptiveErrorThreshold;
+  if (errorRatio <= 1.0) return 0;
+  return passSamples * static_cast<int>(std::min<double>(ADAPTIVE_MAX_SAMPLE_FACTOR, ceil(errorRatio)));
+}
+
 void PathTracer::ScanPixelsAndCastRays(const Scene &scene, int previous_samples, int next_samples) {
-  m_processed_y_counts = 0;
+  m_processedTileCount = 0;
 
-  const size_t height = m_camera.GetScreenHeight();
-  const size_t width = m_camera.GetScreenWidth();
+  const int height = static_cast<int>(m_camera.GetScreenHeight());
+  const int width = static_cast<int>(m_camera.GetScreenWidth());
+  const int tileCount = static_cast<int>(m_tileScheduler->GetTiles().size());
 
   // trace all pixels
-  const double averaging_factor = next_samples * m_supersamples * m_supersamples;
-#pragma omp parallel for schedule(dynamic, 1)
-  for (int y = 0; y<(signed)height; y++) {
-    Random rnd(y+1+previous_samples*height);
-    for (int x = 0; x<(signed)width && m_enableRendering; x++) {
-      const int index = x + (height - y - 1)*width;
-
-      Color accumulated_radiance;
-
-      // super-sampling
-      for (int sy = 0; sy<m_supersamples && m_enableRendering; sy++) for (int sx = 0; sx < m_supersamples && m_enableRendering; sx++) {
-        // (x,y)sNZł̈ʒu: [0,1]
-        const double rx = (2.0*sx + 1.0)/(2*m_supersamples);
-        const double ry = (2.0*sy + 1.0)/(2*m_supersamples);
-
-        Ray ray(m_camera.SampleRayForPixel(x + rx, y + ry, rnd));
-
-        // (m_samples)TvO
-        for (int s=previous_samples+1; s<=next_samples; s++) {
-          accumulated_radiance += Radiance(scene, ray, rnd, 0);
-          m_omittedRayCount++;
+  m_tileScheduler->Run(std::max(1, omp_get_max_threads()), [&](const TileScheduler::Tile &tile) {
+    std::unique_ptr<Sampler> sampler;
+    if (m_samplerType == Sampler::SAMPLER_TYPE_SOBOL) {
+      sampler.reset(new SobolSampler());
+    } else {
+      sampler.reset(new Random(tile.index + 1 + previous_samples*tileCount));
+    }
+    Sampler &rnd = *sampler;
+    for (int y = tile.y; y < tile.y + tile.height && m_enableRendering; y++) {
+      // neighbouring pixels in a row are traced together as a packet of coherent camera rays
+      for (int x0 = tile.x; x0 < tile.x + tile.width && m_enableRendering; x0 += Scene::RAY_PACKET_SIZE) {
+        const int pixelCount = std::min(Scene::RAY_PACKET_SIZE, tile.x + tile.width - x0);
+
+        int samples[Scene::RAY_PACKET_SIZE];
+        int maxSamples = 0;
+        for (int i = 0; i < pixelCount; i++) {
+          samples[i] = SamplesForPixel(x0 + i + (height - y - 1)*width, next_samples - previous_samples);
+          maxSamples = std::max(maxSamples, samples[i]);
+        }
+        if (maxSamples == 0) continue;
+
+        Color accumulated_radiance[Scene::RAY_PACKET_SIZE];
+        double luminance_sum[Scene::RAY_PACKET_SIZE] = { 0 };
+        double luminance_squared_sum[Scene::RAY_PACKET_SIZE] = { 0 };
+
+        // super-sampling
+        for (int sy = 0; sy<m_supersamples && m_enableRendering; sy++) for (int sx = 0; sx < m_supersamples && m_enableRendering; sx++) {
+          const int subpixel = sy*m_supersamples + sx;
+
+          Ray rays[Scene::RAY_PACKET_SIZE];
+          for (int i = 0; i < pixelCount; i++) {
+            // the camera ray takes the first dimensions of the first sample traced with it
+            const int index = x0 + i + (height - y - 1)*width;
+            rnd.StartSample(index, m_pixelSampleCount[index] + subpixel*samples[i]);
+            // (x,y)sNZł̈ʒu: [0,1]
+            double rx, ry;
+            rnd.next2D(rx, ry);
+            rx = (sx + rx) / m_supersamples;
+            ry = (sy + ry) / m_supersamples;
+            rays[i] = m_camera.SampleRayForPixel(x0 + i + rx, y + ry, rnd);
+          }
+
+          // the camera ray is the same for all the samples, so is its intersection
+          Scene::IntersectionInformation intersections[Scene::RAY_PACKET_SIZE];
+          const int intersectedMask = scene.CheckIntersectionPacket(rays, pixelCount, intersections);
+          m_checkIntersectionCount += pixelCount;
+
+          for (int i = 0; i < pixelCount; i++) {
+            const bool intersected = ((intersectedMask >> i) & 1) != 0;
+            // (samples[i])TvO
+            for (int s = 0; s < samples[i]; s++) {
+              const int index = x0 + i + (height - y - 1)*width;
+              rnd.StartSample(index, m_pixelSampleCount[index] + subpixel*samples[i] + s, CAMERA_SAMPLE_DIMENSIONS);
+              const Color radiance = Radiance(scene, rays[i], rnd, intersected, intersections[i]);
+              accumulated_radiance[i] += radiance;
+              const double luminance = Luminance(radiance);
+              luminance_sum[i] += luminance;
+              luminance_squared_sum[i] += luminance * luminance;
+              m_omittedRayCount++;
+            }
+          }
+        }
+        for (int i = 0; i < pixelCount; i++) {
+          if (samples[i] == 0) continue;
+          const int index = x0 + i + (height - y - 1)*width;
+          m_radianceSum[index] += accumulated_radiance[i];
+          m_luminanceSum[index] += luminance_sum[i];
+          m_luminanceSquaredSum[index] += luminance_squared_sum[i];
+          m_pixelSampleCount[index] += samples[i] * m_supersamples * m_supersamples;
+          // the pixels have different sample counts, so each one is the mean of its own samples
+          m_result[index] = m_radianceSum[index] / m_pixelSampleCount[index];
         }
       }
-      // img_n+c(x) = n/(n+c)*img_n(x) + 1/(n+c)*sum_{n+1}^{n+c}rad_i(x)/supersamples^2
-      m_result[index] = m_result[index] * (static_cast<double>(previous_samples) / next_samples) + accumulated_radiance / averaging_factor;
     }
-    m_processed_y_counts++;
-    //cerr << "y = " << y << ": " << static_cast<double>(m_processed_y_counts)/height*100 << "% finished" << endl;
-
-  }
+    m_processedTileCount++;
+  });
 }
 
 const static int MinDepth = 5;
 const static int MaxDepth = 64;
 
-Color PathTracer::Radiance(const Scene &scene, const Ray &ray, Random &rnd, const int depth) {
-  Scene::IntersectionInformation intersect;
+// pXċAɒǐՂ
+// ܂ł̏d݂ throughput ƂĎAe˂ł throughput * (̓_ł̊^) Ĉ{̃CŎ֐i
+Color PathTracer::Radiance(const Scene &scene, const Ray &cameraRay, Sampler &rnd, const bool cameraRayIntersected, const Scene::IntersectionInformation &cameraRayIntersection) {
+  Color radiance;
+  Color throughput(1, 1, 1);
+  Ray ray(cameraRay);
+  bool intersected = cameraRayIntersected;
+  Scene::IntersectionInformation intersect(cameraRayIntersection);
+  // solid angle pdf of the direction sampled by the previous Lambert bounce, where the lights and the IBL were also
+  // sampled (NEE). 0 if they were not sampled there (camera, specular, refraction): the emission of the hit counts fully
+  double bsdfPdf = 0.0;
+  Vector3 bsdfOrigin, bsdfNormal;
+
+  for (int depth = 0; ; depth++) {
+    if (depth > 0) {
+      m_checkIntersectionCount++;
+      intersected = scene.CheckIntersection(ray, intersect);
+    }
 
-  m_checkIntersectionCount++;
-  bool intersected = scene.CheckIntersection(ray, intersect);
+    if (!intersected) {
+      if (scene.GetIBL()) {
+        const IBL *ibl = scene.GetIBL();
+        // the environment was also sampled at the previous Lambert bounce (MIS)
+        const double weight = bsdfPdf > 0.0 && ibl->HasImportanceSamplingMap() ? PowerHeuristic(bsdfPdf, ibl->Pdf(ray.dir)) : 1.0;
+        //radiance += Multiply(throughput, scene.GetIBL()->Sample(ray));    // mɔwiƂ̏ՓˈʒuvZ
+        radiance += Multiply(throughput, ibl->Sample(ray.dir)) * weight; // C_n܂ĂƂ݂ȂČvZ
+      } else {
+        radiance += Multiply(throughput, scene.Background());
+      }
+      break;
+    }
 
-  Vector3 normal;
+    const Material &material = intersect.object->GetMaterial();
+    const Vector3 normal = intersect.hit.normal.dot(ray.dir) < 0.0 ? intersect.hit.normal : intersect.hit.normal * -1.0;
+    const Color &textured = intersect.texturedHitpointColor = material.GetTexturedColor(intersect.hit.uv);
 
-  if (intersected) {
-    normal = intersect.hit.normal.dot(ray.dir) < 0.0 ? intersect.hit.normal : intersect.hit.normal * -1.0;
-  }
+    // emission of the hit. a light found by a Lambert bounce is weighted against the light sample taken there (MIS)
+    if (material.emission.lengthSq() != 0) {
+      double weight = 1.0;
+      const LightBase *light = intersect.object->AsLight();
+      if (bsdfPdf > 0.0 && light != nullptr) {
+        weight = PowerHeuristic(bsdfPdf, m_lightSampler->Pdf(bsdfOrigin, bsdfNormal, light, intersect.hit.position));
+      }
+      radiance += Multiply(throughput, material.emission) * weight;
+      m_hitToLightCount++;
+    }
 
-  Color income;// = DirectRadiance(scene, ray, rnd, depth, intersected, intersect, normal);
-  income += Radiance_internal(scene, ray, rnd, depth, intersected, intersect, normal);
+    double russian_roulette_probability = std::max(textured.x, std::max(textured.y, textured.z)); // K
+    if (depth > MaxDepth) {
+      russian_roulette_probability *= pow(0.5, depth - MaxDepth);
+    }
+    if (depth > MinDepth) {
+      if (rnd.nextDouble() >= russian_roulette_probability) {
+        break;
+      }
+    } else {
+      russian_roulette_probability = 1.0; // no roulette
+    }
 
+    bool continued = false;
+    bsdfPdf = 0.0;
+    switch (material.reflection_type) {
+      case Material::REFLECTION_TYPE_LAMBERT:
+        continued = Scatter_Lambert(scene, ray, rnd, depth, intersect, normal, russian_roulette_probability, throughput, radiance);
+        if (continued && m_performNextEventEstimation) {
+          // cosine sampling: pdf = cos/PI
+          bsdfPdf = ray.dir.dot(normal) / PI;
+          bsdfOrigin = intersect.hit.position;
+          bsdfNormal = normal;
+        }
+        break;
+      case Material::REFLECTION_TYPE_SPECULAR:
+        continued = Scatter_Specular(ray, intersect, normal, russian_roulette_probability, throughput);
+        break;
+      case Material::REFLECTION_TYPE_REFRACTION:
+        continued = Scatter_Refraction(ray, rnd, intersect, normal, russian_roulette_probability, throughput);
+        break;
+    }
+    if (!continued) break;
+  }
 
-  return income;
+  return radiance;
 }
 
 /*
-Color PathTracer::DirectRadiance(const Scene &scene, const Ray &ray, Random &rnd, const int depth, const bool intersected, Scene::IntersectionInformation &intersect, const Vector3 &normal) {
+Color PathTracer::DirectRadiance(const Scene &scene, const Ray &ray, Sampler &rnd, const int depth, const bool intersected, Scene::IntersectionInformation &intersect, const Vector3 &normal) {
   if (!intersected) {
     if (scene.GetIBL()) {
       return scene.GetIBL()->Sample(ray);    // mɔwiƂ̏ՓˈʒuvZ
@@ -145,8 +331,8 @@ Color PathTracer::DirectRadiance(const Scene &scene, const Ray &ray, Random &rnd
 
   Color income;
 
-  if (intersect.object->material.emission.lengthSq() == 0) {
-    switch (intersect.object->material.reflection_type) {
+  if (intersect.object->GetMaterial().emission.lengthSq() == 0) {
+    switch (intersect.object->GetMaterial().reflection_type) {
     case Material::REFLECTION_TYPE_LAMBERT:
       // CgTvOs
       // IBL ܂߂
@@ -163,60 +349,40 @@ Color PathTracer::DirectRadiance(const Scene &scene, const Ray &ray, Random &rnd
   }
 
   if (depth == 0)
-    income += intersect.object->material.emission;
+    income += intersect.object->GetMaterial().emission;
 
   return income;
 }
 */
 
 // ڌɂ Radiance ̕]
-Color PathTracer::DirectRadiance_Lambert(const Scene &scene, const Ray &ray, Random &rnd, const int depth, const bool intersected, Scene::IntersectionInformation &intersect, const Vector3 &normal) {
+Color PathTracer::DirectRadiance_Lambert(const Scene &scene, const Ray &ray, Sampler &rnd, const int depth, const bool intersected, Scene::IntersectionInformation &intersect, const Vector3 &normal) {
   assert(intersected);
 
   // CgɓĂ疳
-  if (dynamic_cast<LightBase *>(intersect.object) != nullptr)
+  if (intersect.object->AsLight() != nullptr)
   {
     return Color(0, 0, 0);
   }
 
-  const vector<LightBase *> &lights = scene.GetLights();
-  if (lights.size() == 0) return scene.Background();
-
-  // pick a random light according to light power
-  double totalPower = 0.0;
-  vector<double> eachLightProbability, accumulatedProbability;
-  for (size_t i = 0; i < lights.size(); i++) {
-    double power = lights[i]->TotalPower();
-    eachLightProbability.push_back(power);
-    accumulatedProbability.push_back(totalPower + power);
-    totalPower += power;
-  }
-
-  // m֐K
-  for (size_t i = 0; i < lights.size(); i++) {
-    eachLightProbability[i] /= totalPower;
-    accumulatedProbability[i] /= totalPower;
-  }
+  if (m_lightSampler->GetLightCount() == 0) return scene.Background();
 
   static const int NumberOfLightSamples = 1;
   Color income;
 
   for (int lightCount = 0; lightCount < NumberOfLightSamples; lightCount++) {
 
-    double next = rnd.nextDouble();
-    int index = 0;
-    for (size_t i = 0; i < lights.size(); i++) {
-      if (next <= accumulatedProbability[i]) {
-        index = i; break;
-      }
+    // pick a light (according to its power, or its contribution estimated by the light BVH)
+    double lightProbability = 0.0;
+    const LightSampler::Light *selectedLight = m_lightSampler->Sample(intersect.hit.position, normal, rnd.nextDouble(), lightProbability);
+    if (selectedLight == nullptr) {
+      continue;
     }
 
-    const LightBase *selectedLight = lights[index];
-
     // pick a one point
     Vector3 point, light_normal; double pdf = 0.0;
-    //selectedLight->SampleOnePoint(point, light_normal, pdf, rnd);
-    if (!selectedLight->SampleOnePointWithTargetPoint(point, light_normal, pdf, intersect.hit.position, rnd)) {
+    //selectedLight->light->SampleOnePoint(point, light_normal, pdf, rnd);
+    if (!selectedLight->light->SampleOnePointWithTargetPoint(point, light_normal, pdf, intersect.hit.position, rnd)) {
       continue;
     }
 
@@ -229,16 +395,22 @@ Color PathTracer::DirectRadiance_Lambert(const Scene &scene, const Ray &ray, Ran
     }
   
     // check visibility
-    Scene::IntersectionInformation hit;
-    if (scene.CheckIntersection(Ray(intersect.hit.position, dir), hit)) {
-      if (dynamic_cast<LightBase *>(hit.object) == selectedLight) {
+    // (the light must be the first hit: nothing may be closer than the light surface)
+    const Ray shadowRay(intersect.hit.position, dir);
+    const SceneObject *lightObject = selectedLight->object;
+    HitInformation lightHit;
+    if (lightObject != nullptr && lightObject->CheckIntersection(shadowRay, lightHit)) {
+      if (!scene.IsOccluded(shadowRay, lightHit.distance - EPS)) {
         // visible
         // BRDF = color/PI
-        double G = cos_shita * light_cos_shita / (hit.hit.distance * hit.hit.distance);
-        Vector3 reflect_rate(intersect.texturedHitpointColor / PI * G / (pdf * eachLightProbability[index]));
-        income.x += reflect_rate.x * hit.object->material.emission.x;
-        income.y += reflect_rate.y * hit.object->material.emission.y;
-        income.z += reflect_rate.z * hit.object->material.emission.z;
+        double G = cos_shita * light_cos_shita / (lightHit.distance * lightHit.distance);
+        // MIS weight against the Lambert sampling hitting the same point (pdf = cos/PI)
+        const double lightPdf = lightProbability * selectedLight->light->PdfWithTargetPoint(lightHit.position, intersect.hit.position);
+        const double misWeight = PowerHeuristic(lightPdf, cos_shita / PI);
+        Vector3 reflect_rate(intersect.texturedHitpointColor / PI * G * misWeight / (pdf * lightProbability));
+        income.x += reflect_rate.x * lightObject->GetMaterial().emission.x;
+        income.y += reflect_rate.y * lightObject->GetMaterial().emission.y;
+        income.z += reflect_rate.z * lightObject->GetMaterial().emission.z;
         // direct_illum = 1/N*L_e*BRDF*G*V/pdf(light)
         m_hitToLightCount++;
       }
@@ -249,102 +421,38 @@ Color PathTracer::DirectRadiance_Lambert(const Scene &scene, const Ray &ray, Ran
   return income / NumberOfLightSamples;
 }
 
-// tool
-namespace {
-  Color GetTexturedColor(const Material &mat, const Vector3 &uv) {
-
-    if (mat.texture_id != ImageHandler::INVALID_IMAGE_ID)
-    {
-      Color c = mat.color;
-      if (Image *img = ImageHandler::GetInstance().GetImage(mat.texture_id))
-      {
-        double u = uv.x;
-        double v = uv.y;
-        auto &pixel = img->GetPixelByUV(u, v);
-
-        c.x *= pixel.x;
-        c.y *= pixel.y;
-        c.z *= pixel.z;
-
-        return c;
-      }
-    }
-    return mat.color;
-  }
-}
+// the environment is treated as infinitely far, as the rays that miss the scene look it up by their direction
+Color PathTracer::DirectRadiance_IBL(const Scene &scene, Sampler &rnd, const Scene::IntersectionInformation &intersect, const Vector3 &normal) {
+  const IBL *ibl = scene.GetIBL();
+  if (ibl == nullptr || !ibl->HasImportanceSamplingMap()) return Color(0, 0, 0);
 
-Color PathTracer::Radiance_internal(const Scene &scene, const Ray &ray, Random &rnd, const int depth, const bool intersected, Scene::IntersectionInformation &intersect, const Vector3 &normal) {
-  if (!intersected) {
-    if (scene.GetIBL()) {
-      //return scene.GetIBL()->Sample(ray);    // mɔwiƂ̏ՓˈʒuvZ
-      return scene.GetIBL()->Sample(ray.dir); // C_n܂ĂƂ݂ȂČvZ
-    } else {
-      return scene.Background();
-    }
-  }
+  Vector3 dir; double pdf = 0.0;
+  if (!ibl->SampleDirection(dir, pdf, rnd)) return Color(0, 0, 0);
 
-  Color &textured = intersect.texturedHitpointColor = GetTexturedColor(intersect.object->material, intersect.hit.uv);
+  const double cos_shita = dir.dot(normal);
+  if (cos_shita <= 0) return Color(0, 0, 0);
 
-  Color income;
-
-  //  if LɂƁAڌ̂ݍl悤ɂȂ
-  //if (depth >= 1) {
-  //  return intersect.object->material.emission;
-  //}
+  if (scene.IsOccluded(Ray(intersect.hit.position, dir), INF)) return Color(0, 0, 0);
 
-  double russian_roulette_probability = std::max(textured.x, std::max(textured.y, textured.z)); // K
-  if (depth > MaxDepth) {
-    russian_roulette_probability *= pow(0.5, depth - MaxDepth);
-  }
-  if (depth > MinDepth) {
-    if (rnd.nextDouble() >= russian_roulette_probability) {
-      // e radiance vZƂɒڌvZĂ̂ŁA
-      // ueye 璼 light  hit ꍇv̂݁Aemission  income ɉ
-      if (depth == 0 || !m_performNextEventEstimation) {
-        if (intersect.object->material.emission.lengthSq() != 0) {
-          m_hitToLightCount++;
-        }
-        return intersect.object->material.emission;
-      }
-      return scene.Background();
-    }
-  } else {
-    russian_roulette_probability = 1.0; // no roulette
-  }
-
-  switch (intersect.object->material.reflection_type) {
-    case Material::REFLECTION_TYPE_LAMBERT:
-      income = Radiance_Lambert(scene, ray, rnd, depth, intersect, normal, russian_roulette_probability);
-      break;
-    case Material::REFLECTION_TYPE_SPECULAR:
-      income = Radiance_Specular(scene, ray, rnd, depth, intersect, normal, russian_roulette_probability);
-      break;
-    case Material::REFLECTION_TYPE_REFRACTION:
-      income = Radiance_Refraction(scene, ray, rnd, depth, intersect, normal, russian_roulette_probability);
-      break;
-  }
-
-  // e radiance vZƂɒڌvZĂ̂ŁA
-  // ueye 璼 light  hit ꍇv̂݁Aemission  income ɉ
-  if (depth == 0 || !m_performNextEventEstimation) {
-    // --> eye 璼 light  hit A light g˗ꍇɂLɂȂ
-    income += intersect.object->material.emission;
-    if (intersect.object->material.emission.lengthSq() != 0) {
-      m_hitToLightCount++;
-    }
-  }
-
-  return income;
+  // BRDF = color/PI. MIS weight against the Lambert sampling (pdf = cos/PI)
+  const double misWeight = PowerHeuristic(pdf, cos_shita / PI);
+  return Multiply(intersect.texturedHitpointColor, ibl->Sample(dir)) * (cos_shita * misWeight / (PI * pdf));
 }
 
-// Lambert ʂ Radiance ̕]
-Color PathTracer::Radiance_Lambert(const Scene &scene, const Ray &ray, Random &rnd, const int depth, Scene::IntersectionInformation &intersect, const Vector3 &normal, double russian_roulette_prob) {
+// Lambert : ڌA̕TvO
+bool PathTracer::Scatter_Lambert(const Scene &scene, Ray &ray, Sampler &rnd, const int depth, Scene::IntersectionInformation &intersect, const Vector3 &normal, double russian_roulette_prob, Color &throughput, Color &radiance) {
+  const Color weight = throughput / russian_roulette_prob;
 
-  Color direct;
+  // lights do not reflect
+  if (intersect.object->GetMaterial().emission.lengthSq() != 0) {
+    return false;
+  }
 
   // ڌ]
-  if (m_performNextEventEstimation && intersect.object->material.emission.lengthSq() == 0) {
-    direct = DirectRadiance_Lambert(scene, ray, rnd, depth, true, intersect, normal);
+  // direct ͂łɔ˗Zς݂Ȃ̂ŁApX̏d݂|
+  if (m_performNextEventEstimation) {
+    radiance += Multiply(weight, DirectRadiance_Lambert(scene, ray, rnd, depth, true, intersect, normal));
+    radiance += Multiply(weight, DirectRadiance_IBL(scene, rnd, intersect, normal));
   }
 
   Vector3 w,u,v;
@@ -356,95 +464,57 @@ Color PathTracer::Radiance_Lambert(const Scene &scene, const Ray &ray, Random &r
    u = Vector3(1,0,0).cross(w);
   }
   v = w.cross(u);
-  double u1 = rnd.nextDouble(); double u2 = rnd.nextDouble();
-  // pdf is 1/PI
-  //double r1 = PI*u1; // 
-  //double r2 = 1-u2; // cos
-  //double r3 = sqrt(1-r2*r2); // sin
-  //double pdf = 1/PI;
+  double u1, u2;
+  rnd.next2D(u1, u2);
 
   // pdf is cos/PI
   double r1 = 2*PI*u1;
   double r2 = sqrt(u2); // cos
   double r3 = sqrt(1-u2); // sin
-  double pdf = r2/PI;
-
-  //const double r1 = 2 * PI * rnd.nextDouble();
-  //const double r2 = rnd.nextDouble(), r2s = sqrt(r2);
-  //Vector3 dir = u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1.0-r2);
-  //dir.normalize();
-  //weight = intersect.object->color / russian_roulette_probability;
 
   Vector3 dir = u*r3*cos(r1) + v*r3*sin(r1) + w*r2;
   dir.normalize();
 
-  //Color weight = intersect.object->color / PI * r2 / pdf / russian_roulette_prob;
-  Color weight = intersect.texturedHitpointColor;
-  Color income(0,0,0);
-  if (intersect.object->material.emission.lengthSq() == 0) {
-    income = Radiance(scene, Ray(intersect.hit.position, dir), rnd, depth + 1);
-  } 
-  // direct ͂łɔ˗Zς݂Ȃ̂ŁAweight|Kv͂Ȃ
-  return ( Vector3(weight.x*income.x, weight.y*income.y, weight.z*income.z) + direct ) / russian_roulette_prob;
+  // BRDF*cos/pdf = color
+  throughput = Multiply(weight, intersect.texturedHitpointColor);
+  ray = Ray(intersect.hit.position, dir);
+  return true;
 }
 
 // ʔ
-Color PathTracer::Radiance_Specular(const Scene &scene, const Ray &ray, Random &rnd, const int depth, Scene::IntersectionInformation &intersect, const Vector3 &normal, double russian_roulette_prob) {
+bool PathTracer::Scatter_Specular(Ray &ray, Scene::IntersectionInformation &intersect, const Vector3 &normal, double russian_roulette_prob, Color &throughput) {
   Vector3 reflected_dir(ray.dir - normal*2*ray.dir.dot(normal));
   reflected_dir.normalize();
 
-  // Ԑڌ̕]
-  Ray newray(intersect.hit.position, reflected_dir);
-  Color income = Radiance(scene, newray, rnd, depth+1);
-
-  // ڌ̕]
-  Scene::IntersectionInformation newhit;
-  if (m_performNextEventEstimation && scene.CheckIntersection(newray, newhit)) {
-    income += newhit.object->material.emission;
-  }
-
-  Color weight = intersect.texturedHitpointColor / russian_roulette_prob;
-  return Vector3(weight.x*income.x, weight.y*income.y, weight.z*income.z);
-
+  throughput = Multiply(throughput, intersect.texturedHitpointColor) / russian_roulette_prob;
+  ray = Ray(intersect.hit.position, reflected_dir);
+  return true;
 }
 
 // ܖ
-Color PathTracer::Radiance_Refraction(const Scene &scene, const Ray &ray, Random &rnd, const int depth, Scene::IntersectionInformation &intersect, const Vector3 &normal, double russian_roulette_prob) {
+// ˂Ƌ܂̂ǂ炩mIɑIŒǐՂ
+bool PathTracer::Scatter_Refraction(Ray &ray, Sampler &rnd, Scene::IntersectionInformation &intersect, const Vector3 &normal, double russian_roulette_prob, Color &throughput) {
   bool into = intersect.hit.normal.dot(normal) > 0.0;
 
   Vector3 reflect_dir = ray.dir - normal*2*ray.dir.dot(normal);
   reflect_dir.normalize();
   double n_vacuum = REFRACTIVE_INDEX_VACUUM;
-  double n_obj = intersect.object->material.refraction_rate;
+  double n_obj = intersect.object->GetMaterial().refraction_rate;
   double n_ratio = into ? n_vacuum/n_obj : n_obj/n_vacuum;
 
   double dot = ray.dir.dot(normal);
   double cos2t = 1-n_ratio*n_ratio*(1-dot*dot);
 
-  // ˕̒ڌ̕]
-  Color reflect_direct;
-  Ray reflect_ray(intersect.hit.position, reflect_dir);
-  Scene::IntersectionInformation reflected_hit;
-  if (m_performNextEventEstimation && scene.CheckIntersection(reflect_ray, reflected_hit)) {
-    reflect_direct = reflected_hit.object->material.emission;
-  }
-
   if (cos2t < 0) {
     // S
-    Color income = reflect_direct + Radiance(scene, Ray(intersect.hit.position, reflect_dir), rnd, depth+1);
-    Color weight = intersect.object->material.color / russian_roulette_prob;
-    return Vector3(weight.x*income.x, weight.y*income.y, weight.z*income.z);
+    throughput = Multiply(throughput, intersect.object->GetMaterial().color) / russian_roulette_prob;
+    ray = Ray(intersect.hit.position, reflect_dir);
+    return true;
   }
 
   // ܕ
   Vector3 refract_dir( ray.dir*n_ratio - intersect.hit.normal * (into ? 1.0 : -1.0) * (dot*n_ratio + sqrt(cos2t)) );
   refract_dir.normalize();
-  const Ray refract_ray(intersect.hit.position, refract_dir);
-  // ܕ̒ڌ̕]
-  Color refract_direct;
-  if (m_performNextEventEstimation && scene.CheckIntersection(refract_ray, reflected_hit)) {
-    refract_direct = reflected_hit.object->material.emission;
-  }
 
   // Fresnel ̎
   double F0 = (n_obj-n_vacuum)*(n_obj-n_vacuum)/((n_obj+n_vacuum)*(n_obj+n_vacuum));
@@ -453,30 +523,17 @@ Color PathTracer::Radiance_Refraction(const Scene &scene, const Ray &ray, Random
   double n_ratio2 = n_ratio*n_ratio;  // ܑOł̕ˋPx̕ω
   double Tr = (1-Fr)*n_ratio2;        // ܒとO̊
 
-  Color income, weight;
-
-  if (depth > 2) {
-    //  or ܂̂ݒǐ
-    const double reflect_prob = 0.1 + 0.8 * Fr;
-    if (rnd.nextDouble() < reflect_prob) {
-      // 
-      income = (reflect_direct + Radiance(scene, Ray(intersect.hit.position, reflect_dir), rnd, depth+1)) * Fr;
-      weight = intersect.texturedHitpointColor / (russian_roulette_prob * reflect_prob);
-    } else {
-      // 
-      income = (refract_direct + Radiance(scene, refract_ray, rnd, depth+1)) * Tr;
-      weight = intersect.texturedHitpointColor / (russian_roulette_prob * (1 - reflect_prob));
-    }
+  const double reflect_prob = 0.1 + 0.8 * Fr;
+  if (rnd.nextDouble() < reflect_prob) {
+    // 
+    throughput = Multiply(throughput, intersect.texturedHitpointColor) * (Fr / (russian_roulette_prob * reflect_prob));
+    ray = Ray(intersect.hit.position, reflect_dir);
   } else {
-    // ˂Ƌܗǐ
-    m_omittedRayCount++;
-    income =
-      (reflect_direct + Radiance(scene, Ray(intersect.hit.position, reflect_dir), rnd, depth+1)) * Fr +
-      (refract_direct + Radiance(scene, refract_ray, rnd, depth + 1)) *Tr;
-    weight = intersect.texturedHitpointColor / russian_roulette_prob;
+    // 
+    throughput = Multiply(throughput, intersect.texturedHitpointColor) * (Tr / (russian_roulette_prob * (1 - reflect_prob)));
+    ray = Ray(intersect.hit.position, refract_dir);
   }
-
-  return /*intersect.object->material.emission +*/ Vector3(weight.x*income.x, weight.y*income.y, weight.z*income.z);
+  return true;
 }
 
 // ʕ\p̏擾\bh
@@ -491,7 +548,12 @@ std::string PathTracer::GetCurrentRenderingInfo() const {
     ss << " = " << static_cast<double>(m_hitToLightCount*100.0) / m_omittedRayCount << "%";
   }
   ss << endl;
-  ss << m_processed_y_counts*100.0/m_camera.GetScreenHeight() << "% finished." << endl;
+  if (m_adaptiveErrorThreshold > 0.0 && !m_pixelSampleCount.empty()) {
+    ss << "converged pixels = " << m_convergedPixelCount * 100.0 / m_pixelSampleCount.size() << "%" << endl;
+  }
+  if (m_tileScheduler) {
+    ss << m_processedTileCount*100.0/m_tileScheduler->GetTiles().size() << "% finished." << endl;
+  }
 
   return ss.str();
 }
@@ -1,24 +1,25 @@
 #pragma once
 
 #include <functional>
+#include <atomic>
+#include <memory>
 
 #include "Renderer.h"
 #include "Color.h"
 #include "scenes/Scene.h"
 #include "Camera.h"
+#include "tools/TileScheduler.h"
+#include "tools/Sampler.h"
 
 namespace OmochiRenderer {
 
 class Scene;
 class Ray;
-class Random;
+class Sampler;
 class IBL;
+class LightSampler;
 
 class PathTracer : public Renderer {
-public:
-  // _OɌĂяoR[obNp\bh`
-  typedef std::function<void(int samples, const Color *result, double accumulatedRenderingTime)> RenderingFinishCallbackFunction;
-
 public:
 	// RXgN^AfXgN^
   PathTracer(const Camera &camera, int samples, int supersamples);
@@ -30,6 +31,27 @@ public:
     m_performNextEventEstimation = enable;
   }
 
+  // ʂ^Cɕĕ`悷ۂ̐ݒ
+  void SetTileScheduling(int tileSize, TileScheduler::TILE_ORDER order, bool centerOut) {
+    m_tileSize = tileSize;
+    m_tileOrder = order;
+    m_tileCenterOut = centerOut;
+  }
+
+  //  (Sampler) ̎
+  void SetSamplerType(Sampler::SAMPLER_TYPE type) {
+    m_samplerType = type;
+  }
+
+  // adaptive sampling: a pixel stops being sampled once the relative standard error of its mean luminance is
+  // errorThreshold or less (after minSamples samples per pixel). errorThreshold <= 0 disables it.
+  // stopWhenConverged ends the rendering when all the pixels have converged
+  void SetAdaptiveSampling(double errorThreshold, int minSamples, bool stopWhenConverged) {
+    m_adaptiveErrorThreshold = errorThreshold;
+    m_adaptiveMinSamples = minSamples;
+    m_stopWhenConverged = stopWhenConverged;
+  }
+
 	virtual void RenderScene(const Scene &scene);
 
 	virtual const Color *GetResult() const {return m_result;}
@@ -48,17 +70,23 @@ private:
 
   // SsNZXLAC΂\bh
   void ScanPixelsAndCastRays(const Scene &scene, int previous_samples, int next_samples);
-  // ^ꂽCɂāA̕ˋPx߂
-  Color Radiance(const Scene &scene, const Ray &ray, Random &rnd, const int depth);
+  double EstimatePixelError(int index) const;
+  bool IsPixelConverged(int index) const;
+  int SamplesForPixel(int index, int passSamples) const;
 
-  //Color DirectRadiance(const Scene &scene, const Ray &ray, Random &rnd, const int depth, const bool intersected, Scene::IntersectionInformation &intersect, const Vector3 &normal);
+  // ^ꂽC (ς) ɂāA̕ˋPx߂
+  Color Radiance(const Scene &scene, const Ray &ray, Sampler &rnd, const bool intersected, const Scene::IntersectionInformation &intersection);
 
-  Color DirectRadiance_Lambert(const Scene &scene, const Ray &ray, Random &rnd, const int depth, const bool intersected, Scene::IntersectionInformation &intersect, const Vector3 &normal);
-  Color Radiance_internal(const Scene &scene, const Ray &ray, Random &rnd, const int depth, const bool intersected, Scene::IntersectionInformation &intersect, const Vector3 &normal);
+  //Color DirectRadiance(const Scene &scene, const Ray &ray, Sampler &rnd, const int depth, const bool intersected, Scene::IntersectionInformation &intersect, const Vector3 &normal);
 
-  Color Radiance_Lambert(const Scene &scene, const Ray &ray, Random &rnd, const int depth, Scene::IntersectionInformation &intersect, const Vector3 &normal, double russian_roulette_prob);
-  Color Radiance_Specular(const Scene &scene, const Ray &ray, Random &rnd, const int depth, Scene::IntersectionInformation &intersect, const Vector3 &normal, double russian_roulette_prob);
-  Color Radiance_Refraction(const Scene &scene, const Ray &ray, Random &rnd, const int depth, Scene::IntersectionInformation &intersect, const Vector3 &normal, double russian_roulette_prob);
+  Color DirectRadiance_Lambert(const Scene &scene, const Ray &ray, Sampler &rnd, const int depth, const bool intersected, Scene::IntersectionInformation &intersect, const Vector3 &normal);
+  // IBL ̒ڌ (}bv̏d_TvOABSDF TvOƂ MIS dݕt)
+  Color DirectRadiance_IBL(const Scene &scene, Sampler &rnd, const Scene::IntersectionInformation &intersect, const Vector3 &normal);
+
+  // ̃C (ray)  throughput XVBpXꍇ true
+  bool Scatter_Lambert(const Scene &scene, Ray &ray, Sampler &rnd, const int depth, Scene::IntersectionInformation &intersect, const Vector3 &normal, double russian_roulette_prob, Color &throughput, Color &radiance);
+  bool Scatter_Specular(Ray &ray, Scene::IntersectionInformation &intersect, const Vector3 &normal, double russian_roulette_prob, Color &throughput);
+  bool Scatter_Refraction(Ray &ray, Sampler &rnd, Scene::IntersectionInformation &intersect, const Vector3 &normal, double russian_roulette_prob, Color &throughput);
 
 private:
   Camera m_camera;
@@ -66,7 +94,15 @@ private:
 	int m_min_samples,m_max_samples,m_step_samples;
 	int m_supersamples;
   int m_previous_samples;
-  int m_processed_y_counts;
+  std::atomic<int> m_processedTileCount;
+  int m_tileSize;
+  TileScheduler::TILE_ORDER m_tileOrder;
+  bool m_tileCenterOut;
+  Sampler::SAMPLER_TYPE m_samplerType;
+  // dimensions of a sample used by the camera ray (position in the pixel, point on the aperture)
+  static const unsigned int CAMERA_SAMPLE_DIMENSIONS = 4;
+  std::shared_ptr<TileScheduler> m_tileScheduler;
+  const LightSampler *m_lightSampler;   // of the scene being rendered
   RenderingFinishCallbackFunction m_renderFinishCallback;
 
   int m_checkIntersectionCount;
@@ -75,6 +111,21 @@ private:
 
 	Color *m_result;
 
+  // per pixel statistics. m_result is m_radianceSum / m_pixelSampleCount
+  std::vector<Color> m_radianceSum;
+  std::vector<double> m_luminanceSum;
+  std::vector<double> m_luminanceSquaredSum;
+  std::vector<int> m_pixelSampleCount;
+
+  // a pixel whose error is (ratio) times the threshold gets min(ratio, this) times the samples of the pass
+  static const int ADAPTIVE_MAX_SAMPLE_FACTOR = 4;
+  // the error of dark pixels is relative to this luminance
+  static const double ADAPTIVE_LUMINANCE_FLOOR;
+  double m_adaptiveErrorThreshold;
+  int m_adaptiveMinSamples;
+  bool m_stopWhenConverged;
+  size_t m_convergedPixelCount;
+
   bool m_performNextEventEstimation = false;
 };
 
@@ -1,6 +1,6 @@
 #pragma once
 
-#include "SceneObject.h"
+#include "TriangleBase.h"
 #include "Ray.h"
 #include "tools/Constant.h"
 #include "HitInformation.h"
@@ -8,13 +8,13 @@
 
 namespace OmochiRenderer {
 
-class Polygon : public SceneObject {
+class Polygon : public TriangleBase {
 public:
   Polygon(const Vector3 &pos1, const Vector3 &pos2, const Vector3 &pos3,
     const Vector3 &uv1, const Vector3 &uv2, const Vector3 &uv3,
     const Vector3 &normal1, const Vector3 &normal2, const Vector3 &normal3,
-    const Material &mat, const Vector3 &pos)
-    : SceneObject(mat)
+    MaterialTable::MATERIAL_ID materialId_, const Vector3 &pos)
+    : TriangleBase(materialId_)
   {
     m_posAndEdges[0] = pos1;
     m_posAndEdges[1] = pos2 - pos1;
@@ -29,7 +29,7 @@ public:
     reconstruct_boundingbox();
   }
   Polygon(const Polygon &polygon)
-    : SceneObject(polygon.material)
+    : TriangleBase(polygon.materialId)
   {
     for (int i=0; i<3; i++) {
       m_posAndEdges[i] = polygon.m_posAndEdges[i];
@@ -61,48 +61,39 @@ public:
   }
 
   bool CheckIntersection(const Ray &ray, HitInformation &hit) const {
-    // A
-    // Ql: http://shikousakugo.wordpress.com/2012/07/01/ray-intersection-3/
-    const Vector3 &edge1 = m_posAndEdges[1];
-    const Vector3 &edge2 = m_posAndEdges[2];
-
-    Vector3 P(ray.dir.cross(edge2));
-    double det = P.dot(edge1);
-
-    if (det > EPS) {
-      // solve u
-      Vector3 T(ray.orig - (m_posAndEdges[0] + position));
-      double u = P.dot(T);
-
-      if (u>=0 && u<= det) {
-        // solve v
-        Vector3 Q(T.cross(edge1));
-        double v = Q.dot(ray.dir);
-
-        if (v>=0 && u+v<=det) {
-          double t = Q.dot(edge2) / det;
-
-          if (t>=EPS) {
-            const Vector3 &uvEdge1 = m_uvOrigAndEdges[1];
-            const Vector3 &uvEdge2 = m_uvOrigAndEdges[2];
+    double t, u_rate, v_rate;
+    if (CalcIntersection(ray, t, u_rate, v_rate)) {
+      CalcHitInformation(ray, t, u_rate, v_rate, hit);
+      return true;
+    }
+    return false;
+  }
 
-            double u_rate = (u / det);
-            double v_rate = v / det;
+  bool CheckOcclusion(const Ray &ray, double maxDistance) const {
+    double t, u_rate, v_rate;
+    return CalcIntersection(ray, t, u_rate, v_rate) && t < maxDistance;
+  }
 
-            hit.distance = t;
-            hit.position = ray.orig + ray.dir*t;
-            hit.normal = m_normalAndDiffs[1] * u_rate + m_normalAndDiffs[2] * v_rate + m_normalAndDiffs[0];
-            hit.normal.normalize();
-            hit.uv = uvEdge1 * u_rate + uvEdge2 * v_rate + m_uvOrigAndEdges[0];
+  // solves the distance and the barycentric coordinates of the hit point
+  bool CalcIntersection(const Ray &ray, double &t, double &u_rate, double &v_rate) const {
+    return TriangleBase::CalcIntersection(ray, m_posAndEdges[0] + position, m_posAndEdges[1], m_posAndEdges[2], t, u_rate, v_rate);
+  }
 
-            return true;
-          }
-        }
-      }
+  void GetVertexAndEdges(Vector3 &vertex0, Vector3 &edge1, Vector3 &edge2) const {
+    vertex0 = m_posAndEdges[0] + position;
+    edge1 = m_posAndEdges[1];
+    edge2 = m_posAndEdges[2];
+  }
 
-    }
+  void CalcHitInformation(const Ray &ray, double t, double u_rate, double v_rate, HitInformation &hit) const {
+    const Vector3 &uvEdge1 = m_uvOrigAndEdges[1];
+    const Vector3 &uvEdge2 = m_uvOrigAndEdges[2];
 
-    return false;
+    hit.distance = t;
+    hit.position = ray(t);
+    hit.normal = m_normalAndDiffs[1] * u_rate + m_normalAndDiffs[2] * v_rate + m_normalAndDiffs[0];
+    hit.normal.normalize();
+    hit.uv = uvEdge1 * u_rate + uvEdge2 * v_rate + m_uvOrigAndEdges[0];
   }
 
   Vector3 m_posAndEdges[3];  // m_posAndEdges[3]: pos0Bm_pos_AndEdges[1,2]: pos1,2 - pos0
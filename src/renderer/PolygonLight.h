@@ -0,0 +1,188 @@
+#pragma once
+
+#include "LightBase.h"
+#include "Polygon.h"
+#include "tools/Sampler.h"
+#include "tools/Arena.h"
+
+namespace OmochiRenderer {
+  // a Polygon with an emissive material. it emits from its front face (the face Polygon::CheckIntersection hits).
+  // Model and the floor helpers of Scene create it for every polygon whose material has emission (Ke in .mtl)
+  class PolygonLight : public Polygon, public LightBase {
+  public:
+    PolygonLight(const Vector3 &pos1, const Vector3 &pos2, const Vector3 &pos3,
+      const Vector3 &uv1, const Vector3 &uv2, const Vector3 &uv3,
+      const Vector3 &normal1, const Vector3 &normal2, const Vector3 &normal3,
+      MaterialTable::MATERIAL_ID materialId_, const Vector3 &pos)
+      : Polygon(pos1, pos2, pos3, uv1, uv2, uv3, normal1, normal2, normal3, materialId_, pos)
+      , LightBase()
+    {
+    }
+    virtual ~PolygonLight() {}
+
+    // PolygonLight if the material is emissive, Polygon otherwise. allocated from arena, which owns it
+    static Polygon *Create(Arena &arena, const Vector3 &pos1, const Vector3 &pos2, const Vector3 &pos3,
+      const Vector3 &uv1, const Vector3 &uv2, const Vector3 &uv3,
+      const Vector3 &normal1, const Vector3 &normal2, const Vector3 &normal3,
+      MaterialTable::MATERIAL_ID materialId_, const Vector3 &pos)
+    {
+      if (MaterialTable::GetInstance().Get(materialId_).emission.lengthSq() > 0) {
+        return arena.New<PolygonLight>(pos1, pos2, pos3, uv1, uv2, uv3, normal1, normal2, normal3, materialId_, pos);
+      }
+      return arena.New<Polygon>(pos1, pos2, pos3, uv1, uv2, uv3, normal1, normal2, normal3, materialId_, pos);
+    }
+
+    // uniform on the area. pdf = 1 / area
+    virtual void SampleOnePoint(Vector3 &point, Vector3 &normal, double &pdf, const Sampler &rnd) const {
+      const Vector3 cross(m_posAndEdges[1].cross(m_posAndEdges[2]));
+      const double area = 0.5 * cross.length();
+
+      double u1, u2;
+      rnd.next2D(u1, u2);
+      const double su1 = sqrt(u1);
+      point = m_posAndEdges[0] + position + m_posAndEdges[1] * (su1 * (1 - u2)) + m_posAndEdges[2] * (su1 * u2);
+      normal = cross / (2 * area);
+      pdf = 1.0 / area;
+    }
+
+    // uniform on the solid angle subtended at targetPoint (Arvo, "Stratified Sampling of Spherical Triangles").
+    // pdf is converted to the area measure like the other lights. falls back to the area sampling when the triangle is
+    // too small or too large in the solid angle for the spherical sampling to be accurate.
+    // false if targetPoint is behind the emitting face
+    virtual bool SampleOnePointWithTargetPoint(Vector3 &sampledPoint, Vector3 &sampledPointNormal, double &pdf, const Vector3 &targetPoint, const Sampler &rnd) const {
+      const Vector3 v0(m_posAndEdges[0] + position);
+      const Vector3 cross(m_posAndEdges[1].cross(m_posAndEdges[2]));
+      const double crossLength = cross.length();
+      if (crossLength == 0) return false;
+      const Vector3 normal(cross / crossLength);
+
+      // the front face looks towards the normal of the winding (e1 x e2)
+      if ((targetPoint - v0).dot(normal) <= 0) return false;
+
+      double u1, u2;
+      rnd.next2D(u1, u2);
+
+      double solidAngle = 0;
+      if (!SampleSphericalTriangle(targetPoint, u1, u2, sampledPoint, solidAngle)) {
+        const double su1 = sqrt(u1);
+        sampledPoint = v0 + m_posAndEdges[1] * (su1 * (1 - u2)) + m_posAndEdges[2] * (su1 * u2);
+        sampledPointNormal = normal;
+        pdf = 2.0 / crossLength;
+        return true;
+      }
+
+      Vector3 dir(sampledPoint - targetPoint);
+      const double distanceSq = dir.lengthSq();
+      if (distanceSq == 0) return false;
+      dir /= sqrt(distanceSq);
+      const double cos_light = fabs(dir.dot(normal));
+      if (cos_light == 0) return false;
+
+      sampledPointNormal = normal;
+      pdf = cos_light / (distanceSq * solidAngle);
+      return true;
+    }
+
+    virtual double PdfWithTargetPoint(const Vector3 &pointOnLight, const Vector3 &targetPoint) const {
+      const Vector3 cross(m_posAndEdges[1].cross(m_posAndEdges[2]));
+      const double crossLength = cross.length();
+      if (crossLength == 0) return 0.0;
+      const Vector3 normal(cross / crossLength);
+
+      Vector3 toTarget(targetPoint - pointOnLight);
+      const double distanceSq = toTarget.lengthSq();
+      if (distanceSq == 0) return 0.0;
+      toTarget /= sqrt(distanceSq);
+      const double cos_light = toTarget.dot(normal);
+      if (cos_light <= 0) return 0.0;
+
+      Vector3 a, b, c;
+      double alpha, solidAngle;
+      if (ProjectOnSphere(targetPoint, a, b, c, alpha, solidAngle)) {
+        return 1.0 / solidAngle;
+      }
+      // area sampling
+      return distanceSq / (cos_light * 0.5 * crossLength);
+    }
+
+    virtual const LightBase *AsLight() const { return this; }
+
+    virtual double TotalPower() const {
+      return 0.5 * m_posAndEdges[1].cross(m_posAndEdges[2]).length() * GetMaterial().emission.length();
+    }
+
+  private:
+    // zero for the zero vector
+    static Vector3 Normalized(const Vector3 &v) {
+      const double length = v.length();
+      return length > 0 ? v / length : Vector3(0, 0, 0);
+    }
+
+    // angle between unit vectors, accurate also for nearly (anti)parallel ones
+    static double AngleBetween(const Vector3 &a, const Vector3 &b) {
+      if (a.dot(b) < 0) return PI - 2 * asin(std::min<double>(1.0, (a + b).length() / 2));
+      return 2 * asin(std::min<double>(1.0, (b - a).length() / 2));
+    }
+
+    // projects the triangle on the unit sphere around p: the vertices a, b, c, the spherical angle at a and the solid angle.
+    // false if the solid angle is out of the range where the spherical sampling is accurate
+    // (tiny triangles lose the precision, huge ones are nearly degenerate)
+    bool ProjectOnSphere(const Vector3 &p, Vector3 &a, Vector3 &b, Vector3 &c, double &alpha, double &solidAngle) const {
+      const Vector3 v0(m_posAndEdges[0] + position);
+      a = Normalized(v0 - p);
+      b = Normalized(v0 + m_posAndEdges[1] - p);
+      c = Normalized(v0 + m_posAndEdges[2] - p);
+      Vector3 n_ab(a.cross(b)), n_bc(b.cross(c)), n_ca(c.cross(a));
+      if (n_ab.lengthSq() == 0 || n_bc.lengthSq() == 0 || n_ca.lengthSq() == 0) return false;
+      n_ab.normalize(); n_bc.normalize(); n_ca.normalize();
+
+      // the spherical angles at a, b, c. their excess over PI is the solid angle
+      alpha = AngleBetween(n_ab, n_ca * -1);
+      const double beta = AngleBetween(n_bc, n_ab * -1);
+      const double gamma = AngleBetween(n_ca, n_bc * -1);
+      solidAngle = alpha + beta + gamma - PI;
+      return solidAngle >= 3e-4 && solidAngle <= 6.22;
+    }
+
+    bool SampleSphericalTriangle(const Vector3 &p, double u1, double u2, Vector3 &sampledPoint, double &solidAngle) const {
+      Vector3 a, b, c;
+      double alpha;
+      if (!ProjectOnSphere(p, a, b, c, alpha, solidAngle)) return false;
+      const Vector3 v0(m_posAndEdges[0] + position);
+
+      // the sub-triangle (a, b, c') with the area u1 * solidAngle
+      const double subArea = u1 * solidAngle + PI;
+      const double cosAlpha = cos(alpha), sinAlpha = sin(alpha);
+      const double sinPhi = sin(subArea) * cosAlpha - cos(subArea) * sinAlpha;
+      const double cosPhi = cos(subArea) * cosAlpha + sin(subArea) * sinAlpha;
+      const double k1 = cosPhi + cosAlpha;
+      const double k2 = sinPhi - sinAlpha * a.dot(b);
+      double cosBp = (k2 + (k2 * cosPhi - k1 * sinPhi) * cosAlpha) / ((k2 * sinPhi + k1 * cosPhi) * sinAlpha);
+      cosBp = std::max(-1.0, std::min(1.0, cosBp));
+      const double sinBp = sqrt(1 - cosBp * cosBp);
+      const Vector3 cp(a * cosBp + Normalized(c - a * c.dot(a)) * sinBp);
+
+      // the direction on the arc from b to c'
+      const double cosTheta = 1 - u2 * (1 - cp.dot(b));
+      const double sinTheta = sqrt(std::max(0.0, 1 - cosTheta * cosTheta));
+      const Vector3 w(b * cosTheta + Normalized(cp - b * cp.dot(b)) * sinTheta);
+
+      // intersect the direction with the triangle to get the point
+      const Vector3 &e1 = m_posAndEdges[1], &e2 = m_posAndEdges[2];
+      const Vector3 s1(w.cross(e2));
+      const double divisor = s1.dot(e1);
+      if (divisor == 0) return false;
+      const Vector3 s(p - v0);
+      double b1 = s.dot(s1) / divisor;
+      double b2 = w.dot(s.cross(e1)) / divisor;
+      b1 = std::max(0.0, std::min(1.0, b1));
+      b2 = std::max(0.0, std::min(1.0, b2));
+      if (b1 + b2 > 1) {
+        const double sum = b1 + b2;
+        b1 /= sum; b2 /= sum;
+      }
+      sampledPoint = v0 + e1 * b1 + e2 * b2;
+      return true;
+    }
+  };
+}
@@ -2,11 +2,16 @@
 
 #include <iostream>
 #include <limits>
+#include <fstream>
+#include <unordered_map>
 #include <malloc.h>
+#include <sys/stat.h>
 #include "QBVH.h"
 #include "BVH.h"
 
 #include "SceneObject.h"
+#include "TriangleBase.h"
+#include "tools/MappedFile.h"
 
 using namespace std;
 
@@ -40,6 +45,11 @@ namespace OmochiRenderer {
       _mm_load1_ps(rayorg+1), // y
       _mm_load1_ps(rayorg+2)  // z
     };
+    const __m128 rayDirection[3] = {
+      _mm_set1_ps(static_cast<float>(ray.dir.x)),
+      _mm_set1_ps(static_cast<float>(ray.dir.y)),
+      _mm_set1_ps(static_cast<float>(ray.dir.z))
+    };
 
     __declspec(align(16)) const float raydir[3] = {
       ray.dir.x == 0 ? INF : static_cast<float>(1.0f/ray.dir.x),
@@ -61,11 +71,12 @@ namespace OmochiRenderer {
 
     // search loop
     bool intersection_results[4];
-    std::vector<size_t> indicesStack;
-    indicesStack.push_back(0);  // root index
-    while (!indicesStack.empty()) {
-      size_t nextIndex = indicesStack.back();
-      indicesStack.pop_back();
+    // the stack is bounded by the tree (see CalcTraversalStackSize_internal), so it is allocated on the stack
+    size_t *indicesStack = static_cast<size_t *>(_alloca(sizeof(size_t) * m_traversalStackSize));
+    size_t stackSize = 0;
+    indicesStack[stackSize++] = 0;  // root index
+    while (stackSize > 0) {
+      size_t nextIndex = indicesStack[--stackSize];
 
       assert (nextIndex < m_usedNodeCount);
 
@@ -107,10 +118,9 @@ namespace OmochiRenderer {
             // intersected. check it
             if (IsChildindexLeaf(node->children[childindex])) {
               // this child node is a leaf
-              size_t leafstartindex = GetIndexOfObjectInChildLeaf(node->children[childindex]);
-              //cerr << "orig:" << node->children[childindex] << " converted:" << leafstartindex << endl;
+              size_t leafindex = GetIndexOfObjectInChildLeaf(node->children[childindex]);
               Scene::IntersectionInformation infoTmp;
-              if (CheckIntersection_Leaf(ray, leafstartindex, infoTmp)) {
+              if (CheckIntersection_Leaf(ray, rayOrg, rayDirection, leafindex, static_cast<float>(info.hit.distance), infoTmp)) {
                 if (info.hit.distance > infoTmp.hit.distance) {
                   info = infoTmp;
                   float dist = static_cast<float>(info.hit.distance);
@@ -119,7 +129,8 @@ namespace OmochiRenderer {
               }
             } else {
               // this child node is not a leaf
-              indicesStack.push_back(node->children[childindex]);
+              assert (stackSize < m_traversalStackSize);
+              indicesStack[stackSize++] = node->children[childindex];
             }
           }
         }
@@ -131,13 +142,40 @@ namespace OmochiRenderer {
     return false;
   }
 
-  bool QBVH::CheckIntersection_Leaf(const Ray &ray, size_t leafStartIndex, Scene::IntersectionInformation &hitResultDetail) const {
+  bool QBVH::CheckIntersection_Leaf(const Ray &ray, const __m128 rayOrig[3], const __m128 rayDir[3], size_t leafIndex, float tmax,
+    Scene::IntersectionInformation &hitResultDetail) const
+  {
+    const LeafInfo &leaf = m_leaves[leafIndex];
     double nearestDist = -1;
+
+    // polygons: intersect whole blocks, then resolve only the nearest one
+    const TriangleBlock4 *blocks = m_triangleBlocks.get();
+    size_t nearestPolygonIndex = 0;
+    float nearestU = 0, nearestV = 0;
+    for (unsigned int i=leaf.firstBlock; i<leaf.firstBlock+leaf.blockCount; i++) {
+      float u, v;
+      const int lane = blocks[i].Intersect(rayOrig, rayDir, tmax, u, v);
+      if (lane >= 0) {
+        nearestPolygonIndex = i * TriangleBlock4::WIDTH + lane;
+        nearestU = u; nearestV = v;
+        nearestDist = tmax;
+      }
+    }
+    if (nearestDist >= 0) {
+      const TriangleBase *polygon = static_cast<const TriangleBase *>(m_triangleBlockObjects[nearestPolygonIndex]);
+      // recalculate in double for the precision of the hit position (float and double may disagree at the edges)
+      if (!polygon->CheckIntersection(ray, hitResultDetail.hit)) {
+        polygon->CalcHitInformation(ray, nearestDist, nearestU, nearestV, hitResultDetail.hit);
+      }
+      hitResultDetail.object = m_triangleBlockObjects[nearestPolygonIndex];
+      nearestDist = hitResultDetail.hit.distance;
+    }
+
+    // other objects
     HitInformation info;
-    for (size_t i=leafStartIndex; m_leafObjectArray[i]; i++) {
+    for (size_t i=leaf.firstObject; m_leafObjectArray[i]; i++) {
       assert (i+1<m_leafObjectArray.size());
 
-//      cerr << i << endl;
       const SceneObject *obj = m_leafObjectArray[i];
       if (obj->CheckIntersection(ray, info) && (nearestDist < 0 || info.distance < nearestDist)) {
         hitResultDetail.hit = info;
@@ -149,12 +187,188 @@ namespace OmochiRenderer {
     return (nearestDist >= 0);
   }
 
-  bool QBVH::Construct(const std::vector<SceneObject *> &targets) {
+  void QBVH::CheckIntersectionPacket(const Ray rays[PACKET_SIZE], int activeMask, Scene::IntersectionInformation infos[PACKET_SIZE]) const {
+    if (activeMask == 0) return;
+    assert ((activeMask & ~((1 << PACKET_SIZE) - 1)) == 0);
+    int firstRay = 0;
+    while (((activeMask >> firstRay) & 1) == 0) firstRay++;
+
+    // the children are ordered by the direction signs, so a packet must share them.
+    // otherwise the rays are not coherent: trace them one by one
+    const int rayDirSign[3] = {
+      rays[firstRay].dir.x >= 0 ? 0 : 1,
+      rays[firstRay].dir.y >= 0 ? 0 : 1,
+      rays[firstRay].dir.z >= 0 ? 0 : 1
+    };
+    for (int i=0; i<PACKET_SIZE; i++) {
+      if (((activeMask >> i) & 1) == 0) continue;
+      if ((rays[i].dir.x >= 0 ? 0 : 1) != rayDirSign[0] || (rays[i].dir.y >= 0 ? 0 : 1) != rayDirSign[1] || (rays[i].dir.z >= 0 ? 0 : 1) != rayDirSign[2]) {
+        for (int j=0; j<PACKET_SIZE; j++) {
+          if ((activeMask >> j) & 1) CheckIntersection(rays[j], infos[j]);
+        }
+        return;
+      }
+    }
+
+    // initialize each ray
+    __m128 rayOrg[PACKET_SIZE][3], rayDirection[PACKET_SIZE][3], inversedRayDir[PACKET_SIZE][3];
+    float currentShortestDistance[PACKET_SIZE];
+    for (int i=0; i<PACKET_SIZE; i++) {
+      if (((activeMask >> i) & 1) == 0) continue;
+      const Ray &ray = rays[i];
+      rayOrg[i][0] = _mm_set1_ps(static_cast<float>(ray.orig.x));
+      rayOrg[i][1] = _mm_set1_ps(static_cast<float>(ray.orig.y));
+      rayOrg[i][2] = _mm_set1_ps(static_cast<float>(ray.orig.z));
+      rayDirection[i][0] = _mm_set1_ps(static_cast<float>(ray.dir.x));
+      rayDirection[i][1] = _mm_set1_ps(static_cast<float>(ray.dir.y));
+      rayDirection[i][2] = _mm_set1_ps(static_cast<float>(ray.dir.z));
+      inversedRayDir[i][0] = _mm_set1_ps(ray.dir.x == 0 ? static_cast<float>(INF) : static_cast<float>(1.0f/ray.dir.x));
+      inversedRayDir[i][1] = _mm_set1_ps(ray.dir.y == 0 ? static_cast<float>(INF) : static_cast<float>(1.0f/ray.dir.y));
+      inversedRayDir[i][2] = _mm_set1_ps(ray.dir.z == 0 ? static_cast<float>(INF) : static_cast<float>(1.0f/ray.dir.z));
+      currentShortestDistance[i] = std::numeric_limits<float>::max();
+      infos[i].hit.distance = INF;
+    }
+
+    const QBVH_structure *root = m_root.get();
+
+    // each node is visited once for all the rays which reach it (the mask of them is on the stack with the node)
+    struct StackEntry {
+      size_t index;
+      int rayMask;
+    };
+    StackEntry *indicesStack = static_cast<StackEntry *>(_alloca(sizeof(StackEntry) * m_traversalStackSize));
+    size_t stackSize = 0;
+    indicesStack[stackSize].index = 0;  // root index
+    indicesStack[stackSize++].rayMask = activeMask;
+    while (stackSize > 0) {
+      const StackEntry current = indicesStack[--stackSize];
+      assert (current.index < m_usedNodeCount);
+      const QBVH_structure *node = &root[current.index];
+
+      // which rays hit each child box before their current nearest hit
+      int childRayMasks[4] = {0, 0, 0, 0};
+      for (int i=0; i<PACKET_SIZE; i++) {
+        if (((current.rayMask >> i) & 1) == 0) continue;
+        bool intersection_results[4];
+        __m128 distancesToAABB;
+        if (BoundingBox::CheckIntersection4floatAABB(node->bboxes, rayOrg[i], inversedRayDir[i], rayDirSign,
+          _mm_setzero_ps(), _mm_set1_ps(currentShortestDistance[i]), intersection_results, distancesToAABB))
+        {
+          for (int childindex=0; childindex<4; childindex++) {
+            if (intersection_results[childindex]) childRayMasks[childindex] |= (1 << i);
+          }
+        }
+      }
+
+      // same ordering as CheckIntersection
+      int ordering[4];
+      const int leftIndexFirst = rayDirSign[node->axis_top] == 0 ? 0 : 2;
+      const int rightIndexFirst = (leftIndexFirst+2)%4;
+      ordering[leftIndexFirst] = rayDirSign[node->axis_left] == 0 ? 0 : 1;
+      ordering[leftIndexFirst+1] = 1 - ordering[leftIndexFirst];
+      ordering[rightIndexFirst] = rayDirSign[node->axis_right] == 0 ? 2 : 3;
+      ordering[rightIndexFirst+1] = 5 - ordering[rightIndexFirst];
+
+      // leaves are checked at once from near to far, inner nodes are pushed so that the nearest is popped first
+      for (int order=0; order<4; order++) {
+        const int childindex = ordering[order];
+        const size_t child = node->children[childindex];
+        if (childRayMasks[childindex] == 0 || !IsValidIndex(child) || !IsChildindexLeaf(child)) continue;
+        const size_t leafindex = GetIndexOfObjectInChildLeaf(child);
+        for (int i=0; i<PACKET_SIZE; i++) {
+          if (((childRayMasks[childindex] >> i) & 1) == 0) continue;
+          Scene::IntersectionInformation infoTmp;
+          if (CheckIntersection_Leaf(rays[i], rayOrg[i], rayDirection[i], leafindex, currentShortestDistance[i], infoTmp)) {
+            if (infos[i].hit.distance > infoTmp.hit.distance) {
+              infos[i] = infoTmp;
+              currentShortestDistance[i] = static_cast<float>(infos[i].hit.distance);
+            }
+          }
+        }
+      }
+      for (int order=3; order>=0; order--) {
+        const int childindex = ordering[order];
+        const size_t child = node->children[childindex];
+        if (childRayMasks[childindex] == 0 || !IsValidIndex(child) || IsChildindexLeaf(child)) continue;
+        assert (stackSize < m_traversalStackSize);
+        indicesStack[stackSize].index = child;
+        indicesStack[stackSize++].rayMask = childRayMasks[childindex];
+      }
+    }
+  }
+
+  bool QBVH::Occluded(const Ray &ray, double maxDistance) const {
+    // any hit closer than maxDistance terminates the traversal, so the children are not ordered
+    const int rayDirSign[3] = {
+      ray.dir.x >= 0 ? 0 : 1,
+      ray.dir.y >= 0 ? 0 : 1,
+      ray.dir.z >= 0 ? 0 : 1
+    };
+    const __m128 rayOrg[3] = {
+      _mm_set1_ps(static_cast<float>(ray.orig.x)),
+      _mm_set1_ps(static_cast<float>(ray.orig.y)),
+      _mm_set1_ps(static_cast<float>(ray.orig.z))
+    };
+    const __m128 rayDirection[3] = {
+      _mm_set1_ps(static_cast<float>(ray.dir.x)),
+      _mm_set1_ps(static_cast<float>(ray.dir.y)),
+      _mm_set1_ps(static_cast<float>(ray.dir.z))
+    };
+    const __m128 inversedRayDir[3] = {
+      _mm_set1_ps(ray.dir.x == 0 ? static_cast<float>(INF) : static_cast<float>(1.0f/ray.dir.x)),
+      _mm_set1_ps(ray.dir.y == 0 ? static_cast<float>(INF) : static_cast<float>(1.0f/ray.dir.y)),
+      _mm_set1_ps(ray.dir.z == 0 ? static_cast<float>(INF) : static_cast<float>(1.0f/ray.dir.z))
+    };
+    const __m128 tmax_m128 = _mm_set1_ps(static_cast<float>(maxDistance));
+
+    const QBVH_structure *root = m_root.get();
+    bool intersection_results[4];
+    __m128 distancesToAABB;
+
+    size_t *indicesStack = static_cast<size_t *>(_alloca(sizeof(size_t) * m_traversalStackSize));
+    size_t stackSize = 0;
+    indicesStack[stackSize++] = 0;  // root index
+    while (stackSize > 0) {
+      const QBVH_structure *node = &root[indicesStack[--stackSize]];
+
+      if (!BoundingBox::CheckIntersection4floatAABB(
+        node->bboxes, rayOrg, inversedRayDir, rayDirSign, _mm_setzero_ps(), tmax_m128, intersection_results, distancesToAABB)) {
+        continue;
+      }
+      for (int childindex = 0; childindex < 4; childindex++) {
+        const size_t child = node->children[childindex];
+        if (!intersection_results[childindex] || !IsValidIndex(child)) continue;
+        if (IsChildindexLeaf(child)) {
+          if (Occluded_Leaf(ray, rayOrg, rayDirection, GetIndexOfObjectInChildLeaf(child), maxDistance)) return true;
+        } else {
+          assert (stackSize < m_traversalStackSize);
+          indicesStack[stackSize++] = child;
+        }
+      }
+    }
+    return false;
+  }
+
+  bool QBVH::Occluded_Leaf(const Ray &ray, const __m128 rayOrig[3], const __m128 rayDir[3], size_t leafIndex, double maxDistance) const {
+    const LeafInfo &leaf = m_leaves[leafIndex];
+
+    const TriangleBlock4 *blocks = m_triangleBlocks.get();
+    const float tmax = static_cast<float>(maxDistance);
+    for (unsigned int i=leaf.firstBlock; i<leaf.firstBlock+leaf.blockCount; i++) {
+      if (blocks[i].Occluded(rayOrig, rayDir, tmax)) return true;
+    }
+    for (size_t i=leaf.firstObject; m_leafObjectArray[i]; i++) {
+      if (m_leafObjectArray[i]->CheckOcclusion(ray, maxDistance)) return true;
+    }
+    return false;
+  }
+
+  bool QBVH::Construct(const std::vector<SceneObject *> &targets, const BVH::CONSTRUCTION_TYPE bvhConstructionType) {
     if (targets.size() == 0) return false;
 
     // at first, construct BVH
     BVH bvh;
-    if (!bvh.Construct(BVH::CONSTRUCTION_OBJECT_SAH, targets)) return false;
+    if (!bvh.Construct(bvhConstructionType, targets)) return false;
 
     // allocate memory
     ReallocateQBVH_root(bvh.GetBVHNodeCount());
@@ -167,15 +381,283 @@ namespace OmochiRenderer {
     m_usedNodeCount = 1; // for the root node
 
     // leaf style:
-    // [OBJ, OBJ, NULL, OBJ, NULL, OBJ, OBJ, OBJ, NULL, ...]
-    // => m_leafObjectArray requires maximum size of "2*targets.size()" size
-    m_leafObjectArray.clear(); m_leafObjectArray.reserve(targets.size()*2);
+    // polygons are packed into m_triangleBlockObjects (TriangleBlock4::WIDTH per block), others are in m_leafObjectArray:
+    // [OBJ, OBJ, NULL, NULL, OBJ, NULL, ...]
+    m_leaves.clear();
+    m_triangleBlockObjects.clear(); m_triangleBlockObjects.reserve(targets.size()*2);
+    m_leafObjectArray.clear();
 
     // flatten the BVH structure to QBVH structure
     const BVH::BVH_structure *bvh_root = bvh.GetRootNode();
 
     Construct_internal(0, bvh, bvh_root);
 
+    BuildTriangleBlocks_internal();
+    CalcTraversalStackSize_internal();
+
+    return true;
+  }
+
+  namespace {
+    // FNV-1a
+    class CacheKeyHash {
+    public:
+      CacheKeyHash() : m_hash(14695981039346656037ULL) {}
+      void Add(const void *data, size_t size) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i=0; i<size; i++) {
+          m_hash ^= bytes[i];
+          m_hash *= 1099511628211ULL;
+        }
+      }
+      template <typename T> void Add(const T &value) { Add(&value, sizeof(value)); }
+      void Add(const Vector3 &v) { Add(v.x); Add(v.y); Add(v.z); }
+      unsigned long long Get() const { return m_hash; }
+    private:
+      unsigned long long m_hash;
+    };
+
+    struct CacheFileHeader {
+      char magic[8];
+      unsigned int version;
+      unsigned int nodeSize;
+      unsigned int blockSize;
+      unsigned int traversalStackSize;
+      unsigned long long key;
+      unsigned long long objectCount;
+      unsigned long long nodeCount;
+      unsigned long long nodesOffset;
+      unsigned long long blockCount;
+      unsigned long long blocksOffset;
+      unsigned long long blockObjectsOffset;
+      unsigned long long leafCount;
+      unsigned long long leavesOffset;
+      unsigned long long leafEntryCount;
+      unsigned long long leafEntriesOffset;
+    };
+    const char CACHE_FILE_MAGIC[8] = {'O', 'M', 'Q', 'B', 'V', 'H', 'C', '\0'};
+    const unsigned int NULL_LEAF_ENTRY = static_cast<unsigned int>(-1);
+    const size_t CACHE_SECTION_ALIGNMENT = 64;
+
+    bool ConvertObjectsToIndices(const std::vector<SceneObject *> &objects, const std::unordered_map<const SceneObject *, unsigned int> &objectIndices,
+      std::vector<unsigned int> &indices)
+    {
+      indices.resize(objects.size());
+      for (size_t i=0; i<objects.size(); i++) {
+        if (objects[i] == NULL) {
+          indices[i] = NULL_LEAF_ENTRY;
+        } else {
+          auto it = objectIndices.find(objects[i]);
+          if (it == objectIndices.end()) return false;
+          indices[i] = it->second;
+        }
+      }
+      return true;
+    }
+
+    bool ConvertIndicesToObjects(const unsigned int *indices, size_t count, const std::vector<SceneObject *> &targets, std::vector<SceneObject *> &objects) {
+      objects.resize(count);
+      for (size_t i=0; i<count; i++) {
+        if (indices[i] == NULL_LEAF_ENTRY) {
+          objects[i] = NULL;
+        } else if (indices[i] < targets.size()) {
+          objects[i] = targets[indices[i]];
+        } else {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // start of a section of the cache file
+    unsigned long long ReserveCacheSection(unsigned long long &fileSize, unsigned long long sectionSize, size_t alignment) {
+      const unsigned long long offset = (fileSize + alignment - 1) / alignment * alignment;
+      fileSize = offset + sectionSize;
+      return offset;
+    }
+  }
+
+  unsigned long long QBVH::CalcCacheKey(const std::vector<SceneObject *> &targets, const BVH::CONSTRUCTION_TYPE bvhConstructionType,
+    const std::vector<std::string> &sourceFiles)
+  {
+    CacheKeyHash hash;
+
+    // build parameters
+    hash.Add(static_cast<unsigned int>(CACHE_VERSION));
+    hash.Add(static_cast<unsigned int>(sizeof(QBVH_structure)));
+    hash.Add(static_cast<unsigned int>(sizeof(TriangleBlock4)));
+    hash.Add(static_cast<unsigned int>(sizeof(Real)));
+    hash.Add(static_cast<int>(bvhConstructionType));
+    hash.Add(static_cast<int>(BVH::BINNED_SAH_BIN_COUNT));
+    hash.Add(static_cast<int>(BVH::SBVH_SPATIAL_BIN_COUNT));
+    hash.Add(static_cast<int>(BVH::SBVH_MAX_DUPLICATION_PERCENT));
+    hash.Add(static_cast<int>(BVH::LBVH_MAX_LEAF_COUNT));
+
+    // geometry after the transforms, in order
+    hash.Add(targets.size());
+    for (size_t i=0; i<targets.size(); i++) {
+      const SceneObject *obj = targets[i];
+      hash.Add(obj->boundingBox.min());
+      hash.Add(obj->boundingBox.max());
+      const TriangleBase *triangle = dynamic_cast<const TriangleBase *>(obj);
+      if (triangle) {
+        Vector3 vertex0, edge1, edge2;
+        triangle->GetVertexAndEdges(vertex0, edge1, edge2);
+        hash.Add(vertex0); hash.Add(edge1); hash.Add(edge2);
+      }
+    }
+
+    // the files the targets came from
+    for (size_t i=0; i<sourceFiles.size(); i++) {
+      hash.Add(sourceFiles[i].c_str(), sourceFiles[i].size());
+      struct _stat64 fileStatus;
+      if (_stat64(sourceFiles[i].c_str(), &fileStatus) == 0) {
+        hash.Add(static_cast<long long>(fileStatus.st_size));
+        hash.Add(static_cast<long long>(fileStatus.st_mtime));
+      } else {
+        hash.Add(-1LL);
+      }
+    }
+
+    return hash.Get();
+  }
+
+  bool QBVH::SaveToFile(const std::string &file, unsigned long long key, const std::vector<SceneObject *> &targets) const {
+    if (!m_root || m_usedNodeCount == 0) return false;
+
+    std::unordered_map<const SceneObject *, unsigned int> objectIndices;
+    for (size_t i=0; i<targets.size(); i++) objectIndices[targets[i]] = static_cast<unsigned int>(i);
+
+    std::vector<unsigned int> blockObjectEntries, leafEntries;
+    if (!ConvertObjectsToIndices(m_triangleBlockObjects, objectIndices, blockObjectEntries) ||
+      !ConvertObjectsToIndices(m_leafObjectArray, objectIndices, leafEntries))
+    {
+      return false;
+    }
+    const size_t blockCount = m_triangleBlockObjects.size() / TriangleBlock4::WIDTH;
+
+    CacheFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.nodeSize = sizeof(QBVH_structure);
+    header.blockSize = sizeof(TriangleBlock4);
+    header.traversalStackSize = static_cast<unsigned int>(m_traversalStackSize);
+    header.key = key;
+    header.objectCount = targets.size();
+
+    // nodes and blocks are aligned so that they can be used in the mapped file as they are
+    unsigned long long fileSize = sizeof(header);
+    header.nodeCount = m_usedNodeCount;
+    header.nodesOffset = ReserveCacheSection(fileSize, sizeof(QBVH_structure) * m_usedNodeCount, CACHE_SECTION_ALIGNMENT);
+    header.blockCount = blockCount;
+    header.blocksOffset = ReserveCacheSection(fileSize, sizeof(TriangleBlock4) * blockCount, CACHE_SECTION_ALIGNMENT);
+    header.blockObjectsOffset = ReserveCacheSection(fileSize, sizeof(unsigned int) * blockObjectEntries.size(), sizeof(unsigned int));
+    header.leafCount = m_leaves.size();
+    header.leavesOffset = ReserveCacheSection(fileSize, sizeof(LeafInfo) * m_leaves.size(), sizeof(unsigned int));
+    header.leafEntryCount = leafEntries.size();
+    header.leafEntriesOffset = ReserveCacheSection(fileSize, sizeof(unsigned int) * leafEntries.size(), sizeof(unsigned int));
+
+    std::ofstream ofs(file.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!ofs) return false;
+
+    unsigned long long written = 0;
+    auto writeSection = [&ofs, &written](unsigned long long offset, const void *data, size_t size) {
+      const char padding[CACHE_SECTION_ALIGNMENT] = {0};
+      assert (offset >= written && offset - written <= CACHE_SECTION_ALIGNMENT);
+      ofs.write(padding, static_cast<std::streamsize>(offset - written));
+      if (size > 0) ofs.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+      written = offset + size;
+    };
+    writeSection(0, &header, sizeof(header));
+    writeSection(header.nodesOffset, m_root.get(), sizeof(QBVH_structure) * m_usedNodeCount);
+    writeSection(header.blocksOffset, m_triangleBlocks.get(), sizeof(TriangleBlock4) * blockCount);
+    writeSection(header.blockObjectsOffset, blockObjectEntries.empty() ? NULL : &blockObjectEntries[0], sizeof(unsigned int) * blockObjectEntries.size());
+    writeSection(header.leavesOffset, m_leaves.empty() ? NULL : &m_leaves[0], sizeof(LeafInfo) * m_leaves.size());
+    writeSection(header.leafEntriesOffset, leafEntries.empty() ? NULL : &leafEntries[0], sizeof(unsigned int) * leafEntries.size());
+
+    return ofs.good();
+  }
+
+  bool QBVH::LoadFromFile(const std::string &file, unsigned long long key, const std::vector<SceneObject *> &targets) {
+    std::shared_ptr<MappedFile> mappedFile(new MappedFile);
+    if (!mappedFile->Open(file)) return false;
+
+    unsigned char *data = mappedFile->GetData();
+    const size_t size = mappedFile->GetSize();
+    if (size < sizeof(CacheFileHeader)) return false;
+
+    CacheFileHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != CACHE_VERSION ||
+      header.nodeSize != sizeof(QBVH_structure) ||
+      header.blockSize != sizeof(TriangleBlock4) ||
+      header.key != key ||
+      header.objectCount != targets.size() ||
+      header.nodeCount == 0 ||
+      header.nodesOffset % CACHE_SECTION_ALIGNMENT != 0 ||
+      header.blocksOffset % CACHE_SECTION_ALIGNMENT != 0 ||
+      header.nodesOffset + sizeof(QBVH_structure) * header.nodeCount > size ||
+      header.blocksOffset + sizeof(TriangleBlock4) * header.blockCount > size ||
+      header.blockObjectsOffset + sizeof(unsigned int) * TriangleBlock4::WIDTH * header.blockCount > size ||
+      header.leavesOffset + sizeof(LeafInfo) * header.leafCount > size ||
+      header.leafEntriesOffset + sizeof(unsigned int) * header.leafEntryCount > size)
+    {
+      return false;
+    }
+
+    std::vector<SceneObject *> triangleBlockObjects, leafObjectArray;
+    if (!ConvertIndicesToObjects(reinterpret_cast<const unsigned int *>(data + header.blockObjectsOffset),
+        static_cast<size_t>(header.blockCount) * TriangleBlock4::WIDTH, targets, triangleBlockObjects) ||
+      !ConvertIndicesToObjects(reinterpret_cast<const unsigned int *>(data + header.leafEntriesOffset),
+        static_cast<size_t>(header.leafEntryCount), targets, leafObjectArray))
+    {
+      return false;
+    }
+    const LeafInfo *leaves = reinterpret_cast<const LeafInfo *>(data + header.leavesOffset);
+
+    // the traversal trusts the indices in the nodes and the leaves, so a broken file is rejected (and the QBVH is rebuilt).
+    // the construction gives each inner node one parent with a smaller index, so anything else is broken too
+    const QBVH_structure *nodes = reinterpret_cast<const QBVH_structure *>(data + header.nodesOffset);
+    std::vector<bool> referenced(static_cast<size_t>(header.nodeCount), false);
+    for (size_t i=0; i<header.nodeCount; i++) {
+      for (int j=0; j<4; j++) {
+        const size_t child = nodes[i].children[j];
+        if (!IsValidIndex(child)) continue;
+        if (IsChildindexLeaf(child)) {
+          if (GetIndexOfObjectInChildLeaf(child) >= header.leafCount) return false;
+        } else {
+          if (child >= header.nodeCount || child <= i || referenced[child]) return false;
+          referenced[child] = true;
+        }
+      }
+    }
+    // the objects of a leaf are terminated by NULL, so the array must end with one
+    if (header.leafCount > 0 && (leafObjectArray.empty() || leafObjectArray.back() != NULL)) return false;
+    for (size_t i=0; i<header.leafCount; i++) {
+      const LeafInfo &leaf = leaves[i];
+      if (static_cast<unsigned long long>(leaf.firstBlock) + leaf.blockCount > header.blockCount ||
+        leaf.firstObject >= leafObjectArray.size())
+      {
+        return false;
+      }
+    }
+
+    // the nodes and the blocks are used in place: the mapping is released with the last reference to them
+    m_root = std::shared_ptr<QBVH_structure>(mappedFile, reinterpret_cast<QBVH_structure *>(data + header.nodesOffset));
+    m_allocatedQBVHNodeSize = m_usedNodeCount = static_cast<size_t>(header.nodeCount);
+    if (header.blockCount > 0) {
+      m_triangleBlocks = std::shared_ptr<TriangleBlock4>(mappedFile, reinterpret_cast<TriangleBlock4 *>(data + header.blocksOffset));
+    } else {
+      m_triangleBlocks.reset();
+    }
+    m_triangleBlockObjects.swap(triangleBlockObjects);
+    m_leaves.assign(leaves, leaves + header.leafCount);
+    m_leafObjectArray.swap(leafObjectArray);
+    // the traversal stack is allocated with this size, so it is recalculated from the nodes instead of read from the header
+    CalcTraversalStackSize_internal();
+
     return true;
   }
 
@@ -260,12 +742,56 @@ namespace OmochiRenderer {
   }
   void QBVH::MakeLeaf_internal(size_t index, const BVH::BVH_structure *leaf, size_t childindex) {
     // child is a leaf
-    size_t startindexofobjects = m_leafObjectArray.size();
+    LeafInfo leafInfo;
+    leafInfo.firstBlock = static_cast<unsigned int>(m_triangleBlockObjects.size() / TriangleBlock4::WIDTH);
+    leafInfo.firstObject = static_cast<unsigned int>(m_leafObjectArray.size());
     for (int j=0; leaf->objects[j] != NULL; j++) {
-      m_leafObjectArray.push_back(leaf->objects[j]);
+      if (dynamic_cast<const TriangleBase *>(leaf->objects[j])) {
+        m_triangleBlockObjects.push_back(leaf->objects[j]);
+      } else {
+        m_leafObjectArray.push_back(leaf->objects[j]);
+      }
     }
+    while (m_triangleBlockObjects.size() % TriangleBlock4::WIDTH != 0) m_triangleBlockObjects.push_back(NULL);
     m_leafObjectArray.push_back(NULL);
-    m_root.get()[index].children[childindex] = SetChildindexAsLeaf(startindexofobjects);
+    leafInfo.blockCount = static_cast<unsigned int>(m_triangleBlockObjects.size() / TriangleBlock4::WIDTH) - leafInfo.firstBlock;
+
+    m_root.get()[index].children[childindex] = SetChildindexAsLeaf(m_leaves.size());
+    m_leaves.push_back(leafInfo);
+  }
+
+  // each inner node pops one entry and pushes at most 4 inner children,
+  // so the traversal stack never exceeds (3 * max depth of inner nodes + 1) entries
+  void QBVH::CalcTraversalStackSize_internal() {
+    size_t maxDepth = 0;
+    std::vector<std::pair<size_t, size_t> > indicesStack; // (index, depth)
+    indicesStack.push_back(std::make_pair(static_cast<size_t>(0), static_cast<size_t>(0)));
+    while (!indicesStack.empty()) {
+      const std::pair<size_t, size_t> current = indicesStack.back();
+      indicesStack.pop_back();
+      if (current.second > maxDepth) maxDepth = current.second;
+      const QBVH_structure &node = m_root.get()[current.first];
+      for (int i=0; i<4; i++) {
+        if (!IsChildindexLeaf(node.children[i])) {
+          indicesStack.push_back(std::make_pair(node.children[i], current.second + 1));
+        }
+      }
+    }
+    m_traversalStackSize = 3 * maxDepth + 1;
+  }
+
+  void QBVH::BuildTriangleBlocks_internal() {
+    const size_t blockCount = m_triangleBlockObjects.size() / TriangleBlock4::WIDTH;
+    m_triangleBlocks.reset();
+    if (blockCount == 0) return;
+
+    TriangleBlock4 *blocks = static_cast<TriangleBlock4 *>(_aligned_malloc(sizeof(TriangleBlock4)*blockCount, 16));
+    memset(blocks, 0, sizeof(TriangleBlock4)*blockCount);
+    for (size_t i=0; i<m_triangleBlockObjects.size(); i++) {
+      if (m_triangleBlockObjects[i] == NULL) continue;
+      blocks[i / TriangleBlock4::WIDTH].Set(static_cast<int>(i % TriangleBlock4::WIDTH), static_cast<const TriangleBase *>(m_triangleBlockObjects[i]));
+    }
+    m_triangleBlocks.reset(blocks, [](void *p){_aligned_free(p);});
   }
 
   size_t QBVH::SetChildindexAsLeaf(size_t childindex) {
@@ -2,29 +2,51 @@
 
 #include <vector>
 #include <memory>
+#include <string>
 #include "scenes/Scene.h"
 #include "BVH.h"
+#include "TriangleBlock.h"
 
 namespace OmochiRenderer {
   class SceneObject;
   class Ray;
-  struct Scene::IntersectionInformation;
 
   class QBVH {
   public:
-    explicit QBVH() : m_root(NULL), m_allocatedQBVHNodeSize(0), m_usedNodeCount(0), m_leafObjectArray(NULL) {}
+    explicit QBVH() : m_root(NULL), m_allocatedQBVHNodeSize(0), m_usedNodeCount(0), m_traversalStackSize(0), m_leaves(), m_triangleBlocks(), m_triangleBlockObjects(), m_leafObjectArray() {}
     ~QBVH();
 
-    bool Construct(const std::vector<SceneObject *> &targets);
+    bool Construct(const std::vector<SceneObject *> &targets, const BVH::CONSTRUCTION_TYPE bvhConstructionType = BVH::CONSTRUCTION_OBJECT_SAH);
     bool CheckIntersection(const Ray &ray, Scene::IntersectionInformation &info) const;
+    // true if anything is hit closer than maxDistance (for shadow rays)
+    bool Occluded(const Ray &ray, double maxDistance) const;
+
+    // traces a packet of coherent rays (e.g. camera rays of neighbouring pixels) together.
+    // rays whose bit in activeMask is 0 are ignored (their infos are not changed).
+    // rays whose direction signs differ from the others are not coherent, and then all are traced one by one
+    static const int PACKET_SIZE = 4;
+    void CheckIntersectionPacket(const Ray rays[PACKET_SIZE], int activeMask, Scene::IntersectionInformation infos[PACKET_SIZE]) const;
 
     void CollectBoundingBoxes(int depth, std::vector<BoundingBox> &result); // for Visualization
 
+    // on-disk cache of the flattened structure and the objects in the leaves.
+    // the key identifies the targets (their geometry and order), the construction type and the files they were read from
+    static unsigned long long CalcCacheKey(const std::vector<SceneObject *> &targets, const BVH::CONSTRUCTION_TYPE bvhConstructionType,
+      const std::vector<std::string> &sourceFiles);
+    bool SaveToFile(const std::string &file, unsigned long long key, const std::vector<SceneObject *> &targets) const;
+    bool LoadFromFile(const std::string &file, unsigned long long key, const std::vector<SceneObject *> &targets);
+
+    static const unsigned int CACHE_VERSION = 3;
+
   private:
     void Construct_internal(size_t nextindex, const BVH &bvh, const BVH::BVH_structure *nextTarget);
     void MakeLeaf_internal(size_t index, const BVH::BVH_structure *leaf, size_t childindex);
+    void BuildTriangleBlocks_internal();
+    void CalcTraversalStackSize_internal();
 
-    bool CheckIntersection_Leaf(const Ray &ray, size_t leafStartIndex, Scene::IntersectionInformation &hitResultDetail) const;
+    bool CheckIntersection_Leaf(const Ray &ray, const __m128 rayOrig[3], const __m128 rayDir[3], size_t leafIndex, float tmax,
+      Scene::IntersectionInformation &hitResultDetail) const;
+    bool Occluded_Leaf(const Ray &ray, const __m128 rayOrig[3], const __m128 rayDir[3], size_t leafIndex, double maxDistance) const;
 
     static size_t SetChildindexAsLeaf(size_t childindex);
     static size_t GetInvalidChildIndex();
@@ -47,6 +69,16 @@ namespace OmochiRenderer {
     };
     std::shared_ptr<QBVH_structure> m_root;
     size_t m_allocatedQBVHNodeSize, m_usedNodeCount;
+    size_t m_traversalStackSize; // entries required by the traversal stack of CheckIntersection
+    // a leaf child index points to m_leaves
+    struct LeafInfo {
+      unsigned int firstBlock;   // polygons: m_triangleBlocks[firstBlock, firstBlock+blockCount)
+      unsigned int blockCount;
+      unsigned int firstObject;  // other objects: m_leafObjectArray[firstObject...] (NULL terminated)
+    };
+    std::vector<LeafInfo> m_leaves;
+    std::shared_ptr<TriangleBlock4> m_triangleBlocks;
+    std::vector<SceneObject *> m_triangleBlockObjects; // TriangleBlock4::WIDTH objects for each block (NULL for empty lanes)
     std::vector<SceneObject *> m_leafObjectArray;
     
   };
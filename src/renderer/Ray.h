@@ -6,14 +6,20 @@ namespace OmochiRenderer {
 
 class Ray {
 public:
+  Ray()
+    : orig()
+    , dir()
+  {
+  }
   Ray(const Vector3 &begin_, const Vector3 &dir_)
     : orig(begin_)
     , dir(dir_)
   {
   }
 
+  // the point at t. summed in double also in the float pipeline: the next rays start from there
   Vector3 operator()(double t) const {
-    return orig + dir*t;
+    return Vector3(Vector3d(orig) + Vector3d(dir)*t);
   }
 
   Vector3 orig;
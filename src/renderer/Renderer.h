@@ -1,5 +1,7 @@
 #pragma once
 
+#include <string>
+#include <functional>
 #include "Color.h"
 
 namespace OmochiRenderer {
@@ -10,6 +12,9 @@ namespace OmochiRenderer {
   protected:
     bool m_enableRendering;
   public:
+    // _OɌĂяoR[obNp\bh`
+    typedef std::function<void(int samples, const Color *result, double accumulatedRenderingTime)> RenderingFinishCallbackFunction;
+
     Renderer() : m_enableRendering(true) {}
     virtual ~Renderer() {};
 
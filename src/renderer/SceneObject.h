@@ -2,25 +2,43 @@
 
 #include "Color.h"
 #include "Material.h"
+#include "MaterialTable.h"
 #include "BoundingBox.h"
+#include "HitInformation.h"
 
 namespace OmochiRenderer {
 
 class Ray;
-class HitInformation;
+class LightBase;
 
 class SceneObject {
 public:
   SceneObject(const Material &material_)
-    : material(material_)
+    : materialId(MaterialTable::GetInstance().Register(material_))
+    , position(0,0,0)
+  {
+  }
+  SceneObject(MaterialTable::MATERIAL_ID materialId_)
+    : materialId(materialId_)
     , position(0,0,0)
   {
   }
   virtual ~SceneObject() {}
 
   virtual bool CheckIntersection(const Ray &ray, HitInformation &hit) const = 0;
+  // true if the ray hits this object closer than maxDistance. for shadow rays, which need no hit information
+  virtual bool CheckOcclusion(const Ray &ray, double maxDistance) const {
+    HitInformation hit;
+    return CheckIntersection(ray, hit) && hit.distance < maxDistance;
+  }
+  // the light of this object, nullptr if it is not a light. cheaper than dynamic_cast on every hit
+  virtual const LightBase *AsLight() const { return nullptr; }
+
+  const Material &GetMaterial() const {
+    return MaterialTable::GetInstance().Get(materialId);
+  }
 
-  Material material;
+  MaterialTable::MATERIAL_ID materialId;
   Vector3 position;
   BoundingBox boundingBox;
 };
@@ -30,6 +30,15 @@ namespace OmochiRenderer {
       , m_showPreview(true)
       , m_rawSettings()
       , m_saveHDR(true)
+      , m_tileSize(32)
+      , m_tileOrder("hilbert")
+      , m_tileCenterOut(true)
+      , m_adaptiveErrorThreshold(0.0)
+      , m_adaptiveMinSamples(4)
+      , m_stopWhenConverged(false)
+      , m_sampler("sobol")
+      , m_lightSampling("power")
+      , m_iblLookup("latlong")
     {
     }
     ~Settings() {}
@@ -99,6 +108,24 @@ namespace OmochiRenderer {
           m_timeToStopRenderer = atof(value.c_str());
         } else if (keyword == "save hdr") {
           m_saveHDR = Utils::parseBoolean(value);
+        } else if (keyword == "tile size") {
+          m_tileSize = atoi(value.c_str());
+        } else if (keyword == "tile order") {
+          m_tileOrder = value;
+        } else if (keyword == "tile center out") {
+          m_tileCenterOut = Utils::parseBoolean(value);
+        } else if (keyword == "adaptive error threshold") {
+          m_adaptiveErrorThreshold = atof(value.c_str());
+        } else if (keyword == "adaptive min samples") {
+          m_adaptiveMinSamples = atoi(value.c_str());
+        } else if (keyword == "stop when converged") {
+          m_stopWhenConverged = Utils::parseBoolean(value);
+        } else if (keyword == "sampler") {
+          m_sampler = value;
+        } else if (keyword == "light sampling") {
+          m_lightSampling = value;
+        } else if (keyword == "ibl lookup") {
+          m_iblLookup = value;
         } else {
           //std::cerr << "Unknown keyword: " << keyword << std::endl;
         }
@@ -132,6 +159,18 @@ namespace OmochiRenderer {
 
     double GetTimeToStopRenderer() const { return m_timeToStopRenderer; }
 
+    int GetTileSize() const { return m_tileSize; }
+    const std::string &GetTileOrder() const { return m_tileOrder; }
+    bool DoServeTilesCenterOut() const { return m_tileCenterOut; }
+
+    double GetAdaptiveErrorThreshold() const { return m_adaptiveErrorThreshold; }
+    int GetAdaptiveMinSamples() const { return m_adaptiveMinSamples; }
+    bool DoStopWhenConverged() const { return m_stopWhenConverged; }
+
+    const std::string &GetSampler() const { return m_sampler; }
+    const std::string &GetLightSampling() const { return m_lightSampling; }
+    const std::string &GetIBLLookup() const { return m_iblLookup; }
+
     double GetScreenHeightInWorldCoordinate() const { return m_screenHeightInWorldCoordinate; }
     double GetDistanceFromCameraToScreen() const { return m_distanceFromCameraToScreen; }
 
@@ -164,6 +203,18 @@ namespace OmochiRenderer {
 
     bool m_saveHDR;
 
+    int m_tileSize;
+    std::string m_tileOrder;
+    bool m_tileCenterOut;
+
+    double m_adaptiveErrorThreshold;
+    int m_adaptiveMinSamples;
+    bool m_stopWhenConverged;
+
+    std::string m_sampler;
+    std::string m_lightSampling;
+    std::string m_iblLookup;
+
     std::map<std::string, std::string> m_rawSettings;
   };
 }
@@ -19,16 +19,34 @@ public:
   }
 
   bool CheckIntersection(const Ray &ray, HitInformation &hit) const
+  {
+    if (!CalcDistance(ray, hit.distance)) return false;
+
+    hit.position = ray(hit.distance);
+    hit.normal = hit.position - position; hit.normal.normalize();
+
+    return true;
+  }
+
+  bool CheckOcclusion(const Ray &ray, double maxDistance) const
+  {
+    double distance;
+    return CalcDistance(ray, distance) && distance < maxDistance;
+  }
+
+  // distance to the nearest hit point in front of the ray origin
+  bool CalcDistance(const Ray &ray, double &distance) const
   {
     // x: the origin of the ray
     // v: normalized direction of the ray
     // c: the center of this sphere
-    const Vector3 &x = ray.orig;
-    const Vector3 &v = ray.dir;
-    const Vector3 &c = position;
+    // in double also in the float pipeline: the squared distances of a huge sphere (e.g. a wall of radius 1e5) cancel out
+    const Vector3d x(ray.orig);
+    const Vector3d v(ray.dir);
+    const Vector3d c(position);
 
     // ʎ
-    Vector3 c_minus_x = c-x;
+    Vector3d c_minus_x = c-x;
     double v_dot_c_minus_x = v.dot(c_minus_x);
     double D1 = v_dot_c_minus_x * v_dot_c_minus_x;
     double D2 = v.lengthSq() * (c_minus_x.lengthSq() - m_radius*m_radius);
@@ -41,11 +59,8 @@ public:
 
     if (t1 <= EPS && t2 <= EPS) return false;
     
-    if (t2 > EPS) hit.distance = t2;
-    else hit.distance = t1;
-
-    hit.position = x + v * hit.distance;
-    hit.normal = hit.position - position; hit.normal.normalize();
+    if (t2 > EPS) distance = t2;
+    else distance = t1;
 
     return true;
   }
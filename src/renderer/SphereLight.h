@@ -2,7 +2,7 @@
 
 #include "LightBase.h"
 #include "Sphere.h"
-#include "tools/Random.h"
+#include "tools/Sampler.h"
 
 namespace OmochiRenderer {
   class SphereLight : public Sphere, public LightBase {
@@ -14,7 +14,7 @@ namespace OmochiRenderer {
     }
     virtual ~SphereLight() {}
 
-    virtual void SampleOnePoint(Vector3 &point, Vector3 &normal, double &pdf, const Random &rnd) const {
+    virtual void SampleOnePoint(Vector3 &point, Vector3 &normal, double &pdf, const Sampler &rnd) const {
       
       // 
       
@@ -25,8 +25,10 @@ namespace OmochiRenderer {
       pdf = 1.0 / (4 * PI *m_radius * m_radius);
        
       // F(, ) = /2*(1-cos)/2
-      double phi = 2 * PI*rnd.nextDouble();
-      double cos_shita = 1 - 2 * rnd.nextDouble();
+      double u1, u2;
+      rnd.next2D(u1, u2);
+      double phi = 2 * PI*u1;
+      double cos_shita = 1 - 2 * u2;
       double sin_shita = sqrt(1-cos_shita*cos_shita);
 
       Vector3 dir(sin_shita*cos(phi), cos_shita, sin_shita*sin(phi));
@@ -36,7 +38,7 @@ namespace OmochiRenderer {
     }
 
     // targetPoint ł\ʒuŃTvO
-    virtual bool SampleOnePointWithTargetPoint(Vector3 &sampledPoint, Vector3 &sampledPointNormal, double &pdf, const Vector3 &targetPoint, const Random &rnd) const {
+    virtual bool SampleOnePointWithTargetPoint(Vector3 &sampledPoint, Vector3 &sampledPointNormal, double &pdf, const Vector3 &targetPoint, const Sampler &rnd) const {
 
       Vector3 diff = targetPoint - this->position;
 
@@ -56,8 +58,10 @@ namespace OmochiRenderer {
       pdf = 1.0 / (2 * PI * m_radius * m_radius * ( 1 - max_cos_shita ) );
 
       // F(, ) = /2*(1-cos)/(1-max_cos)
-      double phi = 2 * PI*rnd.nextDouble();
-      double cos_shita = 1 - (1 - max_cos_shita) * rnd.nextDouble();
+      double u1, u2;
+      rnd.next2D(u1, u2);
+      double phi = 2 * PI*u1;
+      double cos_shita = 1 - (1 - max_cos_shita) * u2;
       double sin_shita = sqrt(1 - cos_shita*cos_shita);
 
       Vector3 dir = normal * cos_shita + axis1 * sin_shita * sin(phi) + axis2 * sin_shita * cos(phi);
@@ -68,8 +72,25 @@ namespace OmochiRenderer {
       return true;
     }
 
+    virtual double PdfWithTargetPoint(const Vector3 &pointOnLight, const Vector3 &targetPoint) const {
+      const double max_cos_shita = m_radius / (targetPoint - this->position).length();
+      if (max_cos_shita > 1) return 0.0;
+
+      Vector3 normal(pointOnLight - this->position); normal.normalize();
+      Vector3 toTarget(targetPoint - pointOnLight);
+      const double distanceSq = toTarget.lengthSq();
+      toTarget /= sqrt(distanceSq);
+      const double light_cos_shita = toTarget.dot(normal);
+      if (light_cos_shita <= 0) return 0.0;
+
+      // area pdf of the cap visible from targetPoint, converted to the solid angle
+      return distanceSq / (light_cos_shita * 2 * PI * m_radius * m_radius * (1 - max_cos_shita));
+    }
+
+    virtual const LightBase *AsLight() const { return this; }
+
     virtual double TotalPower() const {
-      return 4 * PI * m_radius * m_radius * material.emission.length();
+      return 4 * PI * m_radius * m_radius * GetMaterial().emission.length();
     }
   };
 }
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "SceneObject.h"
+#include "Ray.h"
+#include "tools/Constant.h"
+#include "HitInformation.h"
+
+namespace OmochiRenderer {
+
+// a triangle primitive: Polygon, or MeshTriangle referring to a shared TriangleMesh.
+// the BVHs pack the triangles into TriangleBlocks by their vertices and resolve only the nearest hit with CalcHitInformation
+class TriangleBase : public SceneObject {
+public:
+  TriangleBase(MaterialTable::MATERIAL_ID materialId_)
+    : SceneObject(materialId_)
+  {
+  }
+  virtual ~TriangleBase() {}
+
+  // the first vertex (in the world) and the edges from it to the second and the third ones
+  virtual void GetVertexAndEdges(Vector3 &vertex0, Vector3 &edge1, Vector3 &edge2) const = 0;
+
+  // fills the hit information from the distance and the barycentric coordinates of the hit point
+  // (used also by the SIMD intersection of TriangleBlock)
+  virtual void CalcHitInformation(const Ray &ray, double t, double u_rate, double v_rate, HitInformation &hit) const = 0;
+
+  // solves the distance and the barycentric coordinates of the hit point. front faces only (det > EPS)
+  static bool CalcIntersection(const Ray &ray, const Vector3 &vertex0, const Vector3 &edge1, const Vector3 &edge2,
+    double &t, double &u_rate, double &v_rate)
+  {
+    // A
+    // Ql: http://shikousakugo.wordpress.com/2012/07/01/ray-intersection-3/
+    Vector3 P(ray.dir.cross(edge2));
+    double det = P.dot(edge1);
+
+    if (det > EPS) {
+      // solve u
+      Vector3 T(ray.orig - vertex0);
+      double u = P.dot(T);
+
+      if (u>=0 && u<= det) {
+        // solve v
+        Vector3 Q(T.cross(edge1));
+        double v = Q.dot(ray.dir);
+
+        if (v>=0 && u+v<=det) {
+          t = Q.dot(edge2) / det;
+
+          if (t>=EPS) {
+            u_rate = u / det;
+            v_rate = v / det;
+            return true;
+          }
+        }
+      }
+
+    }
+
+    return false;
+  }
+};
+
+}
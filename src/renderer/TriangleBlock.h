@@ -0,0 +1,173 @@
+#pragma once
+
+#include <immintrin.h>
+#include "TriangleBase.h"
+#include "tools/Constant.h"
+
+namespace OmochiRenderer {
+
+  // Triangles (TriangleBase) packed as structure of arrays, to intersect 4 (SSE) or 8 (AVX) of them at once.
+  // The test is the same as TriangleBase::CalcIntersection (front faces only, det > EPS), but in float.
+  // Lanes without a polygon are all zero, so that det is 0 and they never hit.
+
+  struct TriangleBlock4 {
+    static const int WIDTH = 4;
+
+    __m128 origins[3];  // xyz of the first vertices
+    __m128 edges1[3];   // xyz of the second vertices - the first ones
+    __m128 edges2[3];   // xyz of the third vertices - the first ones
+
+    void Set(int lane, const TriangleBase *triangle) {
+      Vector3 origin, edge1, edge2;
+      triangle->GetVertexAndEdges(origin, edge1, edge2);
+      const double values[3][3] = {
+        {origin.x, origin.y, origin.z}, {edge1.x, edge1.y, edge1.z}, {edge2.x, edge2.y, edge2.z}
+      };
+      for (int xyz=0; xyz<3; xyz++) {
+        reinterpret_cast<float *>(&origins[xyz])[lane] = static_cast<float>(values[0][xyz]);
+        reinterpret_cast<float *>(&edges1[xyz])[lane] = static_cast<float>(values[1][xyz]);
+        reinterpret_cast<float *>(&edges2[xyz])[lane] = static_cast<float>(values[2][xyz]);
+      }
+    }
+
+    // returns the lane of the nearest hit closer than tmax, or -1.
+    // if hit, tmax is updated to its distance and u, v are its barycentric coordinates
+    int Intersect(const __m128 rayOrig[3], const __m128 rayDir[3], float &tmax, float &u, float &v) const {
+      __m128 ts, us, vs;
+      const int hitLanes = CalcHitLanes(rayOrig, rayDir, tmax, ts, us, vs);
+      if (hitLanes == 0) return -1;
+
+      __declspec(align(16)) float tArray[4], uArray[4], vArray[4];
+      _mm_store_ps(tArray, ts); _mm_store_ps(uArray, us); _mm_store_ps(vArray, vs);
+      int nearest = -1;
+      for (int lane=0; lane<WIDTH; lane++) {
+        if (((hitLanes >> lane) & 1) && (nearest == -1 || tArray[lane] < tArray[nearest])) nearest = lane;
+      }
+      tmax = tArray[nearest]; u = uArray[nearest]; v = vArray[nearest];
+      return nearest;
+    }
+
+    // true if any polygon is hit closer than tmax
+    bool Occluded(const __m128 rayOrig[3], const __m128 rayDir[3], float tmax) const {
+      __m128 ts, us, vs;
+      return CalcHitLanes(rayOrig, rayDir, tmax, ts, us, vs) != 0;
+    }
+
+  private:
+    // bit mask of the lanes hit closer than tmax, with the distances and barycentric coordinates of all lanes
+    int CalcHitLanes(const __m128 rayOrig[3], const __m128 rayDir[3], float tmax, __m128 &ts, __m128 &us, __m128 &vs) const {
+      const __m128 eps = _mm_set1_ps(static_cast<float>(EPS));
+      const __m128 zero = _mm_setzero_ps();
+      const __m128 one = _mm_set1_ps(1.0f);
+
+      // P = dir x edge2, det = P . edge1
+      const __m128 P[3] = {
+        _mm_sub_ps(_mm_mul_ps(rayDir[1], edges2[2]), _mm_mul_ps(rayDir[2], edges2[1])),
+        _mm_sub_ps(_mm_mul_ps(rayDir[2], edges2[0]), _mm_mul_ps(rayDir[0], edges2[2])),
+        _mm_sub_ps(_mm_mul_ps(rayDir[0], edges2[1]), _mm_mul_ps(rayDir[1], edges2[0]))
+      };
+      const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(P[0], edges1[0]), _mm_mul_ps(P[1], edges1[1])), _mm_mul_ps(P[2], edges1[2]));
+      __m128 mask = _mm_cmpgt_ps(det, eps);
+      if (_mm_movemask_ps(mask) == 0) return 0;
+      const __m128 invDet = _mm_div_ps(one, det);
+
+      // u = (P . T) / det
+      const __m128 T[3] = {_mm_sub_ps(rayOrig[0], origins[0]), _mm_sub_ps(rayOrig[1], origins[1]), _mm_sub_ps(rayOrig[2], origins[2])};
+      us = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(P[0], T[0]), _mm_mul_ps(P[1], T[1])), _mm_mul_ps(P[2], T[2])), invDet);
+      mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(us, zero), _mm_cmple_ps(us, one)));
+
+      // Q = T x edge1, v = (Q . dir) / det
+      const __m128 Q[3] = {
+        _mm_sub_ps(_mm_mul_ps(T[1], edges1[2]), _mm_mul_ps(T[2], edges1[1])),
+        _mm_sub_ps(_mm_mul_ps(T[2], edges1[0]), _mm_mul_ps(T[0], edges1[2])),
+        _mm_sub_ps(_mm_mul_ps(T[0], edges1[1]), _mm_mul_ps(T[1], edges1[0]))
+      };
+      vs = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(Q[0], rayDir[0]), _mm_mul_ps(Q[1], rayDir[1])), _mm_mul_ps(Q[2], rayDir[2])), invDet);
+      mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(vs, zero), _mm_cmple_ps(_mm_add_ps(us, vs), one)));
+
+      // t = (Q . edge2) / det
+      ts = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(Q[0], edges2[0]), _mm_mul_ps(Q[1], edges2[1])), _mm_mul_ps(Q[2], edges2[2])), invDet);
+      mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(ts, eps), _mm_cmplt_ps(ts, _mm_set1_ps(tmax))));
+
+      return _mm_movemask_ps(mask);
+    }
+  };
+
+  struct TriangleBlock8 {
+    static const int WIDTH = 8;
+
+    __m256 origins[3];  // xyz of the first vertices
+    __m256 edges1[3];   // xyz of the second vertices - the first ones
+    __m256 edges2[3];   // xyz of the third vertices - the first ones
+
+    void Set(int lane, const TriangleBase *triangle) {
+      Vector3 origin, edge1, edge2;
+      triangle->GetVertexAndEdges(origin, edge1, edge2);
+      const double values[3][3] = {
+        {origin.x, origin.y, origin.z}, {edge1.x, edge1.y, edge1.z}, {edge2.x, edge2.y, edge2.z}
+      };
+      for (int xyz=0; xyz<3; xyz++) {
+        reinterpret_cast<float *>(&origins[xyz])[lane] = static_cast<float>(values[0][xyz]);
+        reinterpret_cast<float *>(&edges1[xyz])[lane] = static_cast<float>(values[1][xyz]);
+        reinterpret_cast<float *>(&edges2[xyz])[lane] = static_cast<float>(values[2][xyz]);
+      }
+    }
+
+    // same as TriangleBlock4::Intersect
+    int Intersect(const __m256 rayOrig[3], const __m256 rayDir[3], float &tmax, float &u, float &v) const {
+      __m256 ts, us, vs;
+      const int hitLanes = CalcHitLanes(rayOrig, rayDir, tmax, ts, us, vs);
+      if (hitLanes == 0) return -1;
+
+      __declspec(align(32)) float tArray[8], uArray[8], vArray[8];
+      _mm256_store_ps(tArray, ts); _mm256_store_ps(uArray, us); _mm256_store_ps(vArray, vs);
+      int nearest = -1;
+      for (int lane=0; lane<WIDTH; lane++) {
+        if (((hitLanes >> lane) & 1) && (nearest == -1 || tArray[lane] < tArray[nearest])) nearest = lane;
+      }
+      tmax = tArray[nearest]; u = uArray[nearest]; v = vArray[nearest];
+      return nearest;
+    }
+
+    // same as TriangleBlock4::Occluded
+    bool Occluded(const __m256 rayOrig[3], const __m256 rayDir[3], float tmax) const {
+      __m256 ts, us, vs;
+      return CalcHitLanes(rayOrig, rayDir, tmax, ts, us, vs) != 0;
+    }
+
+  private:
+    int CalcHitLanes(const __m256 rayOrig[3], const __m256 rayDir[3], float tmax, __m256 &ts, __m256 &us, __m256 &vs) const {
+      const __m256 eps = _mm256_set1_ps(static_cast<float>(EPS));
+      const __m256 zero = _mm256_setzero_ps();
+      const __m256 one = _mm256_set1_ps(1.0f);
+
+      const __m256 P[3] = {
+        _mm256_sub_ps(_mm256_mul_ps(rayDir[1], edges2[2]), _mm256_mul_ps(rayDir[2], edges2[1])),
+        _mm256_sub_ps(_mm256_mul_ps(rayDir[2], edges2[0]), _mm256_mul_ps(rayDir[0], edges2[2])),
+        _mm256_sub_ps(_mm256_mul_ps(rayDir[0], edges2[1]), _mm256_mul_ps(rayDir[1], edges2[0]))
+      };
+      const __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(P[0], edges1[0]), _mm256_mul_ps(P[1], edges1[1])), _mm256_mul_ps(P[2], edges1[2]));
+      __m256 mask = _mm256_cmp_ps(det, eps, _CMP_GT_OQ);
+      if (_mm256_movemask_ps(mask) == 0) return 0;
+      const __m256 invDet = _mm256_div_ps(one, det);
+
+      const __m256 T[3] = {_mm256_sub_ps(rayOrig[0], origins[0]), _mm256_sub_ps(rayOrig[1], origins[1]), _mm256_sub_ps(rayOrig[2], origins[2])};
+      us = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(P[0], T[0]), _mm256_mul_ps(P[1], T[1])), _mm256_mul_ps(P[2], T[2])), invDet);
+      mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(us, zero, _CMP_GE_OQ), _mm256_cmp_ps(us, one, _CMP_LE_OQ)));
+
+      const __m256 Q[3] = {
+        _mm256_sub_ps(_mm256_mul_ps(T[1], edges1[2]), _mm256_mul_ps(T[2], edges1[1])),
+        _mm256_sub_ps(_mm256_mul_ps(T[2], edges1[0]), _mm256_mul_ps(T[0], edges1[2])),
+        _mm256_sub_ps(_mm256_mul_ps(T[0], edges1[1]), _mm256_mul_ps(T[1], edges1[0]))
+      };
+      vs = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(Q[0], rayDir[0]), _mm256_mul_ps(Q[1], rayDir[1])), _mm256_mul_ps(Q[2], rayDir[2])), invDet);
+      mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(vs, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(us, vs), one, _CMP_LE_OQ)));
+
+      ts = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(Q[0], edges2[0]), _mm256_mul_ps(Q[1], edges2[1])), _mm256_mul_ps(Q[2], edges2[2])), invDet);
+      mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(ts, eps, _CMP_GE_OQ), _mm256_cmp_ps(ts, _mm256_set1_ps(tmax), _CMP_LT_OQ)));
+
+      return _mm256_movemask_ps(mask);
+    }
+  };
+
+}
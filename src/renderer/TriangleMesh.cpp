@@ -0,0 +1,140 @@
+#include "stdafx.h"
+
+#include "TriangleMesh.h"
+
+namespace OmochiRenderer {
+
+namespace {
+  inline Vector3 ToVector3(const float *v) {
+    return Vector3(v[0], v[1], v[2]);
+  }
+  inline void ToFloat3(const Vector3 &v, float *out) {
+    out[0] = static_cast<float>(v.x);
+    out[1] = static_cast<float>(v.y);
+    out[2] = static_cast<float>(v.z);
+  }
+}
+
+MeshTriangle::MeshTriangle(const TriangleMesh *mesh, unsigned int triangleIndex)
+  : TriangleBase(mesh->GetMaterialID())
+  , m_mesh(mesh)
+  , m_triangleIndex(triangleIndex)
+{
+  ReconstructBoundingBox();
+}
+
+bool MeshTriangle::CheckIntersection(const Ray &ray, HitInformation &hit) const {
+  Vector3 vertex0, edge1, edge2;
+  GetVertexAndEdges(vertex0, edge1, edge2);
+  double t, u_rate, v_rate;
+  if (TriangleBase::CalcIntersection(ray, vertex0, edge1, edge2, t, u_rate, v_rate)) {
+    CalcHitInformation(ray, t, u_rate, v_rate, hit);
+    return true;
+  }
+  return false;
+}
+
+bool MeshTriangle::CheckOcclusion(const Ray &ray, double maxDistance) const {
+  Vector3 vertex0, edge1, edge2;
+  GetVertexAndEdges(vertex0, edge1, edge2);
+  double t, u_rate, v_rate;
+  return TriangleBase::CalcIntersection(ray, vertex0, edge1, edge2, t, u_rate, v_rate) && t < maxDistance;
+}
+
+void MeshTriangle::GetVertexAndEdges(Vector3 &vertex0, Vector3 &edge1, Vector3 &edge2) const {
+  vertex0 = m_mesh->GetPosition(m_triangleIndex, 0);
+  edge1 = m_mesh->GetPosition(m_triangleIndex, 1) - vertex0;
+  edge2 = m_mesh->GetPosition(m_triangleIndex, 2) - vertex0;
+}
+
+void MeshTriangle::CalcHitInformation(const Ray &ray, double t, double u_rate, double v_rate, HitInformation &hit) const {
+  const TriangleMesh::Vertex &a = m_mesh->GetVertex(m_triangleIndex, 0);
+  const TriangleMesh::Vertex &b = m_mesh->GetVertex(m_triangleIndex, 1);
+  const TriangleMesh::Vertex &c = m_mesh->GetVertex(m_triangleIndex, 2);
+  const double w_rate = 1.0 - u_rate - v_rate;
+
+  hit.distance = t;
+  hit.position = ray(t);
+  hit.normal = ToVector3(a.normal) * w_rate + ToVector3(b.normal) * u_rate + ToVector3(c.normal) * v_rate;
+  if (hit.normal.lengthSq() == 0) {
+    Vector3 vertex0, edge1, edge2;
+    GetVertexAndEdges(vertex0, edge1, edge2);
+    hit.normal = edge1.cross(edge2);
+  }
+  hit.normal.normalize();
+  hit.uv = Vector3(
+    a.uv[0] * w_rate + b.uv[0] * u_rate + c.uv[0] * v_rate,
+    a.uv[1] * w_rate + b.uv[1] * u_rate + c.uv[1] * v_rate,
+    0.0);
+}
+
+void MeshTriangle::ReconstructBoundingBox() {
+  const Vector3 pos0(m_mesh->GetPosition(m_triangleIndex, 0));
+  const Vector3 pos1(m_mesh->GetPosition(m_triangleIndex, 1));
+  const Vector3 pos2(m_mesh->GetPosition(m_triangleIndex, 2));
+  position = m_mesh->GetPosition();
+  boundingBox.SetBox(
+    Vector3(
+      std::min(std::min(pos0.x, pos1.x), pos2.x),
+      std::min(std::min(pos0.y, pos1.y), pos2.y),
+      std::min(std::min(pos0.z, pos1.z), pos2.z)),
+    Vector3(
+      std::max(std::max(pos0.x, pos1.x), pos2.x),
+      std::max(std::max(pos0.y, pos1.y), pos2.y),
+      std::max(std::max(pos0.z, pos1.z), pos2.z))
+  );
+}
+
+TriangleMesh::TriangleMesh(MaterialTable::MATERIAL_ID materialId)
+  : m_materialId(materialId)
+  , m_position(0, 0, 0)
+  , m_vertices()
+  , m_indices()
+  , m_triangles()
+{
+}
+
+unsigned int TriangleMesh::AddVertex(const Vector3 &position, const Vector3 &normal, const Vector3 &uv) {
+  Vertex vertex;
+  ToFloat3(position, vertex.position);
+  ToFloat3(normal, vertex.normal);
+  vertex.uv[0] = static_cast<float>(uv.x);
+  vertex.uv[1] = static_cast<float>(uv.y);
+  m_vertices.push_back(vertex);
+  return static_cast<unsigned int>(m_vertices.size() - 1);
+}
+
+void TriangleMesh::AddTriangle(unsigned int vertex0, unsigned int vertex1, unsigned int vertex2) {
+  m_indices.push_back(vertex0);
+  m_indices.push_back(vertex1);
+  m_indices.push_back(vertex2);
+}
+
+void TriangleMesh::ConstructTriangles() {
+  // the scene and the BVH keep pointers to the triangles, so they are built at once
+  const size_t count = m_indices.size() / 3;
+  m_triangles.clear();
+  m_triangles.reserve(count);
+  for (size_t i=0; i<count; i++) {
+    m_triangles.push_back(MeshTriangle(this, static_cast<unsigned int>(i)));
+  }
+}
+
+// same as Polygon::Transform: the vertices are rotated and scaled around the origin of the model, then moved to pos
+void TriangleMesh::Transform(const Vector3 &pos, const Vector3 &scale, const Matrix &rot) {
+  m_position = pos;
+  for (size_t i=0; i<m_vertices.size(); i++) {
+    Vertex &vertex = m_vertices[i];
+    Vector3 position(rot.Apply(ToVector3(vertex.position)));
+    position.x *= scale.x;
+    position.y *= scale.y;
+    position.z *= scale.z;
+    ToFloat3(position, vertex.position);
+    ToFloat3(rot.Apply(ToVector3(vertex.normal)), vertex.normal);
+  }
+  for (size_t i=0; i<m_triangles.size(); i++) {
+    m_triangles[i].ReconstructBoundingBox();
+  }
+}
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include "TriangleBase.h"
+#include "tools/Matrix.h"
+
+namespace OmochiRenderer {
+
+class TriangleMesh;
+
+// a triangle of a TriangleMesh. it refers to the mesh and its index there; the vertices are shared in the mesh
+class MeshTriangle : public TriangleBase {
+public:
+  MeshTriangle(const TriangleMesh *mesh, unsigned int triangleIndex);
+  virtual ~MeshTriangle() {}
+
+  bool CheckIntersection(const Ray &ray, HitInformation &hit) const;
+  bool CheckOcclusion(const Ray &ray, double maxDistance) const;
+
+  void GetVertexAndEdges(Vector3 &vertex0, Vector3 &edge1, Vector3 &edge2) const;
+  void CalcHitInformation(const Ray &ray, double t, double u_rate, double v_rate, HitInformation &hit) const;
+
+  // after the vertices of the mesh are moved
+  void ReconstructBoundingBox();
+
+private:
+  const TriangleMesh *m_mesh;
+  unsigned int m_triangleIndex;
+};
+
+// triangles of one material sharing float arrays of vertices (position, normal, uv) through index triplets.
+// Model builds one per material of an .obj file instead of a Polygon per face
+class TriangleMesh {
+public:
+  struct Vertex {
+    float position[3];
+    float normal[3];  // zero if the face gave no normal: the face normal is used
+    float uv[2];
+  };
+
+public:
+  explicit TriangleMesh(MaterialTable::MATERIAL_ID materialId);
+
+  // returns the index of the vertex
+  unsigned int AddVertex(const Vector3 &position, const Vector3 &normal, const Vector3 &uv);
+  // anticlockwise vertices, as Polygon
+  void AddTriangle(unsigned int vertex0, unsigned int vertex1, unsigned int vertex2);
+  // builds the triangles referred by the BVH. call after all the triangles are added
+  void ConstructTriangles();
+
+  void Transform(const Vector3 &pos, const Vector3 &scale = Vector3::One(), const Matrix &rot = Matrix::Identity());
+
+  MaterialTable::MATERIAL_ID GetMaterialID() const { return m_materialId; }
+  const Vector3 &GetPosition() const { return m_position; }
+  size_t GetVertexCount() const { return m_vertices.size(); }
+  size_t GetTriangleCount() const { return m_triangles.size(); }
+  MeshTriangle *GetTriangle(size_t i) { return &m_triangles[i]; }
+
+  const Vertex &GetVertex(unsigned int triangleIndex, int corner) const {
+    return m_vertices[m_indices[triangleIndex * 3 + corner]];
+  }
+  // position in the world
+  Vector3 GetPosition(unsigned int triangleIndex, int corner) const {
+    const float *p = GetVertex(triangleIndex, corner).position;
+    return Vector3(p[0], p[1], p[2]) + m_position;
+  }
+
+private:
+  MaterialTable::MATERIAL_ID m_materialId;
+  Vector3 m_position;
+  std::vector<Vertex> m_vertices;
+  std::vector<unsigned int> m_indices;  // 3 per triangle
+  std::vector<MeshTriangle> m_triangles;
+};
+
+}
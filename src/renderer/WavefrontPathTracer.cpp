@@ -0,0 +1,500 @@
+#include "stdafx.h"
+
+#include "scenes/Scene.h"
+#include "WavefrontPathTracer.h"
+#include "Ray.h"
+#include "tools/Random.h"
+#include "IBL.h"
+
+#include <sstream>
+
+using namespace std;
+
+namespace OmochiRenderer {
+
+namespace {
+  inline Color Multiply(const Color &a, const Color &b) {
+    return Color(a.x*b.x, a.y*b.y, a.z*b.z);
+  }
+
+  // MIS weight of a sample taken with pdf, when the same path can also be sampled with otherPdf
+  inline double PowerHeuristic(double pdf, double otherPdf) {
+    return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+  }
+}
+
+const static int MinDepth = 5;
+const static int MaxDepth = 64;
+
+void WavefrontPathTracer::PathStates::Resize(size_t size) {
+  origin.resize(size);
+  direction.resize(size);
+  throughput.resize(size);
+  radiance.resize(size);
+  pixelIndex.resize(size);
+  depth.resize(size);
+  bsdfPdf.resize(size);
+  bsdfNormal.resize(size);
+  rnd.resize(size, Random(0));
+  intersection.resize(size);
+  intersected.resize(size);
+  alive.resize(size);
+  hasShadowRay.resize(size);
+  shadowDirection.resize(size);
+  shadowDistance.resize(size);
+  shadowContribution.resize(size);
+}
+
+void WavefrontPathTracer::PathStates::Move(size_t from, size_t to) {
+  origin[to] = origin[from];
+  direction[to] = direction[from];
+  throughput[to] = throughput[from];
+  radiance[to] = radiance[from];
+  pixelIndex[to] = pixelIndex[from];
+  depth[to] = depth[from];
+  bsdfPdf[to] = bsdfPdf[from];
+  bsdfNormal[to] = bsdfNormal[from];
+  rnd[to] = rnd[from];
+}
+
+WavefrontPathTracer::WavefrontPathTracer(const Camera &camera, int samples, int supersamples)
+  : Renderer()
+  , m_camera(camera)
+{
+  init(camera, samples, samples, 1, supersamples, nullptr);
+}
+
+WavefrontPathTracer::WavefrontPathTracer(const Camera &camera, int min_samples, int max_samples, int steps, int supersamples, RenderingFinishCallbackFunction callback)
+  : Renderer()
+  , m_camera(camera)
+{
+  init(camera, min_samples, max_samples, steps, supersamples, callback);
+}
+
+void WavefrontPathTracer::init(const Camera &camera, int min_samples, int max_samples, int steps, int supersamples, RenderingFinishCallbackFunction callback)
+{
+  m_camera = camera;
+  m_currentSamples = 0;
+  m_min_samples = min_samples;
+  m_max_samples = max_samples;
+  m_step_samples = steps;
+  m_supersamples = supersamples;
+  m_previous_samples = 0;
+  m_renderFinishCallback = callback;
+
+  m_checkIntersectionCount = 0;
+  m_finishedPathCount = 0;
+  m_pathCountInIteration = 0;
+  m_lightSampler = nullptr;
+  m_result.resize(m_camera.GetScreenHeight()*m_camera.GetScreenWidth());
+}
+
+WavefrontPathTracer::~WavefrontPathTracer()
+{
+}
+
+void WavefrontPathTracer::RenderScene(const Scene &scene) {
+  m_paths.Resize(WAVEFRONT_SIZE);
+  m_shadeOrder.resize(WAVEFRONT_SIZE);
+  m_shadowRays.resize(WAVEFRONT_SIZE);
+  m_accumulatedRadiance.resize(m_result.size());
+  m_lightSampler = &scene.GetLightSampler();
+
+  m_previous_samples = 0;
+  for (m_currentSamples = m_min_samples; m_currentSamples <= m_max_samples && m_enableRendering; m_currentSamples += m_step_samples) {
+    clock_t t1, t2;
+    t1 = clock();
+    m_checkIntersectionCount = 0;
+    if (!TracePaths(scene, m_previous_samples, m_currentSamples)) {
+      // stopped in the middle of the pass: the result stays at the previous samples
+      m_currentSamples = m_previous_samples;
+      break;
+    }
+    t2 = clock();
+    m_previous_samples = m_currentSamples;
+    cerr << "samples = " << m_currentSamples << " rendering finished." << endl;
+    double pastsec = 1.0*(t2 - t1) / CLOCKS_PER_SEC;
+    cerr << "rendering time = " << (1.0 / 60)*pastsec << " min." << endl;
+    cerr << "speed = " << m_checkIntersectionCount / pastsec << " rays (intersection check)/sec" << endl;
+    if (m_renderFinishCallback) {
+      m_renderFinishCallback(m_currentSamples, &m_result[0], pastsec / 60.0);
+    }
+  }
+
+  // release the path states
+  m_paths = PathStates();
+  vector<int>().swap(m_shadeOrder);
+  vector<int>().swap(m_shadowRays);
+  vector<Color>().swap(m_accumulatedRadiance);
+}
+
+bool WavefrontPathTracer::TracePaths(const Scene &scene, int previous_samples, int next_samples) {
+  const long long pixelCount = static_cast<long long>(m_result.size());
+  m_pathCountInIteration = pixelCount * m_supersamples * m_supersamples * (next_samples - previous_samples);
+  m_finishedPathCount = 0;
+  std::fill(m_accumulatedRadiance.begin(), m_accumulatedRadiance.end(), Color());
+
+  long long nextPathId = 0;
+  int activeCount = 0;
+  bool finished = false;
+  while (m_enableRendering) {
+    const int generated = GeneratePaths(activeCount, nextPathId, m_pathCountInIteration, previous_samples);
+    nextPathId += generated;
+    activeCount += generated;
+    if (activeCount == 0) {
+      finished = true;
+      break;
+    }
+
+    ExtendPaths(scene, activeCount);
+    ShadePaths(scene, activeCount);
+    TraceShadowRays(scene, activeCount);
+    activeCount = CompactPaths(activeCount);
+  }
+  // a partial pass is discarded: averaging it as a full one would darken the pixels whose paths were cut short
+  if (!finished) return false;
+
+  // img_n+c(x) = n/(n+c)*img_n(x) + 1/(n+c)*sum_{n+1}^{n+c}rad_i(x)/supersamples^2
+  const double averaging_factor = next_samples * m_supersamples * m_supersamples;
+  for (size_t i = 0; i < m_result.size(); i++) {
+    m_result[i] = m_result[i] * (static_cast<double>(previous_samples) / next_samples) + m_accumulatedRadiance[i] / averaging_factor;
+  }
+  return true;
+}
+
+// path id -> (sample, sub pixel, y, x), x running fastest so that the neighbouring slots get coherent camera rays
+int WavefrontPathTracer::GeneratePaths(int activeCount, long long firstPathId, long long pathCount, int previous_samples) {
+  const int count = static_cast<int>(std::min<long long>(WAVEFRONT_SIZE - activeCount, pathCount - firstPathId));
+  if (count <= 0) return 0;
+
+  const long long width = m_camera.GetScreenWidth();
+  const long long height = m_camera.GetScreenHeight();
+  const long long seedOffset = static_cast<long long>(previous_samples) * m_supersamples * m_supersamples * width * height;
+
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < count; i++) {
+    const int index = activeCount + i;
+    const long long id = firstPathId + i;
+    const int x = static_cast<int>(id % width);
+    const int y = static_cast<int>((id / width) % height);
+    const int sub = static_cast<int>((id / (width * height)) % (m_supersamples * m_supersamples));
+    const int sx = sub % m_supersamples, sy = sub / m_supersamples;
+
+    // (x,y)sNZł̈ʒu: [0,1]
+    const double rx = (2.0*sx + 1.0) / (2 * m_supersamples);
+    const double ry = (2.0*sy + 1.0) / (2 * m_supersamples);
+
+    m_paths.rnd[index] = Random(static_cast<unsigned int>(seedOffset + id + 1));
+    const Ray ray(m_camera.SampleRayForPixel(x + rx, y + ry, m_paths.rnd[index]));
+    m_paths.origin[index] = ray.orig;
+    m_paths.direction[index] = ray.dir;
+    m_paths.throughput[index] = Color(1, 1, 1);
+    m_paths.radiance[index] = Color();
+    m_paths.pixelIndex[index] = static_cast<int>(x + (height - y - 1)*width);
+    m_paths.depth[index] = 0;
+    m_paths.bsdfPdf[index] = 0.0;
+  }
+
+  return count;
+}
+
+void WavefrontPathTracer::ExtendPaths(const Scene &scene, int activeCount) {
+  const int packetCount = (activeCount + Scene::RAY_PACKET_SIZE - 1) / Scene::RAY_PACKET_SIZE;
+
+#pragma omp parallel for schedule(dynamic, 64)
+  for (int p = 0; p < packetCount; p++) {
+    const int first = p * Scene::RAY_PACKET_SIZE;
+    const int rayCount = std::min(Scene::RAY_PACKET_SIZE, activeCount - first);
+
+    Ray rays[Scene::RAY_PACKET_SIZE];
+    for (int i = 0; i < rayCount; i++) {
+      rays[i] = Ray(m_paths.origin[first + i], m_paths.direction[first + i]);
+    }
+    const int intersectedMask = scene.CheckIntersectionPacket(rays, rayCount, &m_paths.intersection[first]);
+    for (int i = 0; i < rayCount; i++) {
+      m_paths.intersected[first + i] = ((intersectedMask >> i) & 1) != 0;
+    }
+  }
+
+  m_checkIntersectionCount += activeCount;
+}
+
+// the paths are shaded in the order of their material type so that the same code runs on consecutive paths
+void WavefrontPathTracer::ShadePaths(const Scene &scene, int activeCount) {
+  int queueBegin[SHADE_QUEUE_COUNT + 1] = { 0 };
+  vector<unsigned char> queueOf(activeCount);
+  for (int i = 0; i < activeCount; i++) {
+    SHADE_QUEUE queue = SHADE_QUEUE_MISS;
+    if (m_paths.intersected[i]) {
+      switch (m_paths.intersection[i].object->GetMaterial().reflection_type) {
+      case Material::REFLECTION_TYPE_LAMBERT: queue = SHADE_QUEUE_LAMBERT; break;
+      case Material::REFLECTION_TYPE_SPECULAR: queue = SHADE_QUEUE_SPECULAR; break;
+      case Material::REFLECTION_TYPE_REFRACTION: queue = SHADE_QUEUE_REFRACTION; break;
+      }
+    }
+    queueOf[i] = static_cast<unsigned char>(queue);
+    queueBegin[queue + 1]++;
+  }
+  for (int q = 0; q < SHADE_QUEUE_COUNT; q++) {
+    queueBegin[q + 1] += queueBegin[q];
+  }
+  for (int i = 0; i < activeCount; i++) {
+    m_shadeOrder[queueBegin[queueOf[i]]++] = i;
+  }
+
+#pragma omp parallel for schedule(dynamic, 256)
+  for (int i = 0; i < activeCount; i++) {
+    Shade_internal(scene, m_shadeOrder[i]);
+  }
+}
+
+void WavefrontPathTracer::Shade_internal(const Scene &scene, int index) {
+  Color &throughput = m_paths.throughput[index];
+  Color &radiance = m_paths.radiance[index];
+  const Vector3 &dir = m_paths.direction[index];
+  const Random &rnd = m_paths.rnd[index];
+  const int depth = m_paths.depth[index];
+
+  m_paths.hasShadowRay[index] = 0;
+  m_paths.alive[index] = 0;
+
+  if (!m_paths.intersected[index]) {
+    if (scene.GetIBL()) {
+      radiance += Multiply(throughput, scene.GetIBL()->Sample(dir));
+    } else {
+      radiance += Multiply(throughput, scene.Background());
+    }
+    return;
+  }
+
+  Scene::IntersectionInformation &intersect = m_paths.intersection[index];
+  const Material &material = intersect.object->GetMaterial();
+  const Vector3 normal = intersect.hit.normal.dot(dir) < 0.0 ? intersect.hit.normal : intersect.hit.normal * -1.0;
+  const Color &textured = intersect.texturedHitpointColor = material.GetTexturedColor(intersect.hit.uv);
+
+  // emission of the hit. a light found by a Lambert bounce is weighted against the light sample taken there (MIS)
+  if (material.emission.lengthSq() != 0) {
+    double weight = 1.0;
+    const LightBase *light = intersect.object->AsLight();
+    if (m_paths.bsdfPdf[index] > 0.0 && light != nullptr) {
+      const double lightPdf = m_lightSampler->Pdf(m_paths.origin[index], m_paths.bsdfNormal[index], light, intersect.hit.position);
+      weight = PowerHeuristic(m_paths.bsdfPdf[index], lightPdf);
+    }
+    radiance += Multiply(throughput, material.emission) * weight;
+  }
+
+  double russian_roulette_probability = std::max(textured.x, std::max(textured.y, textured.z));
+  if (depth > MaxDepth) {
+    russian_roulette_probability *= pow(0.5, depth - MaxDepth);
+  }
+  if (depth > MinDepth) {
+    if (rnd.nextDouble() >= russian_roulette_probability) {
+      return;
+    }
+  } else {
+    russian_roulette_probability = 1.0; // no roulette
+  }
+
+  const Vector3 &position = intersect.hit.position;
+
+  switch (material.reflection_type) {
+  case Material::REFLECTION_TYPE_LAMBERT:
+    {
+      const Color weight = throughput / russian_roulette_probability;
+      if (material.emission.lengthSq() != 0) {
+        // lights do not reflect
+        return;
+      }
+      if (m_performNextEventEstimation) {
+        SampleLight_Lambert(scene, index, normal, weight);
+      }
+
+      Vector3 w, u, v;
+      w = normal;
+      if (fabs(normal.x) > EPS) {
+        u = Vector3(0, 1, 0).cross(w);
+      } else {
+        u = Vector3(1, 0, 0).cross(w);
+      }
+      v = w.cross(u);
+
+      // pdf is cos/PI
+      const double u1 = rnd.nextDouble(); const double u2 = rnd.nextDouble();
+      const double r1 = 2 * PI*u1;
+      const double r2 = sqrt(u2); // cos
+      const double r3 = sqrt(1 - u2); // sin
+      Vector3 next = u*r3*cos(r1) + v*r3*sin(r1) + w*r2;
+      next.normalize();
+
+      throughput = Multiply(weight, textured);
+      m_paths.direction[index] = next;
+      // cosine sampling: pdf = cos/PI
+      m_paths.bsdfPdf[index] = m_performNextEventEstimation ? r2 / PI : 0.0;
+      m_paths.bsdfNormal[index] = normal;
+    }
+    break;
+
+  case Material::REFLECTION_TYPE_SPECULAR:
+    {
+      Vector3 reflected_dir(dir - normal * 2 * dir.dot(normal));
+      reflected_dir.normalize();
+      throughput = Multiply(throughput, textured) / russian_roulette_probability;
+      m_paths.direction[index] = reflected_dir;
+      m_paths.bsdfPdf[index] = 0.0;
+    }
+    break;
+
+  case Material::REFLECTION_TYPE_REFRACTION:
+    {
+      const bool into = intersect.hit.normal.dot(normal) > 0.0;
+
+      Vector3 reflect_dir = dir - normal * 2 * dir.dot(normal);
+      reflect_dir.normalize();
+      const double n_vacuum = REFRACTIVE_INDEX_VACUUM;
+      const double n_obj = material.refraction_rate;
+      const double n_ratio = into ? n_vacuum / n_obj : n_obj / n_vacuum;
+
+      const double dot = dir.dot(normal);
+      const double cos2t = 1 - n_ratio*n_ratio*(1 - dot*dot);
+
+      m_paths.bsdfPdf[index] = 0.0;
+
+      if (cos2t < 0) {
+        // S
+        throughput = Multiply(throughput, material.color) / russian_roulette_probability;
+        m_paths.direction[index] = reflect_dir;
+        break;
+      }
+
+      Vector3 refract_dir(dir*n_ratio - intersect.hit.normal * (into ? 1.0 : -1.0) * (dot*n_ratio + sqrt(cos2t)));
+      refract_dir.normalize();
+
+      // Fresnel ̎
+      const double F0 = (n_obj - n_vacuum)*(n_obj - n_vacuum) / ((n_obj + n_vacuum)*(n_obj + n_vacuum));
+      const double c = 1 - (into ? -dot : -refract_dir.dot(normal));  // 1-cos
+      const double Fr = F0 + (1 - F0)*pow(c, 5.0);    // Fresnel (˂̊)
+      const double Tr = (1 - Fr)*n_ratio*n_ratio;      // ܒとO̊
+
+      // a wavefront path does not split, so either of reflection or refraction is traced at any depth
+      const double reflect_prob = 0.1 + 0.8 * Fr;
+      if (rnd.nextDouble() < reflect_prob) {
+        throughput = Multiply(throughput, textured) * (Fr / (russian_roulette_probability * reflect_prob));
+        m_paths.direction[index] = reflect_dir;
+      } else {
+        throughput = Multiply(throughput, textured) * (Tr / (russian_roulette_probability * (1 - reflect_prob)));
+        m_paths.direction[index] = refract_dir;
+      }
+    }
+    break;
+  }
+
+  m_paths.origin[index] = position;
+  m_paths.depth[index] = depth + 1;
+  m_paths.alive[index] = 1;
+}
+
+// sets up the shadow ray towards a point on a light (the contribution is added if it is not occluded)
+void WavefrontPathTracer::SampleLight_Lambert(const Scene &scene, int index, const Vector3 &normal, const Color &weight) {
+  const Scene::IntersectionInformation &intersect = m_paths.intersection[index];
+  const Random &rnd = m_paths.rnd[index];
+
+  // CgɓĂ疳
+  if (intersect.object->AsLight() != nullptr) {
+    return;
+  }
+
+  if (m_lightSampler->GetLightCount() == 0) {
+    m_paths.radiance[index] += Multiply(weight, scene.Background());
+    return;
+  }
+
+  double lightProbability = 0.0;
+  const LightSampler::Light *selectedLight = m_lightSampler->Sample(intersect.hit.position, normal, rnd.nextDouble(), lightProbability);
+  if (selectedLight == nullptr) {
+    return;
+  }
+
+  Vector3 point, light_normal; double pdf = 0.0;
+  if (!selectedLight->light->SampleOnePointWithTargetPoint(point, light_normal, pdf, intersect.hit.position, rnd)) {
+    return;
+  }
+
+  Vector3 dir((point - intersect.hit.position)); dir.normalize();
+  const double cos_shita = dir.dot(normal);
+  const double light_cos_shita = -dir.dot(light_normal);
+  if (cos_shita < 0 || light_cos_shita < 0) {
+    return;
+  }
+
+  // the shadow ray tests the segment up to the light surface
+  const SceneObject *lightObject = selectedLight->object;
+  HitInformation lightHit;
+  if (lightObject == nullptr || !lightObject->CheckIntersection(Ray(intersect.hit.position, dir), lightHit)) {
+    return;
+  }
+
+  // BRDF = color/PI
+  const double G = cos_shita * light_cos_shita / (lightHit.distance * lightHit.distance);
+  // MIS weight against the Lambert sampling hitting the same point (pdf = cos/PI)
+  const double lightPdf = lightProbability * selectedLight->light->PdfWithTargetPoint(lightHit.position, intersect.hit.position);
+  const double misWeight = PowerHeuristic(lightPdf, cos_shita / PI);
+  const Color reflect_rate(intersect.texturedHitpointColor / PI * G * misWeight / (pdf * lightProbability));
+
+  m_paths.hasShadowRay[index] = 1;
+  m_paths.shadowDirection[index] = dir;
+  m_paths.shadowDistance[index] = lightHit.distance - EPS;
+  m_paths.shadowContribution[index] = Multiply(weight, Multiply(reflect_rate, lightObject->GetMaterial().emission));
+}
+
+void WavefrontPathTracer::TraceShadowRays(const Scene &scene, int activeCount) {
+  int shadowRayCount = 0;
+  for (int i = 0; i < activeCount; i++) {
+    if (m_paths.hasShadowRay[i]) {
+      m_shadowRays[shadowRayCount++] = i;
+    }
+  }
+
+#pragma omp parallel for schedule(dynamic, 256)
+  for (int i = 0; i < shadowRayCount; i++) {
+    const int index = m_shadowRays[i];
+    const Ray shadowRay(m_paths.intersection[index].hit.position, m_paths.shadowDirection[index]);
+    if (!scene.IsOccluded(shadowRay, m_paths.shadowDistance[index])) {
+      m_paths.radiance[index] += m_paths.shadowContribution[index];
+    }
+  }
+
+  m_checkIntersectionCount += shadowRayCount;
+}
+
+int WavefrontPathTracer::CompactPaths(int activeCount) {
+  int aliveCount = 0;
+  for (int i = 0; i < activeCount; i++) {
+    if (m_paths.alive[i]) {
+      if (aliveCount != i) {
+        m_paths.Move(i, aliveCount);
+      }
+      aliveCount++;
+    } else {
+      m_accumulatedRadiance[m_paths.pixelIndex[i]] += m_paths.radiance[i];
+      m_finishedPathCount++;
+    }
+  }
+  return aliveCount;
+}
+
+// ʕ\p̏擾\bh
+std::string WavefrontPathTracer::GetCurrentRenderingInfo() const {
+
+  stringstream ss;
+  ss << "(width, height) = (" << m_camera.GetScreenWidth() << ", " << m_camera.GetScreenHeight() << ")" << endl;
+  ss << "previous samples / pixel = " << m_previous_samples << "x(" << m_supersamples << "x" << m_supersamples << ")" << endl;
+  ss << "current rendering samples / pixel = " << (m_previous_samples + m_step_samples) << "x(" << m_supersamples << "x" << m_supersamples << ")" << endl;
+  ss << "wavefront: " << WAVEFRONT_SIZE << " paths in flight" << endl;
+  if (m_pathCountInIteration != 0) {
+    ss << m_finishedPathCount*100.0 / m_pathCountInIteration << "% finished." << endl;
+  }
+
+  return ss.str();
+}
+
+}
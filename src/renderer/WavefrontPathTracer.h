@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vector>
+
+#include "Renderer.h"
+#include "Color.h"
+#include "scenes/Scene.h"
+#include "Camera.h"
+#include "tools/Random.h"
+
+namespace OmochiRenderer {
+
+class Scene;
+
+// breadth-first ("wavefront") path tracer.
+// instead of tracing each path recursively to its end, a large batch of paths is kept in flight and
+// advanced one bounce at a time in separate stages:
+//   generate: fill the free slots with new camera paths
+//   extend:   intersect all the path rays (4-ray packets)
+//   shade:    paths sorted by material, evaluate the BSDF / russian roulette and set up the next ray and the shadow ray
+//   shadow:   occlusion test of all the shadow rays
+// each stage is a flat loop over the path state, which keeps the code per loop small and the memory access coherent.
+// the estimator is the same as PathTracer's.
+class WavefrontPathTracer : public Renderer {
+public:
+  // number of paths in flight
+  static const int WAVEFRONT_SIZE = 128 * 1024;
+
+public:
+  WavefrontPathTracer(const Camera &camera, int samples, int supersamples);
+  WavefrontPathTracer(const Camera &camera, int min_samples, int max_samples, int step, int supersamples, RenderingFinishCallbackFunction callback);
+  virtual ~WavefrontPathTracer();
+
+  // Next Event Estimation ̗L/̐؂ւ
+  void EnableNextEventEstimation(bool enable = true) {
+    m_performNextEventEstimation = enable;
+  }
+
+  virtual void RenderScene(const Scene &scene);
+
+  virtual const Color *GetResult() const { return &m_result[0]; }
+  virtual const int GetCurrentSampleCount() const { return m_currentSamples; }
+
+  virtual std::string GetCurrentRenderingInfo() const;
+
+private:
+  // path state in SoA layout. index i of every array belongs to the same path
+  struct PathStates {
+    std::vector<Vector3> origin;
+    std::vector<Vector3> direction;
+    std::vector<Color> throughput;
+    std::vector<Color> radiance;
+    std::vector<int> pixelIndex;
+    std::vector<int> depth;
+    // solid angle pdf of direction, sampled by a Lambert bounce at origin where a light was also sampled (MIS).
+    // 0 if the lights were not sampled there: the emission of the next hit counts fully
+    std::vector<double> bsdfPdf;
+    std::vector<Vector3> bsdfNormal;
+    std::vector<Random> rnd;
+    // written by extend
+    std::vector<Scene::IntersectionInformation> intersection;
+    std::vector<char> intersected;
+    // written by shade
+    std::vector<char> alive;
+    std::vector<char> hasShadowRay;
+    std::vector<Vector3> shadowDirection;
+    std::vector<double> shadowDistance;
+    std::vector<Color> shadowContribution;
+
+    void Resize(size_t size);
+    // copies the state carried to the next bounce
+    void Move(size_t from, size_t to);
+  };
+
+  enum SHADE_QUEUE {
+    SHADE_QUEUE_MISS,
+    SHADE_QUEUE_LAMBERT,
+    SHADE_QUEUE_SPECULAR,
+    SHADE_QUEUE_REFRACTION,
+    SHADE_QUEUE_COUNT
+  };
+
+  void init(const Camera &camera, int min_samples, int max_samples, int step, int supersamples,
+    RenderingFinishCallbackFunction callbackOnOneIterationEnded);
+
+  // renders (next_samples - previous_samples) samples per pixel.
+  // returns false if the rendering is stopped before all the paths finish (m_result is not changed then)
+  bool TracePaths(const Scene &scene, int previous_samples, int next_samples);
+
+  // stages. each of them processes the paths [0, activeCount)
+  int GeneratePaths(int activeCount, long long firstPathId, long long pathCount, int previous_samples);
+  void ExtendPaths(const Scene &scene, int activeCount);
+  void ShadePaths(const Scene &scene, int activeCount);
+  void TraceShadowRays(const Scene &scene, int activeCount);
+  // removes the finished paths, accumulating their radiance. returns the new active count
+  int CompactPaths(int activeCount);
+
+  void Shade_internal(const Scene &scene, int index);
+  void SampleLight_Lambert(const Scene &scene, int index, const Vector3 &normal, const Color &weight);
+
+private:
+  Camera m_camera;
+  int m_currentSamples;
+  int m_min_samples, m_max_samples, m_step_samples;
+  int m_supersamples;
+  int m_previous_samples;
+  RenderingFinishCallbackFunction m_renderFinishCallback;
+
+  PathStates m_paths;
+  std::vector<int> m_shadeOrder;
+  std::vector<int> m_shadowRays;
+  std::vector<Color> m_accumulatedRadiance;
+
+  const LightSampler *m_lightSampler;   // of the scene being rendered
+
+  long long m_checkIntersectionCount;
+  long long m_finishedPathCount;
+  long long m_pathCountInIteration;
+
+  std::vector<Color> m_result;
+
+  bool m_performNextEventEstimation = false;
+};
+
+}
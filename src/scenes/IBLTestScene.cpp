@@ -33,7 +33,7 @@ namespace OmochiRenderer {
     //AddObject(new Sphere(16.5, Vector3(27, 42, 197), Material(Material::REFLECTION_TYPE_SPECULAR, Color(), Color(0.99, 0.99, 0.99))));   // 
     //AddObject(new Sphere(16.5, Vector3(127, 42, 172), Material(Material::REFLECTION_TYPE_REFRACTION, Color(), Color(0.99, 0.99, 0.99), REFRACTIVE_INDEX_OBJECT))); // KX
 
-    Model *cube = new Model;
+    Model *cube = NewModel();
     if (!cube->ReadFromObj("input_data/table/Table and Glasses.obj", true)) {
       std::cerr << "failed to load cube.obj!!!" << std::endl;
       getchar();
@@ -43,7 +43,7 @@ namespace OmochiRenderer {
     cube->Transform(Vector3(85, -10, 172), Vector3(160, 160, 160), Matrix::RotateAroundVector(Vector3(0, 1, 0), 15.0 / 180 * PI));
     AddModel(cube);
 
-    cube = new Model;
+    cube = NewModel();
     if (!cube->ReadFromObj("input_data/Revolver/Revolver.obj", true)) {
       std::cerr << "failed to load Revolver.obj!!!" << std::endl;
       getchar();
@@ -53,7 +53,7 @@ namespace OmochiRenderer {
     cube->Transform(Vector3(85, 30, 142), Vector3(140, 140, 140), Matrix::RotateAroundVector(Vector3(0, 1, 0), 15.0 / 180 * PI) * Matrix::RotateAroundVector(Vector3(0, 0, 1), -90.0 / 180 * PI));
     AddModel(cube);
 
-    cube = new Model;
+    cube = NewModel();
     if (!cube->ReadFromObj("input_data/bullet/bullet.obj", true)) {
       std::cerr << "failed to load bullet.obj!!!" << std::endl;
       getchar();
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "renderer/HitInformation.h"
+#include "renderer/Color.h"
+
+namespace OmochiRenderer {
+
+class SceneObject;
+
+// result of the intersection test against a scene (also available as Scene::IntersectionInformation)
+struct SceneIntersectionInformation {
+  HitInformation hit;
+  SceneObject *object;
+  Color texturedHitpointColor;
+};
+
+}
@@ -3,51 +3,98 @@
 #include "Scene.h"
 #include "renderer/BVH.h"
 #include "renderer/QBVH.h"
+#include "renderer/OBVH.h"
+#include "renderer/PolygonLight.h"
 
 namespace OmochiRenderer {
 
+// the objects and the models are freed with m_arena
 Scene::~Scene() {
-  for (size_t i=0; i<m_objects.size(); i++) {
-    SceneObjectInfo &info = m_objects.at(i);
-    if (info.doDelete) {
-      delete info.object;
-    }
-  }
-  for (size_t i=0; i<m_models.size(); i++) {
-    ModelObjectInfo &info = m_models.at(i);
-    if (info.doDelete) {
-      delete info.model;
-    }
-  }
   delete m_bvh;
   delete m_qbvh;
+  delete m_obvh;
 }
 
-void Scene::ConstructBVH()
+void Scene::ConstructBVH(const BVH::CONSTRUCTION_TYPE type)
 {
   if (m_bvh) delete m_bvh;
 
   m_bvh = new BVH();
-  m_bvh->Construct(BVH::CONSTRUCTION_OBJECT_SAH, m_inBVHObjects);
+  m_bvh->Construct(type, m_inBVHObjects);
   //m_bvh->Construct(BVH::CONSTRUCTION_OBJECT_MEDIAN, m_inBVHObjects);
 }
 
-void Scene::ConstructQBVH()
+void Scene::ConstructQBVH(const BVH::CONSTRUCTION_TYPE bvhConstructionType, const std::string &cacheFile)
 {
   if (m_qbvh) delete m_qbvh;
 
   m_qbvh = new QBVH();
-  if (!m_qbvh->Construct(m_inBVHObjects))
+
+  unsigned long long cacheKey = 0;
+  if (!cacheFile.empty()) {
+    std::vector<std::string> sourceFiles;
+    for (size_t i=0; i<m_models.size(); i++) {
+      const std::vector<std::string> &files = m_models[i]->GetSourceFiles();
+      sourceFiles.insert(sourceFiles.end(), files.begin(), files.end());
+    }
+    cacheKey = QBVH::CalcCacheKey(m_inBVHObjects, bvhConstructionType, sourceFiles);
+    if (m_qbvh->LoadFromFile(cacheFile, cacheKey, m_inBVHObjects)) {
+      std::cerr << "QBVH is loaded from " << cacheFile << std::endl;
+      return;
+    }
+  }
+
+  if (!m_qbvh->Construct(m_inBVHObjects, bvhConstructionType))
   {
     delete m_qbvh; m_qbvh = nullptr;
+    return;
+  }
+
+  if (!cacheFile.empty() && !m_qbvh->SaveToFile(cacheFile, cacheKey, m_inBVHObjects)) {
+    std::cerr << "failed to save QBVH to " << cacheFile << std::endl;
   }
 }
 
+void Scene::ConstructOBVH(const BVH::CONSTRUCTION_TYPE bvhConstructionType, const std::string &qbvhCacheFile)
+{
+  if (!OBVH::IsSupported()) {
+    std::cerr << "AVX is not available. QBVH is used instead of OBVH" << std::endl;
+    ConstructQBVH(bvhConstructionType, qbvhCacheFile);
+    return;
+  }
+
+  if (m_obvh) delete m_obvh;
+
+  m_obvh = new OBVH();
+  if (!m_obvh->Construct(m_inBVHObjects, bvhConstructionType))
+  {
+    delete m_obvh; m_obvh = nullptr;
+  }
+}
+
+void Scene::ConstructLightSampler(LightSampler::SAMPLING_TYPE type)
+{
+  std::lock_guard<std::mutex> lock(m_lightSamplerMutex);
+  m_lightSamplingType = type;
+  m_lightSampler.reset(new LightSampler(m_lights, type));
+}
+
+const LightSampler &Scene::GetLightSampler() const
+{
+  std::lock_guard<std::mutex> lock(m_lightSamplerMutex);
+  if (!m_lightSampler) {
+    m_lightSampler.reset(new LightSampler(m_lights, m_lightSamplingType));
+  }
+  return *m_lightSampler;
+}
+
 bool Scene::CheckIntersection(const Ray &ray, IntersectionInformation &info) const {
   info.hit.distance = INF;
   info.object = NULL;
 
-  if (m_qbvh) {
+  if (m_obvh) {
+    m_obvh->CheckIntersection(ray, info);
+  } else if (m_qbvh) {
     m_qbvh->CheckIntersection(ray, info);
   } else if (m_bvh) {
     m_bvh->CheckIntersection(ray, info);
@@ -79,88 +126,150 @@ bool Scene::CheckIntersection(const Ray &ray, IntersectionInformation &info) con
   return info.hit.distance != INF;
 }
 
+int Scene::CheckIntersectionPacket(const Ray rays[RAY_PACKET_SIZE], int rayCount, IntersectionInformation infos[RAY_PACKET_SIZE]) const {
+  static_assert(RAY_PACKET_SIZE == QBVH::PACKET_SIZE, "the packet size of Scene must be the same as QBVH");
+  assert (0 <= rayCount && rayCount <= RAY_PACKET_SIZE);
+
+  int intersectedMask = 0;
+  if (m_qbvh != NULL && m_obvh == NULL) {
+    for (int i=0; i<rayCount; i++) {
+      infos[i].hit.distance = INF;
+      infos[i].object = NULL;
+    }
+    m_qbvh->CheckIntersectionPacket(rays, (1 << rayCount) - 1, infos);
+
+    for (int i=0; i<rayCount; i++) {
+      std::vector<SceneObject *>::const_iterator it,end = m_notInBVHObjects.end();
+      for (it = m_notInBVHObjects.begin(); it!=end; it++) {
+        SceneObject *obj = *it;
+        HitInformation hit;
+        if (obj->CheckIntersection(rays[i], hit)) {
+          if (infos[i].hit.distance > hit.distance) {
+            infos[i].hit = hit;
+            infos[i].object = obj;
+          }
+        }
+      }
+      if (infos[i].hit.distance != INF) intersectedMask |= (1 << i);
+    }
+  } else {
+    // no packet traversal for the others
+    for (int i=0; i<rayCount; i++) {
+      if (CheckIntersection(rays[i], infos[i])) intersectedMask |= (1 << i);
+    }
+  }
+  return intersectedMask;
+}
+
+bool Scene::IsOccluded(const Ray &ray, double maxDistance) const {
+  if (m_obvh) {
+    if (m_obvh->Occluded(ray, maxDistance)) return true;
+  } else if (m_qbvh) {
+    if (m_qbvh->Occluded(ray, maxDistance)) return true;
+  } else if (m_bvh) {
+    if (m_bvh->Occluded(ray, maxDistance)) return true;
+  } else {
+    std::vector<SceneObject *>::const_iterator it,end = m_inBVHObjects.end();
+    for (it = m_inBVHObjects.begin(); it!=end; it++) {
+      if ((*it)->CheckOcclusion(ray, maxDistance)) return true;
+    }
+  }
+
+  std::vector<SceneObject *>::const_iterator it,end = m_notInBVHObjects.end();
+  for (it = m_notInBVHObjects.begin(); it!=end; it++) {
+    if ((*it)->CheckOcclusion(ray, maxDistance)) return true;
+  }
+  return false;
+}
+
 
 void Scene::AddFloorXZ_yUp(const double size_x, const double size_z, const Vector3 &position, const Material &material) {
-  AddObject(new Polygon(
+  const MaterialTable::MATERIAL_ID materialId = MaterialTable::GetInstance().Register(material);
+  AddObject(PolygonLight::Create(m_arena,
     Vector3(-size_x / 2, 0, -size_z / 2), Vector3(-size_x / 2, 0, size_z / 2), Vector3(size_x / 2, 0, -size_z/2),
     Vector3(0, 0, 0), Vector3(0, 1, 0), Vector3(1, 0, 0),
     Vector3(0, 1, 0), Vector3(0, 1, 0), Vector3(0, 1, 0),
-    material, position));
-  AddObject(new Polygon(
+    materialId, position));
+  AddObject(PolygonLight::Create(m_arena,
     Vector3(size_x / 2, 0, -size_z / 2), Vector3(-size_x / 2, 0, size_z / 2), Vector3(size_x / 2, 0, size_z/2),
     Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(1, 1, 0),
     Vector3(0, 1, 0), Vector3(0, 1, 0), Vector3(0, 1, 0),
-    material, position));
+    materialId, position));
 }
 
 // XYʏɁAzUPŏǉ
 void Scene::AddFloorXY_zUp(const double size_x, const double size_y, const Vector3 &position, const Material &material) {
-  AddObject(new Polygon(
+  const MaterialTable::MATERIAL_ID materialId = MaterialTable::GetInstance().Register(material);
+  AddObject(PolygonLight::Create(m_arena,
     Vector3(-size_x / 2, size_y / 2, 0), Vector3(-size_x / 2, -size_y / 2, 0), Vector3(size_x / 2, -size_y / 2, 0),
     Vector3(0, 0, 0), Vector3(0, 1, 0), Vector3(1, 1, 0),
     Vector3(0, 0, 1), Vector3(0, 0, 1), Vector3(0, 0, 1),
-    material, position));
-  AddObject(new Polygon(
+    materialId, position));
+  AddObject(PolygonLight::Create(m_arena,
     Vector3(size_x / 2, size_y / 2, 0), Vector3(-size_x / 2, size_y / 2, 0), Vector3(size_x / 2, -size_y / 2, 0),
     Vector3(1, 0, 0), Vector3(0, 0, 0), Vector3(1, 1, 0),
     Vector3(0, 0, 1), Vector3(0, 0, 1), Vector3(0, 0, 1),
-    material, position));
+    materialId, position));
 }
 
 // YZʏɁAxUPŏǉ
 void Scene::AddFloorYZ_xUp(const double size_y, const double size_z, const Vector3 &position, const Material &material) {
-  AddObject(new Polygon(
+  const MaterialTable::MATERIAL_ID materialId = MaterialTable::GetInstance().Register(material);
+  AddObject(PolygonLight::Create(m_arena,
     Vector3(0, size_y / 2, -size_z / 2), Vector3(0, size_y / 2, size_z / 2), Vector3(0, -size_y / 2, size_z / 2),
     Vector3(1, 0, 0), Vector3(0, 0, 0), Vector3(0, 1, 0),
     Vector3(1, 0, 0), Vector3(1, 0, 0), Vector3(1, 0, 0),
-    material, position));
-  AddObject(new Polygon(
+    materialId, position));
+  AddObject(PolygonLight::Create(m_arena,
     Vector3(0, -size_y / 2, -size_z / 2), Vector3(0, size_y / 2, -size_z / 2), Vector3(0, -size_y / 2, size_z / 2),
     Vector3(1, 1, 0), Vector3(1, 0, 0), Vector3(0, 1, 0),
     Vector3(1, 0, 0), Vector3(1, 0, 0), Vector3(1, 0, 0),
-    material, position));
+    materialId, position));
 }
 
 // XZʏɁAyDownŏǉ
 void Scene::AddFloorXZ_yDown(const double size_x, const double size_z, const Vector3 &position, const Material &material) {
-  AddObject(new Polygon(
+  const MaterialTable::MATERIAL_ID materialId = MaterialTable::GetInstance().Register(material);
+  AddObject(PolygonLight::Create(m_arena,
     Vector3(size_x / 2, 0, -size_z / 2), Vector3(-size_x / 2, 0, size_z / 2), Vector3(-size_x / 2, 0, -size_z / 2),
     Vector3(1, 1, 0), Vector3(0, 0, 0), Vector3(0, 1, 0),
     Vector3(0, -1, 0), Vector3(0, -1, 0), Vector3(0, -1, 0),
-    material, position));
-  AddObject(new Polygon(
+    materialId, position));
+  AddObject(PolygonLight::Create(m_arena,
     Vector3(size_x / 2, 0, size_z / 2), Vector3(-size_x / 2, 0, size_z / 2), Vector3(size_x / 2, 0, -size_z / 2),
     Vector3(1, 0, 0), Vector3(0, 0, 0), Vector3(1, 1, 0),
     Vector3(0, -1, 0), Vector3(0, -1, 0), Vector3(0, -1, 0),
-    material, position));
+    materialId, position));
 }
 
 // XYʏɁAzDownŏǉ
 void Scene::AddFloorXY_zDown(const double size_x, const double size_y, const Vector3 &position, const Material &material) {
-  AddObject(new Polygon(
+  const MaterialTable::MATERIAL_ID materialId = MaterialTable::GetInstance().Register(material);
+  AddObject(PolygonLight::Create(m_arena,
     Vector3(size_x / 2, -size_y / 2, 0), Vector3(-size_x / 2, -size_y / 2, 0), Vector3(-size_x / 2, size_y / 2, 0),
     Vector3(0, 1, 0), Vector3(1, 1, 0), Vector3(1, 0, 0),
     Vector3(0, 0, -1), Vector3(0, 0, -1), Vector3(0, 0, -1),
-    material, position));
-  AddObject(new Polygon(
+    materialId, position));
+  AddObject(PolygonLight::Create(m_arena,
     Vector3(size_x / 2, -size_y / 2, 0), Vector3(-size_x / 2, size_y / 2, 0), Vector3(size_x / 2, size_y / 2, 0),
     Vector3(0, 1, 0), Vector3(1, 0, 0), Vector3(0, 0, 0),
     Vector3(0, 0, -1), Vector3(0, 0, -1), Vector3(0, 0, -1),
-    material, position));
+    materialId, position));
 }
 
 // YZʏɁAxDownŏǉ
 void Scene::AddFloorYZ_xDown(const double size_y, const double size_z, const Vector3 &position, const Material &material) {
-  AddObject(new Polygon(
+  const MaterialTable::MATERIAL_ID materialId = MaterialTable::GetInstance().Register(material);
+  AddObject(PolygonLight::Create(m_arena,
     Vector3(0, -size_y / 2, size_z / 2), Vector3(0, size_y / 2, size_z / 2), Vector3(0, size_y / 2, -size_z / 2),
     Vector3(1, 1, 0), Vector3(1, 0, 0), Vector3(0, 0, 0),
     Vector3(-1, 0, 0), Vector3(-1, 0, 0), Vector3(-1, 0, 0),
-    material, position));
-  AddObject(new Polygon(
+    materialId, position));
+  AddObject(PolygonLight::Create(m_arena,
     Vector3(0, -size_y / 2, size_z / 2), Vector3(0, size_y / 2, -size_z / 2), Vector3(0, -size_y / 2, -size_z / 2),
     Vector3(1, 1, 0), Vector3(0, 0, 0), Vector3(0, 1, 0),
     Vector3(-1, 0, 0), Vector3(-1, 0, 0), Vector3(-1, 0, 0),
-    material, position));
+    materialId, position));
 }
 
 }
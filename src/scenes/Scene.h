@@ -1,5 +1,8 @@
 #pragma once
 #include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
 #include "renderer/Ray.h"
 #include "renderer/HitInformation.h"
 #include "renderer/SceneObject.h"
@@ -7,46 +10,74 @@
 #include "tools/Constant.h"
 #include "renderer/IBL.h"
 #include "renderer/LightBase.h"
+#include "renderer/BVH.h"
+#include "renderer/LightSampler.h"
+#include "tools/Arena.h"
+#include "IntersectionInformation.h"
 
 namespace OmochiRenderer {
 
 class SceneObject;
 class BVH;
 class QBVH;
+class OBVH;
 class IBL;
 
 class Scene {
 public:
-  struct IntersectionInformation {
-    HitInformation hit;
-    SceneObject *object;
-    Color texturedHitpointColor;
-  };
+  typedef SceneIntersectionInformation IntersectionInformation;
 
 public:
   virtual ~Scene();
 
-  void ConstructBVH();
-  void ConstructQBVH();
+  void ConstructBVH(const BVH::CONSTRUCTION_TYPE type = BVH::CONSTRUCTION_OBJECT_SAH);
+  // cacheFile: if not empty, the QBVH is loaded from this file when it matches the scene, otherwise constructed and saved to it
+  void ConstructQBVH(const BVH::CONSTRUCTION_TYPE bvhConstructionType = BVH::CONSTRUCTION_OBJECT_SAH, const std::string &cacheFile = std::string());
+  // falls back to ConstructQBVH if AVX is not available
+  void ConstructOBVH(const BVH::CONSTRUCTION_TYPE bvhConstructionType = BVH::CONSTRUCTION_OBJECT_SAH, const std::string &qbvhCacheFile = std::string());
 
   // V[̃IuWFNgɑ΂Čs
   bool CheckIntersection(const Ray &ray, IntersectionInformation &info) const;
+  // true if anything is hit closer than maxDistance. faster than CheckIntersection for shadow rays (no hit information, first hit terminates)
+  bool IsOccluded(const Ray &ray, double maxDistance) const;
+  // intersects rayCount (up to RAY_PACKET_SIZE) coherent rays, e.g. camera rays of neighbouring pixels, at once.
+  // returns the bit mask of the intersected rays
+  static const int RAY_PACKET_SIZE = 4;
+  int CheckIntersectionPacket(const Ray rays[RAY_PACKET_SIZE], int rayCount, IntersectionInformation infos[RAY_PACKET_SIZE]) const;
 
   // CgXg擾
-  const std::vector<LightBase *> GetLights() const { return m_lights; }
+  const std::vector<LightBase *> &GetLights() const { return m_lights; }
+
+  // (re)builds the light sampler for next event estimation. call after all the objects are added
+  void ConstructLightSampler(LightSampler::SAMPLING_TYPE type = LightSampler::SAMPLING_POWER);
+  // the light sampler built by ConstructLightSampler. if there is none, one with the last sampling type is built on the first call
+  const LightSampler &GetLightSampler() const;
 
   // wi擾
   const IBL *GetIBL() const { return m_ibl.get(); }
+  void SetIBLLookupType(IBL::LOOKUP_TYPE type) { if (m_ibl.get()) m_ibl->SetLookupType(type); }
   virtual Color Background() const { return Color(0,0,0);  }
 
   virtual bool IsValid() const { return true; }
 
 protected:
-  Scene() : m_objects(), m_models(), m_inBVHObjects(), m_notInBVHObjects(), m_lights(), m_bvh(NULL), m_qbvh(NULL), m_ibl(NULL) {}
+  Scene() : m_arena(), m_objects(), m_models(), m_inBVHObjects(), m_notInBVHObjects(), m_lights(), m_bvh(NULL), m_qbvh(NULL), m_obvh(NULL), m_ibl(NULL)
+    , m_lightSamplingType(LightSampler::SAMPLING_POWER), m_lightSampler(), m_lightSamplerMutex() {}
+
+  // allocates an object (e.g. NewObject<Sphere>(radius, position, material)) in the arena of the scene,
+  // which frees all of them at once when the scene is destroyed
+  template <typename T, typename... Args>
+  T *NewObject(Args&&... args) {
+    return m_arena.New<T>(std::forward<Args>(args)...);
+  }
+  // a model whose polygons and meshes are also allocated in the arena of the scene
+  Model *NewModel() {
+    return m_arena.New<Model>(m_arena);
+  }
 
-  // V[փIuWFNgǉ
-  void AddObject(SceneObject *obj, bool doDelete = true, bool containedInBVH = true) {
-    m_objects.push_back(SceneObjectInfo(obj, doDelete, containedInBVH));
+  // V[փIuWFNgǉ. obj is allocated by NewObject
+  void AddObject(SceneObject *obj, bool containedInBVH = true) {
+    m_objects.push_back(SceneObjectInfo(obj, containedInBVH));
     if (containedInBVH) {
       m_inBVHObjects.push_back(obj);
     } else {
@@ -54,7 +85,10 @@ protected:
     }
 
     if (dynamic_cast<LightBase *>(obj) != NULL) {
-      m_lights.push_back(dynamic_cast<LightBase *>(obj));
+      LightBase *light = dynamic_cast<LightBase *>(obj);
+      light->SetLightIndex(static_cast<int>(m_lights.size()));
+      m_lights.push_back(light);
+      m_lightSampler.reset();
     }
   }
 
@@ -72,49 +106,50 @@ protected:
   // YZʏɁAxDownŏǉ
   void AddFloorYZ_xDown(const double size_y, const double size_z, const Vector3 &position, const Material &material);
 
-  // ǂݍ񂾃fǉ
-  void AddModel(Model *obj, bool doDelete = true, bool containedInBVH = true) {
-    m_models.push_back(ModelObjectInfo(obj, doDelete));
+  // ǂݍ񂾃fǉ. obj is allocated by NewModel
+  void AddModel(Model *obj, bool containedInBVH = true) {
+    m_models.push_back(obj);
 
     for (size_t i=0; i<obj->GetMaterialCount(); i++) {
-      const Material &mat = obj->GetMaterial(i);
-      const Model::PolygonList &pl = obj->GetPolygonList(mat);
+      const MaterialTable::MATERIAL_ID materialId = obj->GetMaterialID(i);
+      const Model::PolygonList &pl = obj->GetPolygonList(materialId);
       for (size_t j=0; j<pl.size(); j++) {
-        AddObject(pl[j], false, containedInBVH);
+        AddObject(pl[j], containedInBVH);
+      }
+      if (TriangleMesh *mesh = obj->GetTriangleMesh(materialId)) {
+        for (size_t j=0; j<mesh->GetTriangleCount(); j++) {
+          AddObject(mesh->GetTriangle(j), containedInBVH);
+        }
       }
     }
   }
 
   struct SceneObjectInfo {
-    SceneObjectInfo(SceneObject *obj, bool doDelete_, bool inBVH_)
+    SceneObjectInfo(SceneObject *obj, bool inBVH_)
       : object(obj)
-      , doDelete(doDelete_)
       , inBVH(inBVH_)
     {
     }
     SceneObject *object;
-    bool doDelete;
     bool inBVH;
   };
-  struct ModelObjectInfo {
-    ModelObjectInfo(Model *model_, bool doDelete_)
-      : model(model_)
-      , doDelete(doDelete_)
-    {
-    }
-    Model *model;
-    bool doDelete;
-  };
+  // owns the objects and the models. declared first, so that it is destroyed after everything referring to them
+  Arena m_arena;
   std::vector<SceneObject *> m_inBVHObjects;
   std::vector<SceneObject *> m_notInBVHObjects;
   std::vector<LightBase *> m_lights;
   std::vector<SceneObjectInfo> m_objects;
-  std::vector<ModelObjectInfo> m_models;
+  std::vector<Model *> m_models;
 
   BVH *m_bvh;
   QBVH *m_qbvh;
+  OBVH *m_obvh;
   std::auto_ptr<IBL> m_ibl;
 
+  LightSampler::SAMPLING_TYPE m_lightSamplingType;
+  mutable std::unique_ptr<LightSampler> m_lightSampler;
+  mutable std::mutex m_lightSamplerMutex;
+
 private:
   Scene(const Scene &s) {}
   Scene &operator =(const Scene &s) {return *this;}
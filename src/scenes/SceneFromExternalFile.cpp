@@ -47,13 +47,31 @@ namespace OmochiRenderer {
     , m_baseDir()
     , m_iblFileName()
     , m_spacePartitioningMethod()
+    , m_useQBVHCache(true)
   {
     m_isValid = ReadFromFile(file);
 
+    // QBVH is cached next to the scene file
+    const string qbvhCacheFile(m_useQBVHCache ? file + ".qbvhcache" : "");
+
     if (m_spacePartitioningMethod == "BVH") {
-      ConstructBVH();
+      ConstructBVH(BVH::CONSTRUCTION_BINNED_SAH);
     } else if (m_spacePartitioningMethod == "QBVH") {
-      ConstructQBVH();
+      ConstructQBVH(BVH::CONSTRUCTION_BINNED_SAH, qbvhCacheFile);
+    } else if (m_spacePartitioningMethod == "SBVH") {
+      ConstructBVH(BVH::CONSTRUCTION_SBVH);
+    } else if (m_spacePartitioningMethod == "SBVH+QBVH") {
+      ConstructQBVH(BVH::CONSTRUCTION_SBVH, qbvhCacheFile);
+    } else if (m_spacePartitioningMethod == "LBVH") {
+      ConstructBVH(BVH::CONSTRUCTION_LBVH);
+    } else if (m_spacePartitioningMethod == "LBVH+QBVH") {
+      ConstructQBVH(BVH::CONSTRUCTION_LBVH, qbvhCacheFile);
+    } else if (m_spacePartitioningMethod == "OBVH") {
+      ConstructOBVH(BVH::CONSTRUCTION_BINNED_SAH, qbvhCacheFile);
+    } else if (m_spacePartitioningMethod == "SBVH+OBVH") {
+      ConstructOBVH(BVH::CONSTRUCTION_SBVH, qbvhCacheFile);
+    } else if (m_spacePartitioningMethod == "LBVH+OBVH") {
+      ConstructOBVH(BVH::CONSTRUCTION_LBVH, qbvhCacheFile);
     }
   }
   
@@ -181,6 +199,7 @@ namespace OmochiRenderer {
     // Construct BVH/QBVH
 
     m_iblFileName = m_spacePartitioningMethod = "";
+    m_useQBVHCache = true;
 
     std::vector<LinePair>::const_iterator it, end = lines.end();
     for (it = lines.begin(); it != end; ++it) {
@@ -195,6 +214,8 @@ namespace OmochiRenderer {
         m_ibl.reset(new IBL(m_iblFileName));
       } else if (it->first == "Space Partitioning") {
         m_spacePartitioningMethod = it->second;
+      } else if (it->first == "QBVH Cache") {
+        m_useQBVHCache = (it->second != "False");
       }
       else {
         cerr << "undefined header information: " << it->first << endl;
@@ -288,9 +309,9 @@ namespace OmochiRenderer {
     if (!valid) return false;
 
     if (isLight) {
-      AddObject(new SphereLight(radius, position, newMat), true, inSpacePartitioning);
+      AddObject(NewObject<SphereLight>(radius, position, newMat), inSpacePartitioning);
     } else {
-      AddObject(new Sphere(radius, position, newMat), true, inSpacePartitioning);
+      AddObject(NewObject<Sphere>(radius, position, newMat), inSpacePartitioning);
     }
     return true;
   }
@@ -402,7 +423,7 @@ namespace OmochiRenderer {
 
     if (!valid) return false;
 
-    Model *newModel = new Model;
+    Model *newModel = NewModel();
     if (!newModel->ReadFromObj(fileName))
     {
       return false;
@@ -411,7 +432,7 @@ namespace OmochiRenderer {
       Matrix::RotateAroundVector(Vector3(0, 0, 1), rotation.z) * 
       Matrix::RotateAroundVector(Vector3(0, 1, 0), rotation.y) *
       Matrix::RotateAroundVector(Vector3(1, 0, 0), rotation.x) );
-    AddModel(newModel, true, inSpacePartitioning);
+    AddModel(newModel, inSpacePartitioning);
 
 
     return true;
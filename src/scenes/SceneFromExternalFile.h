@@ -41,5 +41,6 @@ namespace OmochiRenderer {
     std::string m_baseDir;
     std::string m_iblFileName;
     std::string m_spacePartitioningMethod;
+    bool m_useQBVHCache;
   };
 }
@@ -29,7 +29,7 @@ TestScene::TestScene()
 
   m_ibl.reset(new IBL("input_data/Barce_Rooftop_C_Env.hdr"));
  
-  Model *cube = new Model;
+  Model *cube = NewModel();
   //if (!cube->ReadFromObj("input_data/Cargo_ship/OBJ/msmunchen_visualstudio.obj", true)) {
   if (!cube->ReadFromObj("input_data/shrine.obj", true)) {
     std::cerr << "failed to load cube.obj!!!" << std::endl;
@@ -40,7 +40,7 @@ TestScene::TestScene()
   //cube->Transform(Vector3(50, 10, 50), Vector3(6, 6, 6), Matrix::RotateAroundVector(Vector3(0, 1, 0), 30.0 / 180 * PI));
   //cube->Transform(Vector3(50, 5, 70), Vector3(0.05, 0.05, 0.05), Matrix::RotateAroundVector(Vector3(0, 1, 0), 15.0 / 180 * PI));
   cube->Transform(Vector3(27, 16.5, 47), Vector3(2, 2, 2), Matrix::RotateAroundVector(Vector3(0, 1, 0), 0 / 180 * PI));
-  AddModel(cube, true, true);
+  AddModel(cube, true);
   
   //AddObject(new Sphere(10,Vector3(),           Material(Material::REFLECTION_TYPE_LAMBERT,    Color(), Color(0.25, 0.75, 0.25))));    // ΋
   //AddObject(new Sphere(16.5,Vector3(27, 16.5, 47),       Material(Material::REFLECTION_TYPE_SPECULAR,   Color(), Color(0.99, 0.99, 0.99))));   // 
@@ -48,11 +48,11 @@ TestScene::TestScene()
 
 
   //SphereLight *sphereLight = new SphereLight(7.5, Vector3(50.0, 72.5, 61.6), Material(Material::REFLECTION_TYPE_LAMBERT, Color(26, 26, 26), Color()));
-  SphereLight *sphereLight = new SphereLight(15, Vector3(50.0, 90, 81.6), Material(Material::REFLECTION_TYPE_LAMBERT, Color(36, 36, 36), Color()));
-  AddObject(sphereLight, true, false);    // Ɩ
+  SphereLight *sphereLight = NewObject<SphereLight>(15, Vector3(50.0, 90, 81.6), Material(Material::REFLECTION_TYPE_LAMBERT, Color(36, 36, 36), Color()));
+  AddObject(sphereLight, false);    // Ɩ
 
   //ConstructBVH();
-  ConstructQBVH();
+  ConstructOBVH();
 }
 
 }
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+namespace OmochiRenderer {
+
+// picks an index with the probability proportional to its weight in O(1) (Walker's alias method, built with Vose's algorithm).
+// the range [0, 1) of the random number is split into one column per index; the column of index i is taken by i below
+// its threshold and by its alias above it.
+class AliasTable {
+public:
+  AliasTable() : m_threshold(), m_alias(), m_probability(), m_totalWeight(0.0) {}
+  explicit AliasTable(const std::vector<double> &weights) { Build(weights); }
+
+  void Build(const std::vector<double> &weights) {
+    const size_t n = weights.size();
+    m_threshold.assign(n, 1.0);
+    m_alias.resize(n);
+    m_probability.assign(n, 0.0);
+    m_totalWeight = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      m_alias[i] = static_cast<int>(i);
+      m_totalWeight += std::max(weights[i], 0.0);
+    }
+    if (m_totalWeight <= 0.0) {
+      m_threshold.clear(); m_alias.clear(); m_probability.clear();
+      return;
+    }
+
+    // weights scaled so that the average is 1
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    for (size_t i = 0; i < n; i++) {
+      m_probability[i] = std::max(weights[i], 0.0) / m_totalWeight;
+      scaled[i] = m_probability[i] * n;
+      if (scaled[i] < 1.0) small.push_back(static_cast<int>(i));
+      else large.push_back(static_cast<int>(i));
+    }
+    // the rest of a small column is filled by a large one
+    while (!small.empty() && !large.empty()) {
+      const int s = small.back(); small.pop_back();
+      const int l = large.back();
+      m_threshold[s] = scaled[s];
+      m_alias[s] = l;
+      scaled[l] -= 1.0 - scaled[s];
+      if (scaled[l] < 1.0) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // the remaining columns are full (up to rounding errors) and keep threshold 1
+  }
+
+  // u in [0, 1). returns -1 if the table is empty or all the weights are 0
+  int Sample(double u) const {
+    if (m_threshold.empty()) return -1;
+    const int n = static_cast<int>(m_threshold.size());
+    const double scaled = u * n;
+    const int index = std::min(static_cast<int>(scaled), n - 1);
+    return (scaled - index) < m_threshold[index] ? index : m_alias[index];
+  }
+
+  double Probability(int index) const { return m_probability[index]; }
+  double GetTotalWeight() const { return m_totalWeight; }
+  size_t size() const { return m_probability.size(); }
+
+private:
+  std::vector<double> m_threshold;
+  std::vector<int> m_alias;
+  std::vector<double> m_probability;
+  double m_totalWeight;
+};
+
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <vector>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <malloc.h>
+
+namespace OmochiRenderer {
+
+// bump allocator. the objects are placed one after another in large blocks, in the order of allocation,
+// and all of them are destroyed and freed at once by Release (or the destructor).
+// a Scene owns one for its primitives and models. not thread safe: allocate while the scene is loaded
+class Arena {
+public:
+  static const size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+  static const size_t BLOCK_ALIGNMENT = 64;
+
+public:
+  explicit Arena(size_t blockSize = DEFAULT_BLOCK_SIZE)
+    : m_blockSize(blockSize)
+    , m_blocks()
+    , m_current(nullptr)
+    , m_remaining(0)
+    , m_allocatedBytes(0)
+    , m_destructors()
+  {
+  }
+  ~Arena() {
+    Release();
+  }
+
+  // constructs T in the arena. its destructor is called by Release, in the reverse order of construction
+  template <typename T, typename... Args>
+  T *New(Args&&... args) {
+    T *object = new(Allocate(sizeof(T), std::alignment_of<T>::value)) T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value) {
+      Destructor destructor = {object, &Destroy<T>};
+      m_destructors.push_back(destructor);
+    }
+    return object;
+  }
+
+  // raw memory, freed by Release. alignment must be a power of 2 up to BLOCK_ALIGNMENT
+  void *Allocate(size_t size, size_t alignment) {
+    size_t padding = (alignment - reinterpret_cast<size_t>(m_current) % alignment) % alignment;
+    if (m_current == nullptr || padding + size > m_remaining) {
+      // larger ones than a block get their own block
+      const size_t blockSize = size > m_blockSize ? size : m_blockSize;
+      char *block = static_cast<char *>(_aligned_malloc(blockSize, BLOCK_ALIGNMENT));
+      if (block == nullptr) throw std::bad_alloc();
+      m_blocks.push_back(block);
+      m_current = block;
+      m_remaining = blockSize;
+      padding = 0;
+    }
+    void *p = m_current + padding;
+    m_current += padding + size;
+    m_remaining -= padding + size;
+    m_allocatedBytes += size;
+    return p;
+  }
+
+  // destroys the objects and frees all the blocks
+  void Release() {
+    for (size_t i = m_destructors.size(); i > 0; i--) {
+      m_destructors[i-1].destroy(m_destructors[i-1].object);
+    }
+    m_destructors.clear();
+    for (size_t i = 0; i < m_blocks.size(); i++) {
+      _aligned_free(m_blocks[i]);
+    }
+    m_blocks.clear();
+    m_current = nullptr;
+    m_remaining = 0;
+    m_allocatedBytes = 0;
+  }
+
+  size_t GetAllocatedBytes() const { return m_allocatedBytes; }
+  size_t GetBlockCount() const { return m_blocks.size(); }
+
+private:
+  struct Destructor {
+    void *object;
+    void (*destroy)(void *);
+  };
+  template <typename T>
+  static void Destroy(void *object) {
+    static_cast<T *>(object)->~T();
+  }
+
+  Arena(const Arena &);
+  Arena &operator =(const Arena &);
+
+private:
+  size_t m_blockSize;
+  std::vector<char *> m_blocks;
+  char *m_current;
+  size_t m_remaining;
+  size_t m_allocatedBytes;
+  std::vector<Destructor> m_destructors;
+};
+
+}
@@ -0,0 +1,61 @@
+#include "stdafx.h"
+
+#include <Windows.h>
+
+#include "MappedFile.h"
+
+namespace OmochiRenderer {
+
+  MappedFile::MappedFile()
+    : m_file(INVALID_HANDLE_VALUE)
+    , m_mapping(NULL)
+    , m_data(NULL)
+    , m_size(0)
+  {
+  }
+
+  MappedFile::~MappedFile() {
+    Close();
+  }
+
+  bool MappedFile::Open(const std::string &file) {
+    Close();
+
+    m_file = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(m_file, &fileSize) || fileSize.QuadPart == 0 ||
+      static_cast<unsigned long long>(fileSize.QuadPart) > static_cast<size_t>(-1))
+    {
+      Close();
+      return false;
+    }
+
+    m_mapping = CreateFileMappingA(m_file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (m_mapping == NULL) {
+      Close();
+      return false;
+    }
+
+    m_data = static_cast<unsigned char *>(MapViewOfFile(m_mapping, FILE_MAP_COPY, 0, 0, 0));
+    if (m_data == NULL) {
+      Close();
+      return false;
+    }
+    m_size = static_cast<size_t>(fileSize.QuadPart);
+
+    return true;
+  }
+
+  void MappedFile::Close() {
+    if (m_data) UnmapViewOfFile(m_data);
+    if (m_mapping) CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+    m_mapping = NULL;
+    m_data = NULL;
+    m_size = 0;
+  }
+
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+
+namespace OmochiRenderer {
+
+  // maps a whole file into memory (copy-on-write: writes to the memory never go back to the file)
+  class MappedFile {
+  public:
+    explicit MappedFile();
+    ~MappedFile();
+
+    bool Open(const std::string &file);
+    void Close();
+
+    unsigned char *GetData() const { return m_data; }
+    size_t GetSize() const { return m_size; }
+
+  private:
+    MappedFile(const MappedFile &) {}
+    MappedFile &operator =(const MappedFile &) { return *this; }
+
+  private:
+    void *m_file;
+    void *m_mapping;
+    unsigned char *m_data;
+    size_t m_size;
+  };
+}
@@ -1,10 +1,12 @@
 #pragma once
 
 #include <climits>
+#include "Sampler.h"
 
 namespace OmochiRenderer {
 
-class Random {
+// xorshift. as a Sampler it is a plain stream of random numbers (StartSample does nothing)
+class Random : public Sampler {
 public:
   Random(const unsigned int seed) {
     unsigned int s = seed;
@@ -21,7 +23,10 @@ public:
 		return m_seed[3] = (m_seed[3] ^ (m_seed[3] >> 19)) ^ (t ^ (t >> 8)); 
   }
 
-  double nextDouble() const {
+  virtual void StartSample(unsigned int /*pixelIndex*/, unsigned int /*sampleIndex*/, unsigned int /*firstDimension*/ = 0) {
+  }
+
+  virtual double nextDouble() const {
     return static_cast<double>(next())/UINT_MAX;
   }
 
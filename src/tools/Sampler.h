@@ -0,0 +1,32 @@
+#pragma once
+
+namespace OmochiRenderer {
+
+// source of the values used to sample the camera, the lights and the BSDFs.
+// a sample (one path of a pixel) is a point in a high dimensional unit cube and nextDouble() returns its coordinates
+// one after another. quasi-Monte Carlo samplers give well stratified points when every sample uses the same dimension
+// for the same purpose, so the consumers take the values in a fixed order
+class Sampler {
+public:
+  enum SAMPLER_TYPE {
+    SAMPLER_TYPE_RANDOM,
+    SAMPLER_TYPE_SOBOL,
+  };
+
+public:
+  virtual ~Sampler() {}
+
+  // begins the sampleIndex-th sample of the pixel. the following values are its dimensions firstDimension, firstDimension+1, ...
+  virtual void StartSample(unsigned int pixelIndex, unsigned int sampleIndex, unsigned int firstDimension = 0) = 0;
+
+  // next dimension of the current sample: [0,1]
+  virtual double nextDouble() const = 0;
+
+  // next two dimensions, for 2D samples such as a point on a lens or on a light
+  virtual void next2D(double &u, double &v) const {
+    u = nextDouble();
+    v = nextDouble();
+  }
+};
+
+}
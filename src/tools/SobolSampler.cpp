@@ -0,0 +1,86 @@
+#include "stdafx.h"
+
+#include "SobolSampler.h"
+
+namespace OmochiRenderer {
+
+namespace {
+  inline unsigned int ReverseBits(unsigned int x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+  }
+
+  inline double ToUnitInterval(unsigned int x) {
+    return x * (1.0 / 4294967296.0);
+  }
+}
+
+SobolSampler::SobolSampler(unsigned int seed)
+  : m_seed(Hash(seed))
+  , m_pixelSeed(0)
+  , m_sampleIndex(0)
+  , m_dimension(0)
+{
+}
+
+void SobolSampler::StartSample(unsigned int pixelIndex, unsigned int sampleIndex, unsigned int firstDimension) {
+  m_pixelSeed = Hash(pixelIndex ^ m_seed);
+  m_sampleIndex = sampleIndex;
+  m_dimension = firstDimension;
+}
+
+double SobolSampler::nextDouble() const {
+  return ToUnitInterval(SampleDimension(m_dimension++));
+}
+
+void SobolSampler::next2D(double &u, double &v) const {
+  m_dimension = (m_dimension + 1) & ~1u;
+  u = ToUnitInterval(SampleDimension(m_dimension));
+  v = ToUnitInterval(SampleDimension(m_dimension + 1));
+  m_dimension += 2;
+}
+
+unsigned int SobolSampler::SampleDimension(unsigned int dimension) const {
+  const unsigned int pairSeed = Hash(m_pixelSeed ^ Hash(dimension / 2));
+  const unsigned int shuffledIndex = NestedUniformScramble(m_sampleIndex, pairSeed);
+  const unsigned int component = dimension & 1;
+  return NestedUniformScramble(SobolSample(shuffledIndex, component), Hash(pairSeed + component + 1));
+}
+
+// dimension 0 is the van der Corput sequence, dimension 1 uses the primitive polynomial x+1 (all the m_i are 1)
+unsigned int SobolSampler::SobolSample(unsigned int index, unsigned int dimension) {
+  if (dimension == 0) {
+    return ReverseBits(index);
+  }
+
+  unsigned int result = 0;
+  for (unsigned int v = 0x80000000u; index != 0; index >>= 1, v ^= v >> 1) {
+    if (index & 1) result ^= v;
+  }
+  return result;
+}
+
+unsigned int SobolSampler::Hash(unsigned int x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+// Owen scrambling: each digit is flipped depending on the digits above it (Laine-Karras permutation on the reversed bits)
+unsigned int SobolSampler::NestedUniformScramble(unsigned int x, unsigned int seed) {
+  x = ReverseBits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return ReverseBits(x);
+}
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "Sampler.h"
+
+namespace OmochiRenderer {
+
+// Owen-scrambled Sobol sampler, padded by pairs of dimensions (Burley, "Practical Hash-based Owen Scrambling", 2020).
+// dimensions 2k and 2k+1 of a sample are the first two Sobol dimensions at a shuffled sample index. the shuffle and
+// the scramble are hashed from the pixel and k, so every pair is a well stratified 2D point set in every pixel while
+// the pairs (and the pixels) are decorrelated from each other. any number of dimensions is available
+class SobolSampler : public Sampler {
+public:
+  explicit SobolSampler(unsigned int seed = 0);
+
+  virtual void StartSample(unsigned int pixelIndex, unsigned int sampleIndex, unsigned int firstDimension = 0);
+
+  virtual double nextDouble() const;
+  // takes a whole pair (skipping the unused half of the current one) so that the two values come from the same 2D point set
+  virtual void next2D(double &u, double &v) const;
+
+  // the index-th point of Sobol dimension 0 or 1, as a 32 bit fixed point fraction (no scrambling)
+  static unsigned int SobolSample(unsigned int index, unsigned int dimension);
+
+private:
+  unsigned int SampleDimension(unsigned int dimension) const;
+
+  static unsigned int Hash(unsigned int x);
+  static unsigned int NestedUniformScramble(unsigned int x, unsigned int seed);
+
+private:
+  unsigned int m_seed;
+  unsigned int m_pixelSeed;
+  unsigned int m_sampleIndex;
+  mutable unsigned int m_dimension;
+};
+
+}
@@ -0,0 +1,148 @@
+#include "stdafx.h"
+
+#include "TileScheduler.h"
+
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+namespace OmochiRenderer {
+
+TileScheduler::TileScheduler(int imageWidth, int imageHeight, int tileSize, TILE_ORDER order, bool centerOut)
+  : m_tiles()
+{
+  if (tileSize <= 0) tileSize = DEFAULT_TILE_SIZE;
+
+  const int tilesX = (imageWidth + tileSize - 1) / tileSize;
+  const int tilesY = (imageHeight + tileSize - 1) / tileSize;
+
+  unsigned int curveSize = 1;
+  while (curveSize < static_cast<unsigned int>(std::max(tilesX, tilesY))) curveSize *= 2;
+
+  // (ring, curve index) of each tile
+  vector<pair<pair<int, unsigned int>, Tile> > keyedTiles;
+  keyedTiles.reserve(tilesX * tilesY);
+  const double centerX = 0.5 * (tilesX - 1), centerY = 0.5 * (tilesY - 1);
+  for (int ty = 0; ty < tilesY; ty++) {
+    for (int tx = 0; tx < tilesX; tx++) {
+      Tile tile;
+      tile.x = tx * tileSize;
+      tile.y = ty * tileSize;
+      tile.width = std::min(tileSize, imageWidth - tile.x);
+      tile.height = std::min(tileSize, imageHeight - tile.y);
+      tile.index = 0;
+
+      unsigned int curveIndex = 0;
+      switch (order) {
+      case TILE_ORDER_SCANLINE: curveIndex = ty * tilesX + tx; break;
+      case TILE_ORDER_MORTON: curveIndex = MortonIndex(tx, ty); break;
+      case TILE_ORDER_HILBERT: curveIndex = HilbertIndex(curveSize, tx, ty); break;
+      }
+      int ring = 0;
+      if (centerOut) {
+        ring = static_cast<int>(std::max(fabs(tx - centerX), fabs(ty - centerY))) / CENTER_OUT_RING_WIDTH;
+      }
+      keyedTiles.push_back(make_pair(make_pair(ring, curveIndex), tile));
+    }
+  }
+
+  stable_sort(keyedTiles.begin(), keyedTiles.end(),
+    [](const pair<pair<int, unsigned int>, Tile> &a, const pair<pair<int, unsigned int>, Tile> &b) {
+      return a.first < b.first;
+    });
+
+  m_tiles.reserve(keyedTiles.size());
+  for (size_t i = 0; i < keyedTiles.size(); i++) {
+    m_tiles.push_back(keyedTiles[i].second);
+    m_tiles.back().index = static_cast<int>(i);
+  }
+}
+
+void TileScheduler::Run(int workerCount, const std::function<void(const Tile &tile)> &processTile) const {
+  if (m_tiles.empty()) return;
+  workerCount = std::max(1, std::min(workerCount, static_cast<int>(m_tiles.size())));
+
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<int> tiles;
+  };
+  unique_ptr<WorkerQueue[]> queues(new WorkerQueue[workerCount]);
+  for (size_t i = 0; i < m_tiles.size(); i++) {
+    queues[i % workerCount].tiles.push_back(static_cast<int>(i));
+  }
+
+  auto worker = [this, &queues, &processTile, workerCount](int self) {
+    for (;;) {
+      int tileIndex = -1;
+      {
+        lock_guard<mutex> lock(queues[self].mutex);
+        if (!queues[self].tiles.empty()) {
+          tileIndex = queues[self].tiles.front();
+          queues[self].tiles.pop_front();
+        }
+      }
+      // steal. no tile is added after the start, so the work is finished when every deque is empty
+      for (int i = 1; tileIndex < 0 && i < workerCount; i++) {
+        WorkerQueue &victim = queues[(self + i) % workerCount];
+        lock_guard<mutex> lock(victim.mutex);
+        if (!victim.tiles.empty()) {
+          tileIndex = victim.tiles.back();
+          victim.tiles.pop_back();
+        }
+      }
+      if (tileIndex < 0) return;
+
+      processTile(m_tiles[tileIndex]);
+    }
+  };
+
+  vector<thread> threads;
+  for (int i = 1; i < workerCount; i++) {
+    threads.push_back(thread(worker, i));
+  }
+  worker(0);
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+}
+
+TileScheduler::TILE_ORDER TileScheduler::ParseTileOrder(const std::string &str, TILE_ORDER defaultOrder) {
+  const string lower(Utils::tolower(Utils::trim(str)));
+  if (lower == "scanline") return TILE_ORDER_SCANLINE;
+  if (lower == "morton") return TILE_ORDER_MORTON;
+  if (lower == "hilbert") return TILE_ORDER_HILBERT;
+  return defaultOrder;
+}
+
+// interleaves the bits of x and y
+unsigned int TileScheduler::MortonIndex(unsigned int x, unsigned int y) {
+  unsigned int index = 0;
+  for (int bit = 0; bit < 16; bit++) {
+    index |= ((x >> bit) & 1) << (2 * bit);
+    index |= ((y >> bit) & 1) << (2 * bit + 1);
+  }
+  return index;
+}
+
+// distance along the Hilbert curve filling an n x n grid (n is a power of 2)
+unsigned int TileScheduler::HilbertIndex(unsigned int n, unsigned int x, unsigned int y) {
+  unsigned int index = 0;
+  for (unsigned int s = n / 2; s > 0; s /= 2) {
+    const unsigned int rx = (x & s) > 0 ? 1 : 0;
+    const unsigned int ry = (y & s) > 0 ? 1 : 0;
+    index += s * s * ((3 * rx) ^ ry);
+    // rotate the quadrant
+    if (ry == 0) {
+      if (rx == 1) {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return index;
+}
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <functional>
+
+namespace OmochiRenderer {
+
+  // splits an image into square tiles and processes them on worker threads.
+  // the tiles are dealt round-robin to per-worker deques in serving order; a worker takes its next tile from the front of
+  // its own deque and, when that is empty, steals from the back (the least urgent tile) of another worker's deque.
+  class TileScheduler {
+  public:
+    // order of the tiles on the tile grid. space filling curves keep consecutive tiles next to each other
+    enum TILE_ORDER {
+      TILE_ORDER_SCANLINE,
+      TILE_ORDER_MORTON,
+      TILE_ORDER_HILBERT,
+    };
+
+    struct Tile {
+      int x, y;           // upper left pixel
+      int width, height;
+      int index;          // position in the serving order
+    };
+
+    static const int DEFAULT_TILE_SIZE = 32;
+    // with centerOut, the tiles are served in square rings of this many tiles around the image center
+    static const int CENTER_OUT_RING_WIDTH = 2;
+
+  public:
+    TileScheduler(int imageWidth, int imageHeight, int tileSize = DEFAULT_TILE_SIZE, TILE_ORDER order = TILE_ORDER_HILBERT, bool centerOut = true);
+
+    // tiles in serving order
+    const std::vector<Tile> &GetTiles() const { return m_tiles; }
+
+    // calls processTile for every tile on workerCount threads (the calling thread is one of them) and returns when all are done.
+    // processTile is called concurrently
+    void Run(int workerCount, const std::function<void(const Tile &tile)> &processTile) const;
+
+    // "scanline", "morton" or "hilbert". returns defaultOrder for anything else
+    static TILE_ORDER ParseTileOrder(const std::string &str, TILE_ORDER defaultOrder = TILE_ORDER_HILBERT);
+
+  private:
+    static unsigned int MortonIndex(unsigned int x, unsigned int y);
+    static unsigned int HilbertIndex(unsigned int n, unsigned int x, unsigned int y);
+
+  private:
+    std::vector<Tile> m_tiles;
+  };
+
+}
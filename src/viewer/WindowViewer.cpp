@@ -3,7 +3,7 @@
 #include "WindowViewer.h"
 #include "renderer/Camera.h"
 #include "renderer/ToonMapper.h"
-#include "renderer/PathTracer.h"
+#include "renderer/Renderer.h"
 #include "GLUtils.h"
 
 #include <Windows.h>
@@ -427,7 +427,7 @@ namespace OmochiRenderer {
   WindowViewer::WindowViewer(
     const std::string &windowTitle,
     const Camera &camera, 
-    const PathTracer &renderer,
+    const Renderer &renderer,
     const ToonMapper &mapper, 
     const size_t refreshSpanInMsec)
     : m_windowTitle(windowTitle)
@@ -8,14 +8,14 @@
 namespace OmochiRenderer {
 
   class Camera;
-  class PathTracer;
+  class Renderer;
   class ToonMapper;
 
   class WindowViewer {
   public:
     explicit WindowViewer(const std::string &windowTitle,
       const Camera &camera,
-      const PathTracer &renderer,
+      const Renderer &renderer,
       const ToonMapper &mapper,
       const size_t refreshSpanInMsec = 1500);
     virtual ~WindowViewer();
@@ -35,7 +35,7 @@ namespace OmochiRenderer {
   private:
     std::string m_windowTitle;
     const Camera &m_camera;
-    const PathTracer &m_renderer;
+    const Renderer &m_renderer;
     const ToonMapper &m_mapper;
 
     std::shared_ptr<std::thread> m_windowThread;